@@ -0,0 +1,355 @@
+/*
+ * Uploads that run on the transfer queue while the graphics queue keeps rendering.
+ *
+ * Many GPUs have a queue family that can only copy (the DMA engines). Copies
+ * submitted there run alongside rendering, where a copy on the graphics queue waits
+ * its turn between draws. AsyncUploader gives every upload its own staging buffer,
+ * command buffer, fence and semaphore, and submits it to the transfer queue straight
+ * away. The render thread never waits on it:
+ *
+ *   upload...()    staging copy + vkCmdCopy* + release barrier, submitted to the
+ *                  transfer queue, signalling the upload's semaphore and fence
+ *   handOver()     once per frame: for every upload whose fence has signalled, the
+ *                  matching acquire barrier goes into the frame's command buffer and
+ *                  the semaphore into its wait list. Commands submitted after that
+ *                  can use the resource
+ *   beginFrame()   that frame's fence has signalled again, so its semaphores can be
+ *                  reused
+ *
+ * Resources are created VK_SHARING_MODE_EXCLUSIVE, so the transfer family owns them
+ * while copying and the graphics family owns them afterwards. Release (on transfer)
+ * and acquire (on graphics) barriers with the same queue family indices and layouts
+ * move them across; an image's layout transition happens as part of that pair. When
+ * the device has no separate transfer family, the uploader submits to the graphics
+ * queue and an ordinary barrier does the job.
+ *
+ * Not thread safe: upload, poll and hand over from the render thread.
+ */
+#pragma once
+
+#include "gpuAllocator.h"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+using UploadTicket = uint64_t; //0 is never a valid ticket
+
+class AsyncUploader {
+public:
+  void init(VkDevice logicalDevice, GpuAllocator& gpuAllocator, VkQueue queue, uint32_t queueFamily,
+            uint32_t graphicsQueueFamily, uint32_t frameCount, const VkAllocationCallbacks* hostCallbacks = nullptr) {
+    device = logicalDevice;
+    callbacks = hostCallbacks;
+    allocator = &gpuAllocator;
+    transferQueue = queue;
+    transferFamily = queueFamily;
+    graphicsFamily = graphicsQueueFamily;
+    frameSemaphores.assign(frameCount, {});
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = transferFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; //every command buffer is recorded once, submitted once, freed
+    if (vkCreateCommandPool(device, &poolInfo, callbacks, &commandPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create transfer command pool!");
+    }
+  }
+
+  //the device must be idle (or at least the transfer queue and every frame that waited on an upload)
+  void destroy() {
+    for (auto& upload : transfers) {
+      release(upload);
+      freeSemaphores.push_back(upload.semaphore);
+    }
+    transfers.clear();
+    for (auto& upload : finished) {
+      release(upload);
+      freeSemaphores.push_back(upload.semaphore);
+    }
+    finished.clear();
+    for (auto& semaphores : frameSemaphores) {
+      freeSemaphores.insert(freeSemaphores.end(), semaphores.begin(), semaphores.end());
+      semaphores.clear();
+    }
+    for (VkSemaphore semaphore : freeSemaphores) {
+      vkDestroySemaphore(device, semaphore, callbacks);
+    }
+    freeSemaphores.clear();
+    for (VkFence fence : freeFences) {
+      vkDestroyFence(device, fence, callbacks);
+    }
+    freeFences.clear();
+    if (commandPool != VK_NULL_HANDLE) {
+      vkDestroyCommandPool(device, commandPool, callbacks);
+      commandPool = VK_NULL_HANDLE;
+    }
+  }
+
+  //true when copies really run on their own queue family rather than on the graphics queue
+  bool dedicated() const { return transferFamily != graphicsFamily; }
+
+  //dstStage/dstAccess: how the graphics queue will first use the buffer, e.g. vertex input / vertex attribute read
+  UploadTicket uploadBuffer(VkBuffer buffer, VkDeviceSize offset, const void* data, VkDeviceSize size,
+                            VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    Upload upload = begin(data, size, dstStage, dstAccess);
+    VkBufferCopy copy = {0, offset, size};
+    vkCmdCopyBuffer(upload.commandBuffer, upload.staging, buffer, 1, &copy);
+    upload.bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    upload.bufferBarrier.buffer = buffer;
+    upload.bufferBarrier.offset = offset;
+    upload.bufferBarrier.size = size;
+    recordRelease(upload);
+    return submit(upload);
+  }
+
+  //whole image, one mip level and layer, tightly packed data. It ends up in finalLayout, owned by the graphics family
+  UploadTicket uploadImage(VkImage image, VkImageAspectFlags aspect, VkExtent3D extent, VkImageLayout finalLayout,
+                           const void* data, VkDeviceSize size, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    Upload upload = begin(data, size, dstStage, dstAccess);
+    VkImageMemoryBarrier toTransfer = {};
+    toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    toTransfer.srcAccessMask = 0;
+    toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    toTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    toTransfer.image = image;
+    toTransfer.subresourceRange = {aspect, 0, 1, 0, 1};
+    vkCmdPipelineBarrier(upload.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &toTransfer);
+    VkBufferImageCopy copy = {};
+    copy.imageSubresource = {aspect, 0, 0, 1};
+    copy.imageExtent = extent;
+    vkCmdCopyBufferToImage(upload.commandBuffer, upload.staging, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+    upload.isImage = true;
+    upload.imageBarrier = toTransfer;
+    upload.imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    upload.imageBarrier.newLayout = finalLayout;
+    recordRelease(upload);
+    return submit(upload);
+  }
+
+  //non-blocking: true if some transfer finished and is waiting for handOver()
+  bool hasFinishedTransfers() {
+    poll();
+    return !finished.empty();
+  }
+
+  /*
+    Acquire barriers for every finished transfer go into commandBuffer (recorded on
+    the graphics family, submitted before anything that uses the resources) and their
+    semaphores into the submit's wait list. frame is the frame in flight that submit
+    belongs to. Returns how many uploads were handed over.
+  */
+  size_t handOver(VkCommandBuffer commandBuffer, uint32_t frame, std::vector<VkSemaphore>& waitSemaphores,
+                  std::vector<VkPipelineStageFlags>& waitStages) {
+    poll();
+    size_t count = finished.size();
+    for (auto& upload : finished) {
+      if (dedicated()) {
+        //same barrier as the release, with the access masks of this side. srcStage is the semaphore's wait stage, so it runs after the wait
+        VkAccessFlags dstAccess = upload.dstAccess;
+        if (upload.isImage) {
+          upload.imageBarrier.srcAccessMask = 0;
+          upload.imageBarrier.dstAccessMask = dstAccess;
+          vkCmdPipelineBarrier(commandBuffer, upload.dstStage, upload.dstStage, 0, 0, nullptr, 0, nullptr, 1, &upload.imageBarrier);
+        } else {
+          upload.bufferBarrier.srcAccessMask = 0;
+          upload.bufferBarrier.dstAccessMask = dstAccess;
+          vkCmdPipelineBarrier(commandBuffer, upload.dstStage, upload.dstStage, 0, 0, nullptr, 1, &upload.bufferBarrier, 0, nullptr);
+        }
+      }
+      waitSemaphores.push_back(upload.semaphore);
+      waitStages.push_back(upload.dstStage);
+      frameSemaphores[frame].push_back(upload.semaphore);
+      waiting.erase(upload.ticket);
+    }
+    finished.clear();
+    return count;
+  }
+
+  //the frame's fence has signalled, so the submit that waited on these semaphores is done with them
+  void beginFrame(uint32_t frame) {
+    freeSemaphores.insert(freeSemaphores.end(), frameSemaphores[frame].begin(), frameSemaphores[frame].end());
+    frameSemaphores[frame].clear();
+  }
+
+  //handed over: usable by graphics commands submitted after the handOver() that included it
+  bool ready(UploadTicket ticket) const { return ticket != 0 && ticket < nextTicket && !waiting.count(ticket); }
+
+  size_t inFlight() const { return waiting.size(); }
+  uint64_t bytesUploaded() const { return uploadedBytes; }
+
+private:
+  struct Upload {
+    UploadTicket ticket = 0;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    VkBuffer staging = VK_NULL_HANDLE;
+    GpuAllocation stagingAllocation;
+    VkPipelineStageFlags dstStage = 0;
+    VkAccessFlags dstAccess = 0;
+    bool isImage = false;
+    VkBufferMemoryBarrier bufferBarrier = {};
+    VkImageMemoryBarrier imageBarrier = {};
+  };
+
+  //staging buffer with the data in it, and a command buffer that has begun recording
+  Upload begin(const void* data, VkDeviceSize size, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    Upload upload;
+    upload.dstStage = dstStage;
+    upload.dstAccess = dstAccess;
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    upload.stagingAllocation = allocator->createBuffer(bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, upload.staging,
+                                                         GpuMemoryCategory::Staging);
+    std::memcpy(upload.stagingAllocation.mapped, data, size);
+    uploadedBytes += size;
+
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    if (vkAllocateCommandBuffers(device, &allocInfo, &upload.commandBuffer) != VK_SUCCESS) {
+      allocator->destroyBuffer(upload.staging, upload.stagingAllocation);
+      throw std::runtime_error("failed to allocate transfer command buffer!");
+    }
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(upload.commandBuffer, &beginInfo);
+    return upload;
+  }
+
+  //on a separate family: the release half of the ownership transfer. Otherwise the whole dependency
+  void recordRelease(Upload& upload) {
+    uint32_t srcFamily = dedicated() ? transferFamily : VK_QUEUE_FAMILY_IGNORED;
+    uint32_t dstFamily = dedicated() ? graphicsFamily : VK_QUEUE_FAMILY_IGNORED;
+    //a release's dstAccessMask is ignored; the acquire in handOver() makes the writes visible
+    VkAccessFlags dstAccess = dedicated() ? 0 : upload.dstAccess;
+    VkPipelineStageFlags dstStage = dedicated() ? static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT) : upload.dstStage;
+    if (upload.isImage) {
+      upload.imageBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      upload.imageBarrier.dstAccessMask = dstAccess;
+      upload.imageBarrier.srcQueueFamilyIndex = srcFamily;
+      upload.imageBarrier.dstQueueFamilyIndex = dstFamily;
+      vkCmdPipelineBarrier(upload.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &upload.imageBarrier);
+    } else {
+      upload.bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      upload.bufferBarrier.dstAccessMask = dstAccess;
+      upload.bufferBarrier.srcQueueFamilyIndex = srcFamily;
+      upload.bufferBarrier.dstQueueFamilyIndex = dstFamily;
+      vkCmdPipelineBarrier(upload.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 1, &upload.bufferBarrier, 0, nullptr);
+    }
+  }
+
+  UploadTicket submit(Upload& upload) {
+    if (vkEndCommandBuffer(upload.commandBuffer) != VK_SUCCESS) {
+      release(upload);
+      throw std::runtime_error("failed to record transfer command buffer!");
+    }
+    upload.fence = takeFence();
+    upload.semaphore = takeSemaphore();
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &upload.commandBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &upload.semaphore;
+    if (vkQueueSubmit(transferQueue, 1, &submitInfo, upload.fence) != VK_SUCCESS) {
+      freeSemaphores.push_back(upload.semaphore);
+      release(upload);
+      throw std::runtime_error("failed to submit transfer command buffer!");
+    }
+    upload.ticket = nextTicket++;
+    waiting.insert(upload.ticket);
+    transfers.push_back(upload);
+    return upload.ticket;
+  }
+
+  //moves transfers whose fence has signalled to finished, freeing what only the transfer needed
+  void poll() {
+    for (auto it = transfers.begin(); it != transfers.end();) {
+      if (vkGetFenceStatus(device, it->fence) != VK_SUCCESS) {
+        ++it;
+        continue;
+      }
+      release(*it);
+      finished.push_back(*it);
+      it = transfers.erase(it);
+    }
+  }
+
+  //staging buffer, command buffer and fence. The semaphore lives on until the graphics side is done with it
+  void release(Upload& upload) {
+    if (upload.staging != VK_NULL_HANDLE) {
+      allocator->destroyBuffer(upload.staging, upload.stagingAllocation);
+    }
+    if (upload.commandBuffer != VK_NULL_HANDLE) {
+      vkFreeCommandBuffers(device, commandPool, 1, &upload.commandBuffer);
+      upload.commandBuffer = VK_NULL_HANDLE;
+    }
+    if (upload.fence != VK_NULL_HANDLE) {
+      vkResetFences(device, 1, &upload.fence);
+      freeFences.push_back(upload.fence);
+      upload.fence = VK_NULL_HANDLE;
+    }
+  }
+
+  VkFence takeFence() {
+    if (!freeFences.empty()) {
+      VkFence fence = freeFences.back();
+      freeFences.pop_back();
+      return fence;
+    }
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence;
+    if (vkCreateFence(device, &fenceInfo, callbacks, &fence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create transfer fence!");
+    }
+    return fence;
+  }
+
+  VkSemaphore takeSemaphore() {
+    if (!freeSemaphores.empty()) {
+      VkSemaphore semaphore = freeSemaphores.back();
+      freeSemaphores.pop_back();
+      return semaphore;
+    }
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VkSemaphore semaphore;
+    if (vkCreateSemaphore(device, &semaphoreInfo, callbacks, &semaphore) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create transfer semaphore!");
+    }
+    return semaphore;
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  const VkAllocationCallbacks* callbacks = nullptr;
+  GpuAllocator* allocator = nullptr;
+  VkQueue transferQueue = VK_NULL_HANDLE;
+  uint32_t transferFamily = 0;
+  uint32_t graphicsFamily = 0;
+  VkCommandPool commandPool = VK_NULL_HANDLE;
+  std::deque<Upload> transfers; //submitted, fence not signalled yet
+  std::vector<Upload> finished; //copied, waiting for handOver()
+  std::vector<std::vector<VkSemaphore>> frameSemaphores; //waited on by each frame in flight's last submit
+  std::vector<VkSemaphore> freeSemaphores;
+  std::vector<VkFence> freeFences;
+  std::set<UploadTicket> waiting; //not handed over yet
+  UploadTicket nextTicket = 1;
+  uint64_t uploadedBytes = 0;
+};
@@ -0,0 +1,233 @@
+/*
+ * Per-frame command recording spread over worker threads. Recording a command
+ * buffer is CPU work that grows with the number of draws, and a single thread
+ * recording thousands of them every frame becomes the frame's critical path.
+ *
+ * ParallelRecorder splits a frame's draw list into contiguous ranges, one per
+ * thread (the calling thread records the first). Each thread records its range into
+ * a secondary command buffer, and the caller executes the secondaries in order
+ * inside its primary's render pass, so the result draws exactly like one thread
+ * recording the whole list.
+ *
+ * Command pools are externally synchronized, so thread i records from the frame's
+ * pool i in FrameContexts (see frameContext.h), which also resets them when the
+ * frame comes round again. Small draw lists stay on fewer threads
+ * (RECORD_MIN_DRAWS_PER_THREAD each), since waking a thread costs more than
+ * recording a handful of draws.
+ */
+#pragma once
+
+#include "frameContext.h"
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+const size_t RECORD_MIN_DRAWS_PER_THREAD = 64;
+const unsigned RECORD_MAX_THREADS = 8;
+
+//one per core, including the render thread, up to RECORD_MAX_THREADS
+inline unsigned defaultRecordThreadCount() {
+  return std::min(RECORD_MAX_THREADS, std::max(1u, std::thread::hardware_concurrency()));
+}
+
+struct DrawCommand {
+  VkBuffer vertexBuffer = VK_NULL_HANDLE;
+  VkDeviceSize vertexOffset = 0; //binding offset
+  uint32_t firstVertex = 0;
+  uint32_t vertexCount = 0;
+  VkBuffer instanceBuffer = VK_NULL_HANDLE; //per-instance binding, VK_NULL_HANDLE for none
+  VkDeviceSize instanceOffset = 0;
+  uint32_t firstInstance = 0;
+  uint32_t instanceCount = 1;
+  VkBuffer indexBuffer = VK_NULL_HANDLE; //VK_NULL_HANDLE to draw the vertices in order
+  VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+  uint32_t firstIndex = 0;
+  uint32_t indexCount = 0; //with indexBuffer, instead of firstVertex/vertexCount
+  VkBuffer indirectBuffer = VK_NULL_HANDLE; //VkDrawIndexedIndirectCommands to draw instead of the counts above
+  VkDeviceSize indirectOffset = 0;
+  uint32_t maxDrawCount = 0;
+  VkBuffer countBuffer = VK_NULL_HANDLE; //how many of them, read by the GPU; VK_NULL_HANDLE for all maxDrawCount
+  VkDeviceSize countOffset = 0;
+};
+
+class ParallelRecorder {
+public:
+  //records draws [begin, end) into a secondary that has already begun; called on several threads at once
+  using RecordFunction = std::function<void(VkCommandBuffer commandBuffer, size_t begin, size_t end)>;
+
+  ParallelRecorder() = default;
+  ParallelRecorder(const ParallelRecorder&) = delete;
+  ParallelRecorder& operator=(const ParallelRecorder&) = delete;
+  ~ParallelRecorder() { stopWorkers(); }
+
+  //one thread per pool the frame contexts have, the calling thread included
+  void init(FrameContexts& frameContexts) {
+    contexts = &frameContexts;
+    threadTotal = frameContexts.threadCount();
+    for (unsigned i = 1; i < threadTotal; i++) {
+      workers.emplace_back(&ParallelRecorder::work, this, i);
+    }
+  }
+
+  void destroy() { stopWorkers(); }
+
+  /*
+    Records [0, drawCount) through record, split across threads. Returns the
+    secondaries in draw order, for vkCmdExecuteCommands inside a render pass begun
+    with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS. inheritance names that render
+    pass, subpass and framebuffer. Secondaries inherit no dynamic state or bindings,
+    so record has to set viewport, scissor, pipeline and buffers itself.
+  */
+  const std::vector<VkCommandBuffer>& record(const VkCommandBufferInheritanceInfo& inheritance, size_t drawCount,
+                                             const RecordFunction& record) {
+    auto start = std::chrono::steady_clock::now();
+    recorded.clear();
+    if (drawCount == 0) {
+      return recorded;
+    }
+    size_t jobCount = std::min<size_t>(threadTotal, (drawCount + RECORD_MIN_DRAWS_PER_THREAD - 1) / RECORD_MIN_DRAWS_PER_THREAD);
+    jobCount = std::max<size_t>(jobCount, 1);
+    recorded.assign(jobCount, VK_NULL_HANDLE);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job.inheritance = &inheritance;
+      job.record = &record;
+      job.drawCount = drawCount;
+      job.jobCount = jobCount;
+      job.remaining = jobCount - 1;
+      job.error = nullptr;
+      generation++;
+    }
+    if (jobCount > 1) {
+      wake.notify_all();
+    }
+    std::exception_ptr error;
+    try {
+      recordJob(0);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [this] { return job.remaining == 0; });
+      if (!error) {
+        error = job.error;
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    totalRecordMs += ms;
+    recordCount++;
+    threadsUsed = std::max(threadsUsed, jobCount);
+    return recorded;
+  }
+
+  unsigned threadCount() const { return threadTotal; }
+  size_t maxThreadsUsed() const { return threadsUsed; }
+  double averageRecordMs() const { return recordCount ? totalRecordMs / recordCount : 0.0; } //wall time of record(), all threads
+  //start averaging afresh, e.g. between benchmark runs
+  void resetStats() {
+    totalRecordMs = 0.0;
+    recordCount = 0;
+    threadsUsed = 0;
+  }
+
+private:
+  struct Job {
+    const VkCommandBufferInheritanceInfo* inheritance = nullptr;
+    const RecordFunction* record = nullptr;
+    size_t drawCount = 0;
+    size_t jobCount = 0;
+    size_t remaining = 0; //worker jobs not finished yet
+    std::exception_ptr error; //first worker failure
+  };
+
+  void work(unsigned index) {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = generation;
+        if (index >= job.jobCount) {
+          continue; //not needed for this one
+        }
+      }
+      std::exception_ptr error;
+      try {
+        recordJob(index);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error && !job.error) {
+          job.error = error;
+        }
+        job.remaining--;
+      }
+      finished.notify_one();
+    }
+  }
+
+  //runs on thread index, with that thread's pool only
+  void recordJob(size_t index) {
+    size_t begin = job.drawCount * index / job.jobCount;
+    size_t end = job.drawCount * (index + 1) / job.jobCount;
+    VkCommandBuffer commandBuffer = contexts->commandBuffer(VK_COMMAND_BUFFER_LEVEL_SECONDARY, static_cast<unsigned>(index));
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = job.inheritance;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error("failed to begin recording secondary command buffer!");
+    }
+    (*job.record)(commandBuffer, begin, end);
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record secondary command buffer!");
+    }
+    recorded[index] = commandBuffer; //each thread writes its own slot
+  }
+
+  void stopWorkers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+    workers.clear();
+  }
+
+  FrameContexts* contexts = nullptr;
+  unsigned threadTotal = 1; //workers plus the calling thread
+  std::vector<std::thread> workers; //workers[i - 1] records job i; the calling thread records job 0
+  std::mutex mutex; //guards job, generation, stopping
+  std::condition_variable wake;
+  std::condition_variable finished;
+  Job job;
+  uint64_t generation = 0; //bumped per record() call
+  bool stopping = false;
+  std::vector<VkCommandBuffer> recorded; //per job, in draw order
+  double totalRecordMs = 0.0;
+  uint64_t recordCount = 0;
+  size_t threadsUsed = 0;
+};
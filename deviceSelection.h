@@ -0,0 +1,307 @@
+/*
+ * Physical device ranking, and a cache of what it took to rank them.
+ *
+ * Machines with more than one adapter (a discrete GPU next to an integrated one,
+ * or a software rasterizer like lavapipe/SwiftShader) enumerate them in no useful
+ * order, so taking the first suitable device often picks the slow one. Instead every
+ * device is probed once for the things that decide how fast it will be for us:
+ * device type, the size of its device-local memory, whether it has queue families
+ * dedicated to transfer or compute (async uploads and compute work that doesn't
+ * queue up behind graphics), and a few limits. scorePhysicalDevice() turns a probe
+ * into one number, highest wins.
+ *
+ * None of that depends on the window surface and it only changes when the driver
+ * does, so probes are saved to a small file keyed by vendor, device, driver version
+ * and pipeline cache UUID. Later launches rank from the file and skip extension,
+ * memory and queue family enumeration for every device the driver hasn't changed.
+ * Present support is surface specific and is still checked live, see main.cpp.
+ */
+#pragma once
+
+#include "shaderCache.h" //fnv1a64
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+const uint32_t DEVICE_PROBE_CACHE_MAGIC = 0x42525044; //"DPRB"
+const uint32_t DEVICE_PROBE_CACHE_VERSION = 3; //bump when DeviceProbe changes
+const uint32_t NO_QUEUE_FAMILY = UINT32_MAX;
+
+//everything ranking needs that doesn't depend on the surface. Plain data so the cache can write it as is
+struct DeviceProbe {
+  //identity, the cache key
+  uint32_t vendorID;
+  uint32_t deviceID;
+  uint32_t driverVersion;
+  uint32_t apiVersion;
+  uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+  uint64_t requiredExtensionsHash; //of the extension list checked, so a new requirement re-probes
+  //capabilities
+  char deviceName[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE];
+  uint32_t deviceType; //VkPhysicalDeviceType
+  uint32_t extensionsSupported; //all required extensions present
+  uint32_t memoryBudgetSupported; //VK_EXT_memory_budget, optional (see memoryTelemetry.h)
+  uint32_t drawIndirectCountSupported; //VK_KHR_draw_indirect_count, optional (see gpuCulling.h)
+  uint32_t multiDrawIndirect; //VkPhysicalDeviceFeatures, for GPU-driven draws
+  uint32_t drawIndirectFirstInstance;
+  uint64_t deviceLocalBytes; //largest device-local heap
+  uint32_t queueFamilyCount;
+  uint32_t graphicsFamily; //first family with graphics, NO_QUEUE_FAMILY if none
+  uint32_t dedicatedComputeFamily; //compute without graphics, NO_QUEUE_FAMILY if none
+  uint32_t dedicatedTransferFamily; //transfer without graphics or compute, NO_QUEUE_FAMILY if none
+  uint32_t maxImageDimension2D;
+  uint32_t maxBoundDescriptorSets;
+  uint32_t maxPushConstantsSize;
+  uint32_t maxMemoryAllocationCount;
+};
+
+inline uint64_t hashDeviceExtensions(const std::vector<const char*>& extensions) {
+  uint64_t hash = fnv1a64(&DEVICE_PROBE_CACHE_VERSION, sizeof(DEVICE_PROBE_CACHE_VERSION));
+  for (const char* extension : extensions) {
+    hash = fnv1a64(extension, std::strlen(extension) + 1, hash); //with the terminator, so names can't run together
+  }
+  return hash;
+}
+
+inline const char* deviceTypeName(uint32_t type) {
+  switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "discrete";
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "integrated";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "virtual";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: return "cpu";
+    default: return "other";
+  }
+}
+
+//the slow part: extension, memory and queue family enumeration. properties come from the caller, who needs them for the cache lookup anyway
+inline DeviceProbe probePhysicalDevice(VkPhysicalDevice device, const VkPhysicalDeviceProperties& properties,
+                                       const std::vector<const char*>& requiredExtensions) {
+  DeviceProbe probe = {};
+  probe.vendorID = properties.vendorID;
+  probe.deviceID = properties.deviceID;
+  probe.driverVersion = properties.driverVersion;
+  probe.apiVersion = properties.apiVersion;
+  std::memcpy(probe.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+  probe.requiredExtensionsHash = hashDeviceExtensions(requiredExtensions);
+  std::snprintf(probe.deviceName, sizeof(probe.deviceName), "%s", properties.deviceName);
+  probe.deviceType = properties.deviceType;
+  probe.maxImageDimension2D = properties.limits.maxImageDimension2D;
+  probe.maxBoundDescriptorSets = properties.limits.maxBoundDescriptorSets;
+  probe.maxPushConstantsSize = properties.limits.maxPushConstantsSize;
+  probe.maxMemoryAllocationCount = properties.limits.maxMemoryAllocationCount;
+
+  uint32_t extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+  std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+  std::set<std::string> missing(requiredExtensions.begin(), requiredExtensions.end());
+  for (const auto& extension : availableExtensions) {
+    missing.erase(extension.extensionName);
+    if (std::strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+      probe.memoryBudgetSupported = 1;
+    }
+    if (std::strcmp(extension.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0) {
+      probe.drawIndirectCountSupported = 1;
+    }
+  }
+  probe.extensionsSupported = missing.empty();
+
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(device, &features);
+  probe.multiDrawIndirect = features.multiDrawIndirect;
+  probe.drawIndirectFirstInstance = features.drawIndirectFirstInstance;
+
+  VkPhysicalDeviceMemoryProperties memory;
+  vkGetPhysicalDeviceMemoryProperties(device, &memory);
+  for (uint32_t i = 0; i < memory.memoryHeapCount; i++) {
+    if (memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+      probe.deviceLocalBytes = std::max<uint64_t>(probe.deviceLocalBytes, memory.memoryHeaps[i].size);
+    }
+  }
+
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
+  probe.queueFamilyCount = queueFamilyCount;
+  probe.graphicsFamily = probe.dedicatedComputeFamily = probe.dedicatedTransferFamily = NO_QUEUE_FAMILY;
+  for (uint32_t i = 0; i < queueFamilyCount; i++) {
+    VkQueueFlags flags = queueFamilies[i].queueFlags;
+    if (queueFamilies[i].queueCount == 0) {
+      continue;
+    }
+    if ((flags & VK_QUEUE_GRAPHICS_BIT) && probe.graphicsFamily == NO_QUEUE_FAMILY) {
+      probe.graphicsFamily = i;
+    }
+    if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) && probe.dedicatedComputeFamily == NO_QUEUE_FAMILY) {
+      probe.dedicatedComputeFamily = i;
+    }
+    if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))
+        && probe.dedicatedTransferFamily == NO_QUEUE_FAMILY) {
+      probe.dedicatedTransferFamily = i;
+    }
+  }
+  return probe;
+}
+
+/*
+  Highest wins, negative means unusable. Device type decides; within a type the rest
+  is a weighted sum:
+    device type          discrete 100000, integrated 75000, virtual 50000, other 25000, cpu 0
+    device-local memory  +1 per MiB, capped at 16 GiB (16384)
+    queue layout         +2000 dedicated transfer family, +1000 dedicated compute family
+    limits               +maxImageDimension2D / 16 (1024 for the common 16384), capped at 2048
+  The sum is at most 21432, less than the 25000 between types, so an integrated GPU
+  that reports all of system RAM as device local still stays below any discrete GPU,
+  which is the mistake this is here to prevent.
+*/
+inline int64_t scorePhysicalDevice(const DeviceProbe& probe) {
+  if (!probe.extensionsSupported || probe.graphicsFamily == NO_QUEUE_FAMILY) {
+    return -1;
+  }
+  int64_t score = 0;
+  switch (probe.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score += 100000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 75000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score += 50000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: break;
+    default: score += 25000; break;
+  }
+  score += static_cast<int64_t>(std::min<uint64_t>(probe.deviceLocalBytes >> 20, 16384));
+  if (probe.dedicatedTransferFamily != NO_QUEUE_FAMILY) {
+    score += 2000;
+  }
+  if (probe.dedicatedComputeFamily != NO_QUEUE_FAMILY) {
+    score += 1000;
+  }
+  score += std::min<uint32_t>(probe.maxImageDimension2D / 16, 2048);
+  return score;
+}
+
+/*
+  A user's pick, from GPU_DEVICE or --gpu: all digits is an index in enumeration
+  order (what vulkaninfo lists), anything else a case insensitive substring of the
+  device name, e.g. "nvidia" or "radeon".
+*/
+inline bool deviceMatchesOverride(const DeviceProbe& probe, size_t index, const std::string& selection) {
+  if (selection.empty()) {
+    return true;
+  }
+  if (std::all_of(selection.begin(), selection.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+    return std::stoull(selection) == index;
+  }
+  auto lower = [](std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+    return text;
+  };
+  return lower(probe.deviceName).find(lower(selection)) != std::string::npos;
+}
+
+/*
+  The probe file: a header, then DeviceProbe records. One record per device model;
+  a new driver version replaces the old record rather than adding to it, so the file
+  stays as small as the number of adapters in the machine.
+*/
+class DeviceProbeCache {
+public:
+  explicit DeviceProbeCache(std::string filePath) : path(std::move(filePath)) {}
+
+  //a missing, foreign or corrupt file is just an empty cache
+  void load() {
+    probes.clear();
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      return;
+    }
+    FileHeader header = {};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file.good() || header.magic != DEVICE_PROBE_CACHE_MAGIC || header.version != DEVICE_PROBE_CACHE_VERSION
+        || header.recordSize != sizeof(DeviceProbe) || header.count > 64) {
+      return;
+    }
+    std::vector<DeviceProbe> loaded(header.count);
+    file.read(reinterpret_cast<char*>(loaded.data()), header.count * sizeof(DeviceProbe));
+    if (file.gcount() != static_cast<std::streamsize>(header.count * sizeof(DeviceProbe))
+        || fnv1a64(loaded.data(), loaded.size() * sizeof(DeviceProbe)) != header.checksum) {
+      return;
+    }
+    probes = std::move(loaded);
+  }
+
+  //nullptr unless a probe was saved for this exact device, driver and extension list
+  const DeviceProbe* find(const VkPhysicalDeviceProperties& properties, uint64_t requiredExtensionsHash) const {
+    for (const auto& probe : probes) {
+      if (probe.vendorID == properties.vendorID && probe.deviceID == properties.deviceID
+          && probe.driverVersion == properties.driverVersion && probe.apiVersion == properties.apiVersion
+          && std::memcmp(probe.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0
+          && probe.requiredExtensionsHash == requiredExtensionsHash) {
+        return &probe;
+      }
+    }
+    return nullptr;
+  }
+
+  void store(const DeviceProbe& probe) {
+    probes.erase(std::remove_if(probes.begin(), probes.end(), [&probe](const DeviceProbe& old) {
+      return old.vendorID == probe.vendorID && old.deviceID == probe.deviceID
+          && std::strncmp(old.deviceName, probe.deviceName, sizeof(old.deviceName)) == 0;
+    }), probes.end());
+    probes.push_back(probe);
+    dirty = true;
+  }
+
+  //writes only if something was stored since load(). Temp file and rename, like the other caches
+  bool save() {
+    if (!dirty) {
+      return true;
+    }
+    FileHeader header = {};
+    header.magic = DEVICE_PROBE_CACHE_MAGIC;
+    header.version = DEVICE_PROBE_CACHE_VERSION;
+    header.recordSize = sizeof(DeviceProbe);
+    header.count = static_cast<uint32_t>(probes.size());
+    header.checksum = fnv1a64(probes.data(), probes.size() * sizeof(DeviceProbe));
+    std::string tempPath = path + ".tmp";
+    {
+      std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+      if (!file.is_open()) {
+        return false;
+      }
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.write(reinterpret_cast<const char*>(probes.data()), probes.size() * sizeof(DeviceProbe));
+      if (!file.good()) {
+        file.close();
+        std::remove(tempPath.c_str());
+        return false;
+      }
+    }
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+      std::remove(tempPath.c_str());
+      return false;
+    }
+    dirty = false;
+    return true;
+  }
+
+private:
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize; //sizeof(DeviceProbe) when written, catches layout changes nobody bumped the version for
+    uint32_t count;
+    uint64_t checksum; //fnv1a64 of the records
+  };
+
+  std::string path;
+  std::vector<DeviceProbe> probes;
+  bool dirty = false;
+};
@@ -0,0 +1,122 @@
+/*
+ * Command buffers for the frame being recorded. Everything the render loop records
+ * is used for one frame and recorded again for the next, so there's no point in
+ * allocating and freeing command buffers one at a time, or resetting them one at a
+ * time either.
+ *
+ * Each frame in flight gets its own VK_COMMAND_POOL_CREATE_TRANSIENT_BIT pool per
+ * recording thread. begin(frame), called right after waiting on the frame's fence,
+ * resets all of that frame's pools at once (a single vkResetCommandPool each, which
+ * lets the driver recycle the command memory wholesale) and rewinds them. After that
+ * commandBuffer() hands out the pool's command buffers again in order, so a frame
+ * that records what the previous one did allocates nothing: once the pools have
+ * grown to the busiest frame, recording cost doesn't depend on allocation.
+ *
+ * Command buffers from commandBuffer() are only valid until the frame comes round
+ * again; anything recorded once and kept (none today) belongs in a pool of its own.
+ * Pools aren't thread safe, so each recording thread asks for its own index.
+ */
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+class FrameContexts {
+public:
+  FrameContexts() = default;
+  FrameContexts(const FrameContexts&) = delete;
+  FrameContexts& operator=(const FrameContexts&) = delete;
+
+  //threadCount: how many threads may record at once, each with its own pools
+  void init(VkDevice logicalDevice, uint32_t queueFamily, uint32_t frameCount, unsigned threadCount,
+            const VkAllocationCallbacks* hostCallbacks = nullptr) {
+    device = logicalDevice;
+    callbacks = hostCallbacks;
+    frames.assign(frameCount, Frame());
+    for (Frame& frame : frames) {
+      frame.pools.resize(std::max(1u, threadCount));
+      for (Pool& pool : frame.pools) {
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = queueFamily;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; //short lived, reset all together: no RESET_COMMAND_BUFFER_BIT
+        if (vkCreateCommandPool(device, &poolInfo, callbacks, &pool.pool) != VK_SUCCESS) {
+          throw std::runtime_error("failed to create frame command pool!");
+        }
+      }
+    }
+  }
+
+  void destroy() {
+    for (Frame& frame : frames) {
+      for (Pool& pool : frame.pools) {
+        vkDestroyCommandPool(device, pool.pool, callbacks); //frees its command buffers too
+      }
+    }
+    frames.clear();
+  }
+
+  //the frame's fence has signalled: everything recorded from its pools last time is done executing
+  void begin(uint32_t frame) {
+    current = frame;
+    for (Pool& pool : frames[frame].pools) {
+      if (pool.primaryUsed + pool.secondaryUsed > 0) {
+        vkResetCommandPool(device, pool.pool, 0);
+        resetCount++;
+        pool.primaryUsed = pool.secondaryUsed = 0;
+      }
+    }
+  }
+
+  //a reset command buffer from the current frame's pool for thread; only that thread may use the pool until the next begin()
+  VkCommandBuffer commandBuffer(VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY, unsigned thread = 0) {
+    Pool& pool = frames[current].pools.at(thread);
+    bool primary = level == VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    std::vector<VkCommandBuffer>& buffers = primary ? pool.primaries : pool.secondaries;
+    size_t& used = primary ? pool.primaryUsed : pool.secondaryUsed;
+    if (used == buffers.size()) {
+      VkCommandBufferAllocateInfo allocInfo = {};
+      allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      allocInfo.commandPool = pool.pool;
+      allocInfo.level = level;
+      allocInfo.commandBufferCount = 1;
+      VkCommandBuffer commandBuffer;
+      if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate frame command buffer!");
+      }
+      buffers.push_back(commandBuffer);
+      allocationCount++; //only while the pools grow; steady state frames allocate nothing
+    }
+    return buffers[used++];
+  }
+
+  uint32_t frame() const { return current; }
+  unsigned threadCount() const { return frames.empty() ? 0 : static_cast<unsigned>(frames[0].pools.size()); }
+  uint64_t allocations() const { return allocationCount.load(); }
+  uint64_t resets() const { return resetCount; }
+
+private:
+  struct Pool {
+    VkCommandPool pool = VK_NULL_HANDLE;
+    std::vector<VkCommandBuffer> primaries; //allocated so far, reused after every reset
+    std::vector<VkCommandBuffer> secondaries;
+    size_t primaryUsed = 0; //handed out since the last reset
+    size_t secondaryUsed = 0;
+  };
+
+  struct Frame {
+    std::vector<Pool> pools; //one per recording thread
+  };
+
+  VkDevice device = VK_NULL_HANDLE;
+  const VkAllocationCallbacks* callbacks = nullptr;
+  std::vector<Frame> frames;
+  uint32_t current = 0;
+  std::atomic<uint64_t> allocationCount{0}; //commandBuffer() runs on every recording thread
+  uint64_t resetCount = 0;
+};
@@ -0,0 +1,134 @@
+/*
+ * Per-frame dynamic data: transforms, uniforms, instance data, vertices that change
+ * every frame. Allocating, mapping and freeing a buffer for each is far too slow
+ * for something done every frame, and writing into a buffer the GPU may still be
+ * reading from the previous frame corrupts it.
+ *
+ * FrameRingBuffer is one persistently mapped buffer split into one region per frame
+ * in flight. beginFrame(frame), called right after waiting on that frame's fence,
+ * rewinds the frame's region: the GPU is done with everything written there last
+ * time. allocate() is then a bump of a pointer: align, advance, return a pointer
+ * to write through plus the buffer and offset to bind. No Vulkan calls, no locks,
+ * no allocation per frame.
+ *
+ * Size the regions for the worst frame; running out throws, because quietly
+ * dropping a draw's data would be harder to find. peakBytes() says how close it got.
+ */
+#pragma once
+
+#include "gpuAllocator.h"
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+const VkDeviceSize FRAME_RING_REGION_SIZE = 4ull * 1024 * 1024; //per frame in flight
+
+struct FrameAllocation {
+  VkBuffer buffer = VK_NULL_HANDLE; //the ring's buffer, bind it at offset
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  void* data = nullptr; //write here; host coherent, so no flush needed
+};
+
+class FrameRingBuffer {
+public:
+  /*
+    usage decides what the sub-ranges can be bound as. minAlignment is the largest
+    offset alignment any of those uses needs, e.g. minUniformBufferOffsetAlignment
+    for uniform buffers (see alignmentFor()).
+  */
+  void init(GpuAllocator& gpuAllocator, VkDeviceSize bytesPerFrame, uint32_t frameCount, VkBufferUsageFlags usage,
+            VkDeviceSize minAlignment) {
+    allocator = &gpuAllocator;
+    alignment = std::max<VkDeviceSize>(minAlignment, 4);
+    regionSize = alignUp(bytesPerFrame, alignment); //keeps every region's start aligned too
+    regionCount = frameCount;
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = regionSize * frameCount;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    allocation = allocator->createBuffer(bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer,
+                                         GpuMemoryCategory::Dynamic);
+    regionStart = 0;
+    head = 0;
+  }
+
+  void destroy() {
+    if (allocator && buffer != VK_NULL_HANDLE) {
+      allocator->destroyBuffer(buffer, allocation);
+    }
+  }
+
+  //the largest offset alignment needed for the given usages on this device
+  static VkDeviceSize alignmentFor(const VkPhysicalDeviceLimits& limits, VkBufferUsageFlags usage) {
+    VkDeviceSize required = 4; //vertex, index and indirect offsets only need 4 (or the element size, which is smaller)
+    if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+      required = std::max(required, limits.minUniformBufferOffsetAlignment);
+    }
+    if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+      required = std::max(required, limits.minStorageBufferOffsetAlignment);
+    }
+    return required;
+  }
+
+  //the frame's fence has signalled: its region is free again
+  void beginFrame(uint32_t frame) {
+    regionStart = regionSize * (frame % regionCount);
+    head = 0;
+  }
+
+  //extraAlignment on top of the ring's own, e.g. an element size for vertex data. Throws when the region is full
+  FrameAllocation allocate(VkDeviceSize size, VkDeviceSize extraAlignment = 1) {
+    //aligned within the whole buffer, which is what binding offsets are checked against
+    VkDeviceSize offset = alignUp(regionStart + head, std::lcm(alignment, std::max<VkDeviceSize>(extraAlignment, 1))) - regionStart;
+    if (offset + size > regionSize) {
+      throw std::runtime_error("frame ring buffer region full (" + std::to_string(regionSize) + " bytes), raise FRAME_RING_REGION_SIZE");
+    }
+    head = offset + size;
+    peak = std::max(peak, head);
+    FrameAllocation result;
+    result.buffer = buffer;
+    result.offset = regionStart + offset;
+    result.size = size;
+    result.data = static_cast<char*>(allocation.mapped) + regionStart + offset;
+    return result;
+  }
+
+  //allocate and copy in one go
+  FrameAllocation push(const void* data, VkDeviceSize size, VkDeviceSize extraAlignment = 1) {
+    FrameAllocation result = allocate(size, extraAlignment);
+    std::memcpy(result.data, data, size);
+    return result;
+  }
+
+  template <typename T>
+  FrameAllocation push(const T& value) {
+    return push(&value, sizeof(T), alignof(T));
+  }
+
+  VkDeviceSize bytesThisFrame() const { return head; }
+  VkDeviceSize peakBytes() const { return peak; } //most any frame has used
+  VkDeviceSize bytesPerFrame() const { return regionSize; }
+
+private:
+  static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize to) {
+    return (value + to - 1) / to * to; //not just powers of two: extraAlignment can be a vertex size
+  }
+
+  GpuAllocator* allocator = nullptr;
+  VkBuffer buffer = VK_NULL_HANDLE;
+  GpuAllocation allocation;
+  VkDeviceSize alignment = 4;
+  VkDeviceSize regionSize = 0;
+  uint32_t regionCount = 1;
+  VkDeviceSize regionStart = 0; //of the current frame's region
+  VkDeviceSize head = 0; //bytes used in the current region
+  VkDeviceSize peak = 0;
+};
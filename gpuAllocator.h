@@ -0,0 +1,489 @@
+/*
+ * Device memory sub-allocation. vkAllocateMemory is slow (it can take the driver
+ * into the kernel), and a device only allows maxMemoryAllocationCount live
+ * allocations, as few as 4096. So GpuAllocator allocates large blocks per memory
+ * type and hands out ranges of them; buffers and images are bound at an offset into
+ * a shared VkDeviceMemory.
+ *
+ * Each block keeps its free ranges twice: by offset, so a freed range merges with its
+ * neighbours straight away, and by size, so an allocation takes the smallest free range
+ * that fits (best fit), which keeps the big ranges whole for big requests. Besides
+ * the resource's alignment, ranges respect bufferImageGranularity: a buffer or
+ * linear image must not share a granularity "page" with an optimally tiled image.
+ * That padding is only added when the neighbour really is of the other kind.
+ *
+ * Host visible blocks are mapped once, when they are created, and every allocation
+ * in them gets a pointer into that mapping. A memory object can only be mapped once,
+ * so mapping per allocation isn't possible anyway. Writes through the pointer need
+ * flush() unless the memory type is HOST_COHERENT.
+ */
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const VkDeviceSize GPU_ALLOCATOR_BLOCK_SIZE = 64ull * 1024 * 1024;
+
+//decides bufferImageGranularity padding. Buffers and VK_IMAGE_TILING_LINEAR images are Linear
+enum class GpuResourceKind { Linear, Optimal };
+
+//what an allocation is for, so memory use can be broken down by it (see memoryTelemetry.h)
+enum class GpuMemoryCategory { Vertex, Index, Uniform, Storage, Indirect, Staging, Dynamic, Image, Other, Count };
+
+inline const char* gpuMemoryCategoryName(GpuMemoryCategory category) {
+  switch (category) {
+    case GpuMemoryCategory::Vertex: return "vertex";
+    case GpuMemoryCategory::Index: return "index";
+    case GpuMemoryCategory::Uniform: return "uniform";
+    case GpuMemoryCategory::Storage: return "storage";
+    case GpuMemoryCategory::Indirect: return "indirect";
+    case GpuMemoryCategory::Staging: return "staging";
+    case GpuMemoryCategory::Dynamic: return "dynamic";
+    case GpuMemoryCategory::Image: return "image";
+    default: return "other";
+  }
+}
+
+//bytes callers asked for and how many allocations, per category or per memory type
+struct GpuMemoryUsage {
+  VkDeviceSize usedBytes = 0;
+  VkDeviceSize reservedBytes = 0; //blocks; always 0 for categories, which share blocks
+  size_t allocationCount = 0;
+};
+using GpuCategoryUsage = std::array<GpuMemoryUsage, static_cast<size_t>(GpuMemoryCategory::Count)>;
+
+struct GpuAllocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE; //shared with other allocations in the same block
+  VkDeviceSize offset = 0; //aligned, what to bind at
+  VkDeviceSize size = 0; //as requested
+  void* mapped = nullptr; //at offset, for host visible memory; nullptr otherwise
+  uint32_t memoryType = 0;
+  GpuMemoryCategory category = GpuMemoryCategory::Other;
+
+  //where the range came from, for free()
+  uint64_t blockId = 0;
+  VkDeviceSize rangeOffset = 0; //range start, before alignment padding
+  VkDeviceSize rangeSize = 0; //including padding
+};
+
+struct GpuAllocatorStats {
+  VkDeviceSize usedBytes = 0; //what callers asked for
+  VkDeviceSize wastedBytes = 0; //alignment and granularity padding inside allocated ranges
+  VkDeviceSize reservedBytes = 0; //all blocks, used or not
+  size_t blockCount = 0; //vkAllocateMemory calls currently live
+  size_t allocationCount = 0;
+  size_t freeRangeCount = 0; //fragmentation: how many pieces the free space is in
+  VkDeviceSize largestFreeRange = 0;
+};
+
+class GpuAllocator {
+public:
+  GpuAllocator() = default;
+  GpuAllocator(const GpuAllocator&) = delete;
+  GpuAllocator& operator=(const GpuAllocator&) = delete;
+
+  //hostCallbacks: host memory for the Vulkan objects made here (see hostAllocator.h), nullptr for the driver's
+  void init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, const VkAllocationCallbacks* hostCallbacks = nullptr,
+            VkDeviceSize preferredBlockSize = GPU_ALLOCATOR_BLOCK_SIZE) {
+    device = logicalDevice;
+    callbacks = hostCallbacks;
+    blockSize = preferredBlockSize;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    bufferImageGranularity = std::max<VkDeviceSize>(1, properties.limits.bufferImageGranularity);
+    maxAllocationCount = properties.limits.maxMemoryAllocationCount;
+    nonCoherentAtomSize = std::max<VkDeviceSize>(1, properties.limits.nonCoherentAtomSize);
+  }
+
+  //first memory type allowed by typeFilter that has all of the property flags
+  uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+      if ((typeFilter & (1u << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+        return i;
+      }
+    }
+    throw std::runtime_error("failed to find suitable memory type!");
+  }
+
+  //throws if no memory type with the properties has room, or the device is out of allocations
+  GpuAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, GpuResourceKind kind,
+                         GpuMemoryCategory category = GpuMemoryCategory::Other) {
+    std::lock_guard<std::mutex> lock(mutex);
+    //like findMemoryType(), but when a type's heap is full fall through to the next suitable type
+    for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; type++) {
+      if (!(requirements.memoryTypeBits & (1u << type))
+          || (memoryProperties.memoryTypes[type].propertyFlags & properties) != properties) {
+        continue;
+      }
+      GpuAllocation allocation;
+      if (allocateFromType(type, requirements, kind, allocation)) {
+        allocation.category = category;
+        GpuMemoryUsage& usage = categoryUsage[static_cast<size_t>(category)];
+        usage.usedBytes += allocation.size;
+        usage.allocationCount++;
+        return allocation;
+      }
+    }
+    throw std::runtime_error("failed to allocate GPU memory!");
+  }
+
+  //makes host writes through allocation.mapped visible to the device; nothing to do for HOST_COHERENT memory
+  void flush(const GpuAllocation& allocation) {
+    if (!allocation.mapped
+        || (memoryProperties.memoryTypes[allocation.memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+      return;
+    }
+    VkDeviceSize blockEnd;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = blocks.find(allocation.blockId);
+      if (found == blocks.end()) {
+        return;
+      }
+      blockEnd = found->second->size;
+    }
+    //the range has to start and end on nonCoherentAtomSize, or at the end of the memory object
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = allocation.memory;
+    range.offset = allocation.offset / nonCoherentAtomSize * nonCoherentAtomSize;
+    range.size = std::min(alignUp(allocation.offset + allocation.size, nonCoherentAtomSize), blockEnd) - range.offset;
+    if (vkFlushMappedMemoryRanges(device, 1, &range) != VK_SUCCESS) {
+      throw std::runtime_error("failed to flush mapped memory!");
+    }
+  }
+
+  void free(GpuAllocation& allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = blocks.find(allocation.blockId);
+    if (found != blocks.end()) {
+      Block& block = *found->second;
+      block.used.erase(allocation.rangeOffset);
+      block.usedBytes -= allocation.size;
+      block.wastedBytes -= allocation.rangeSize - allocation.size;
+      block.release(allocation.rangeOffset, allocation.rangeSize);
+      GpuMemoryUsage& usage = categoryUsage[static_cast<size_t>(allocation.category)];
+      usage.usedBytes -= allocation.size;
+      usage.allocationCount--;
+      //keep one empty block per type so a free/allocate pair doesn't cost a vkAllocateMemory each time
+      if (block.used.empty() && blocksOfType(block.memoryType) > 1) {
+        destroyBlock(found);
+      }
+    }
+    allocation = GpuAllocation();
+  }
+
+  //create, allocate and bind in one go. The buffer is VK_NULL_HANDLE if anything fails (and it throws)
+  GpuAllocation createBuffer(const VkBufferCreateInfo& bufferInfo, VkMemoryPropertyFlags properties, VkBuffer& buffer,
+                             GpuMemoryCategory category = GpuMemoryCategory::Other) {
+    if (vkCreateBuffer(device, &bufferInfo, callbacks, &buffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create buffer!");
+    }
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+    GpuAllocation allocation;
+    try {
+      allocation = allocate(requirements, properties, GpuResourceKind::Linear, category);
+    } catch (...) {
+      vkDestroyBuffer(device, buffer, callbacks);
+      buffer = VK_NULL_HANDLE;
+      throw;
+    }
+    vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+    return allocation;
+  }
+
+  GpuAllocation createImage(const VkImageCreateInfo& imageInfo, VkMemoryPropertyFlags properties, VkImage& image,
+                            GpuMemoryCategory category = GpuMemoryCategory::Image) {
+    if (vkCreateImage(device, &imageInfo, callbacks, &image) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create image!");
+    }
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+    GpuAllocation allocation;
+    try {
+      allocation = allocate(requirements, properties,
+                            imageInfo.tiling == VK_IMAGE_TILING_OPTIMAL ? GpuResourceKind::Optimal : GpuResourceKind::Linear, category);
+    } catch (...) {
+      vkDestroyImage(device, image, callbacks);
+      image = VK_NULL_HANDLE;
+      throw;
+    }
+    vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+    return allocation;
+  }
+
+  void destroyBuffer(VkBuffer& buffer, GpuAllocation& allocation) {
+    vkDestroyBuffer(device, buffer, callbacks);
+    buffer = VK_NULL_HANDLE;
+    free(allocation);
+  }
+
+  void destroyImage(VkImage& image, GpuAllocation& allocation) {
+    vkDestroyImage(device, image, callbacks);
+    image = VK_NULL_HANDLE;
+    free(allocation);
+  }
+
+  GpuAllocatorStats stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    GpuAllocatorStats stats;
+    for (const auto& entry : blocks) {
+      const Block& block = *entry.second;
+      stats.usedBytes += block.usedBytes;
+      stats.wastedBytes += block.wastedBytes;
+      stats.reservedBytes += block.size;
+      stats.blockCount++;
+      stats.allocationCount += block.used.size();
+      stats.freeRangeCount += block.freeByOffset.size();
+      if (!block.freeBySize.empty()) {
+        stats.largestFreeRange = std::max(stats.largestFreeRange, block.freeBySize.rbegin()->first);
+      }
+    }
+    return stats;
+  }
+
+  //per memory type, indexed like VkPhysicalDeviceMemoryProperties::memoryTypes
+  std::vector<GpuMemoryUsage> usageByType() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<GpuMemoryUsage> usage(memoryProperties.memoryTypeCount);
+    for (const auto& entry : blocks) {
+      const Block& block = *entry.second;
+      usage[block.memoryType].usedBytes += block.usedBytes;
+      usage[block.memoryType].reservedBytes += block.size;
+      usage[block.memoryType].allocationCount += block.used.size();
+    }
+    return usage;
+  }
+
+  GpuCategoryUsage usageByCategory() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return categoryUsage;
+  }
+
+  const VkPhysicalDeviceMemoryProperties& properties() const { return memoryProperties; }
+
+  std::string describeStats() {
+    GpuAllocatorStats s = stats();
+    std::ostringstream text;
+    text << "gpu memory: " << s.allocationCount << " allocations in " << s.blockCount << " blocks, used "
+         << kib(s.usedBytes) << " KiB, wasted " << kib(s.wastedBytes) << " KiB, reserved " << kib(s.reservedBytes)
+         << " KiB (" << s.freeRangeCount << " free ranges, largest " << kib(s.largestFreeRange) << " KiB)";
+    return text.str();
+  }
+
+  //frees every block. Whatever was bound to them must already be destroyed
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!blocks.empty()) {
+      destroyBlock(blocks.begin());
+    }
+  }
+
+private:
+  struct UsedRange {
+    VkDeviceSize size;
+    GpuResourceKind kind;
+  };
+
+  struct Block {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    uint32_t memoryType = 0;
+    char* mapped = nullptr;
+    std::map<VkDeviceSize, VkDeviceSize> freeByOffset; //offset -> size
+    std::multimap<VkDeviceSize, VkDeviceSize> freeBySize; //size -> offset
+    std::map<VkDeviceSize, UsedRange> used; //range offset -> range
+    VkDeviceSize usedBytes = 0;
+    VkDeviceSize wastedBytes = 0;
+
+    void insertFree(VkDeviceSize offset, VkDeviceSize rangeSize) {
+      freeByOffset[offset] = rangeSize;
+      freeBySize.emplace(rangeSize, offset);
+    }
+
+    void eraseFree(std::map<VkDeviceSize, VkDeviceSize>::iterator range) {
+      auto sized = freeBySize.equal_range(range->second);
+      for (auto it = sized.first; it != sized.second; ++it) {
+        if (it->second == range->first) {
+          freeBySize.erase(it);
+          break;
+        }
+      }
+      freeByOffset.erase(range);
+    }
+
+    //returns a range to the free lists, merged with free neighbours
+    void release(VkDeviceSize offset, VkDeviceSize rangeSize) {
+      auto next = freeByOffset.lower_bound(offset);
+      if (next != freeByOffset.end() && offset + rangeSize == next->first) {
+        rangeSize += next->second;
+        eraseFree(next);
+      }
+      next = freeByOffset.lower_bound(offset);
+      if (next != freeByOffset.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+          offset = previous->first;
+          rangeSize += previous->second;
+          eraseFree(previous);
+        }
+      }
+      insertFree(offset, rangeSize);
+    }
+  };
+  using BlockMap = std::map<uint64_t, std::unique_ptr<Block>>;
+
+  static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return alignment > 1 ? (value + alignment - 1) / alignment * alignment : value;
+  }
+
+  //true if the last byte of one resource and the first byte of the next fall in the same granularity page
+  bool samePage(VkDeviceSize endOfFirst, VkDeviceSize startOfSecond) const {
+    return (endOfFirst - 1) / bufferImageGranularity == startOfSecond / bufferImageGranularity;
+  }
+
+  //where the resource would go in a free range, or false if it doesn't fit once padded
+  bool placeInRange(const Block& block, VkDeviceSize rangeOffset, VkDeviceSize rangeSize, const VkMemoryRequirements& requirements,
+                    GpuResourceKind kind, VkDeviceSize& start, VkDeviceSize& end) const {
+    start = alignUp(rangeOffset, requirements.alignment);
+    if (bufferImageGranularity > 1) {
+      auto previous = block.used.lower_bound(rangeOffset);
+      if (previous != block.used.begin()) {
+        --previous;
+        if (previous->second.kind != kind && samePage(previous->first + previous->second.size, start)) {
+          start = alignUp(start, bufferImageGranularity);
+        }
+      }
+    }
+    end = start + requirements.size;
+    if (end > rangeOffset + rangeSize) {
+      return false;
+    }
+    if (bufferImageGranularity > 1) {
+      auto next = block.used.lower_bound(end);
+      if (next != block.used.end() && next->second.kind != kind && samePage(end, next->first)) {
+        end = alignUp(end, bufferImageGranularity);
+        if (end > rangeOffset + rangeSize) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  bool allocateFromBlock(uint64_t blockId, Block& block, const VkMemoryRequirements& requirements, GpuResourceKind kind,
+                         GpuAllocation& allocation) {
+    //smallest ranges first; padding can make a range that is big enough on paper too small, so keep looking
+    for (auto sized = block.freeBySize.lower_bound(requirements.size); sized != block.freeBySize.end(); ++sized) {
+      VkDeviceSize rangeOffset = sized->second;
+      VkDeviceSize rangeSize = sized->first;
+      VkDeviceSize start, end;
+      if (!placeInRange(block, rangeOffset, rangeSize, requirements, kind, start, end)) {
+        continue;
+      }
+      block.eraseFree(block.freeByOffset.find(rangeOffset));
+      if (end < rangeOffset + rangeSize) {
+        block.insertFree(end, rangeOffset + rangeSize - end); //the tail stays free
+      }
+      block.used[rangeOffset] = {end - rangeOffset, kind};
+      block.usedBytes += requirements.size;
+      block.wastedBytes += end - rangeOffset - requirements.size;
+      allocation.memory = block.memory;
+      allocation.offset = start;
+      allocation.size = requirements.size;
+      allocation.mapped = block.mapped ? block.mapped + start : nullptr;
+      allocation.memoryType = block.memoryType;
+      allocation.blockId = blockId;
+      allocation.rangeOffset = rangeOffset;
+      allocation.rangeSize = end - rangeOffset;
+      return true;
+    }
+    return false;
+  }
+
+  bool allocateFromType(uint32_t type, const VkMemoryRequirements& requirements, GpuResourceKind kind, GpuAllocation& allocation) {
+    for (auto& entry : blocks) {
+      if (entry.second->memoryType == type && allocateFromBlock(entry.first, *entry.second, requirements, kind, allocation)) {
+        return true;
+      }
+    }
+    //small heaps (e.g. the 256 MiB host visible device local window) get proportionally smaller blocks
+    VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[type].heapIndex].size;
+    VkDeviceSize newBlockSize = heapSize <= 1024ull * 1024 * 1024 ? std::min(blockSize, heapSize / 8) : blockSize;
+    newBlockSize = std::max(newBlockSize, alignUp(requirements.size, requirements.alignment)); //big resources get a block of their own
+    auto created = createBlock(type, newBlockSize);
+    if (created == blocks.end()) {
+      return false;
+    }
+    return allocateFromBlock(created->first, *created->second, requirements, kind, allocation);
+  }
+
+  BlockMap::iterator createBlock(uint32_t type, VkDeviceSize size) {
+    if (maxAllocationCount && blocks.size() >= maxAllocationCount) {
+      return blocks.end();
+    }
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = type;
+    std::unique_ptr<Block> block(new Block());
+    if (vkAllocateMemory(device, &allocInfo, callbacks, &block->memory) != VK_SUCCESS) {
+      return blocks.end(); //heap full, the caller tries the next memory type
+    }
+    block->size = size;
+    block->memoryType = type;
+    if (memoryProperties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+      void* mapped = nullptr;
+      if (vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &mapped) != VK_SUCCESS) {
+        vkFreeMemory(device, block->memory, callbacks);
+        return blocks.end();
+      }
+      block->mapped = static_cast<char*>(mapped);
+    }
+    block->insertFree(0, size);
+    return blocks.emplace(nextBlockId++, std::move(block)).first;
+  }
+
+  void destroyBlock(BlockMap::iterator block) {
+    if (block->second->mapped) {
+      vkUnmapMemory(device, block->second->memory);
+    }
+    vkFreeMemory(device, block->second->memory, callbacks);
+    blocks.erase(block);
+  }
+
+  size_t blocksOfType(uint32_t type) const {
+    return std::count_if(blocks.begin(), blocks.end(), [type](const BlockMap::value_type& entry) {
+      return entry.second->memoryType == type;
+    });
+  }
+
+  static VkDeviceSize kib(VkDeviceSize bytes) { return (bytes + 1023) / 1024; }
+
+  VkDevice device = VK_NULL_HANDLE;
+  const VkAllocationCallbacks* callbacks = nullptr;
+  VkPhysicalDeviceMemoryProperties memoryProperties = {};
+  VkDeviceSize blockSize = GPU_ALLOCATOR_BLOCK_SIZE;
+  VkDeviceSize bufferImageGranularity = 1;
+  VkDeviceSize nonCoherentAtomSize = 1;
+  uint32_t maxAllocationCount = 0;
+  std::mutex mutex;
+  GpuCategoryUsage categoryUsage = {};
+  BlockMap blocks; //by id, which never repeats, so a stale GpuAllocation can't free into a new block
+  uint64_t nextBlockId = 1;
+};
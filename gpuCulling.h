@@ -0,0 +1,288 @@
+/*
+ * GPU-driven drawing. With thousands of objects, deciding on the CPU which ones are
+ * on screen and recording a draw for each becomes the frame's bottleneck, even spread
+ * over threads. Instead every object's bounds go into a storage buffer and a compute
+ * shader (shaders/cullObjects.comp) tests them against the view frustum, one
+ * invocation per object, writing a VkDrawIndexedIndirectCommand for each one that
+ * survives. The CPU records one indirect draw whatever the object count.
+ *
+ * With VK_KHR_draw_indirect_count the shader compacts the survivors and counts them,
+ * and vkCmdDrawIndexedIndirectCountKHR reads the count on the GPU. Without it the
+ * shader writes one record per object, culled ones with instanceCount 0, and the
+ * draw covers all of them (with multiDrawIndirect as one call, else one per record).
+ * The count is written either way, so visibleObjects() can say how much was culled.
+ *
+ * Everything per frame (bounds in, commands and count out) lives in FrameRingBuffer:
+ * it's rewritten every frame anyway, and host visible so the CPU zeroes the count
+ * and reads it back without extra copies. Each frame in flight has its own
+ * descriptor set, pointed at that frame's ranges in record().
+ */
+#pragma once
+
+#include "frameRing.h"
+#include "spirvReflect.h"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const uint32_t GPU_CULL_WORKGROUP_SIZE = 64; //cullObjects.comp's local_size_x, specialization constant 0
+
+//an object's box in clip space; std430 vec4 in the shader
+struct GpuCullBounds {
+  float minX, minY, maxX, maxY;
+};
+
+//cullObjects.comp's push constant block, checked against the reflected size
+struct GpuCullParams {
+  float planes[4][4]; //xy normal, w distance; inside where dot(normal, p) + distance >= 0
+  uint32_t objectCount;
+  uint32_t indexCount; //the mesh every object draws
+  uint32_t firstIndex;
+  int32_t vertexOffset;
+  uint32_t compact;
+};
+
+//the indirect draw a culling pass fed, for DrawCommand
+struct GpuCullOutput {
+  VkBuffer commandBuffer = VK_NULL_HANDLE; //VkDrawIndexedIndirectCommand records
+  VkDeviceSize commandOffset = 0;
+  uint32_t maxDrawCount = 0;
+  VkBuffer countBuffer = VK_NULL_HANDLE; //VK_NULL_HANDLE unless compacted
+  VkDeviceSize countOffset = 0;
+};
+
+class GpuCuller {
+public:
+  GpuCuller() = default;
+  GpuCuller(const GpuCuller&) = delete;
+  GpuCuller& operator=(const GpuCuller&) = delete;
+
+  /*
+    code/reflection: cullObjects.comp compiled and reflected. compact: the draw will
+    use the count (VK_KHR_draw_indirect_count), so only visible objects get records.
+    maxDrawCount: maxDrawIndirectCount, the most one count draw can take; a frame
+    with more objects than that isn't compacted, so it can be drawn in several calls.
+  */
+  void init(VkDevice logicalDevice, VkPipelineCache pipelineCache, const uint32_t* code, size_t codeSize, const ShaderReflection& reflection,
+            uint32_t frameCount, bool compact, uint32_t maxDrawCount, const VkAllocationCallbacks* hostCallbacks = nullptr) {
+    device = logicalDevice;
+    callbacks = hostCallbacks;
+    compacting = compact;
+    compactLimit = maxDrawCount;
+    checkInterface(reflection);
+
+    VkDescriptorSetLayoutBinding bindings[3] = {};
+    for (uint32_t i = 0; i < 3; i++) {
+      bindings[i].binding = i; //bounds, commands, count
+      bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      bindings[i].descriptorCount = 1;
+      bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {};
+    setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    setLayoutInfo.bindingCount = 3;
+    setLayoutInfo.pBindings = bindings;
+    if (vkCreateDescriptorSetLayout(device, &setLayoutInfo, callbacks, &setLayout) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create culling descriptor set layout!");
+    }
+    VkPushConstantRange pushConstants = {};
+    pushConstants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstants.size = sizeof(GpuCullParams);
+    VkPipelineLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layoutInfo.setLayoutCount = 1;
+    layoutInfo.pSetLayouts = &setLayout;
+    layoutInfo.pushConstantRangeCount = 1;
+    layoutInfo.pPushConstantRanges = &pushConstants;
+    if (vkCreatePipelineLayout(device, &layoutInfo, callbacks, &pipelineLayout) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create culling pipeline layout!");
+    }
+
+    VkShaderModuleCreateInfo moduleInfo = {};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = codeSize;
+    moduleInfo.pCode = code;
+    VkShaderModule module;
+    if (vkCreateShaderModule(device, &moduleInfo, callbacks, &module) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create culling shader module!");
+    }
+    VkSpecializationMapEntry workgroupSize = {0, 0, sizeof(uint32_t)};
+    VkSpecializationInfo specialization = {};
+    specialization.mapEntryCount = 1;
+    specialization.pMapEntries = &workgroupSize;
+    specialization.dataSize = sizeof(GPU_CULL_WORKGROUP_SIZE);
+    specialization.pData = &GPU_CULL_WORKGROUP_SIZE;
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = module;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.stage.pSpecializationInfo = &specialization;
+    pipelineInfo.layout = pipelineLayout;
+    VkResult result = vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, callbacks, &pipeline);
+    vkDestroyShaderModule(device, module, callbacks); //the pipeline keeps what it needs
+    if (result != VK_SUCCESS) {
+      throw std::runtime_error("failed to create culling compute pipeline!");
+    }
+
+    VkDescriptorPoolSize poolSize = {};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSize.descriptorCount = 3 * frameCount;
+    VkDescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = frameCount;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    if (vkCreateDescriptorPool(device, &poolInfo, callbacks, &descriptorPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create culling descriptor pool!");
+    }
+    std::vector<VkDescriptorSetLayout> layouts(frameCount, setLayout);
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = frameCount;
+    allocInfo.pSetLayouts = layouts.data();
+    descriptorSets.resize(frameCount);
+    if (vkAllocateDescriptorSets(device, &allocInfo, descriptorSets.data()) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate culling descriptor sets!");
+    }
+    counts.assign(frameCount, nullptr);
+    objectsSubmitted.assign(frameCount, 0);
+  }
+
+  void destroy() {
+    if (device == VK_NULL_HANDLE) {
+      return;
+    }
+    vkDestroyDescriptorPool(device, descriptorPool, callbacks); //frees the sets
+    vkDestroyPipeline(device, pipeline, callbacks);
+    vkDestroyPipelineLayout(device, pipelineLayout, callbacks);
+    vkDestroyDescriptorSetLayout(device, setLayout, callbacks);
+    device = VK_NULL_HANDLE;
+  }
+
+  bool compacts() const { return compacting; }
+
+  //the clip space box, x and y in [-1, 1]: what a 2D scene without a camera can see
+  static void clipSpaceFrustum(float planes[4][4]) {
+    const float box[4][4] = {{1, 0, 0, 1}, {-1, 0, 0, 1}, {0, 1, 0, 1}, {0, -1, 0, 1}};
+    for (int i = 0; i < 4; i++) {
+      for (int j = 0; j < 4; j++) {
+        planes[i][j] = box[i][j];
+      }
+    }
+  }
+
+  /*
+    Records the culling dispatch for objectCount objects into commandBuffer, outside
+    any render pass, followed by the barrier that makes its output readable as
+    indirect commands. params supplies the frustum and the mesh; objectCount and
+    compact are filled in here. frame is the frame in flight, whose ring region and
+    descriptor set are free again.
+  */
+  GpuCullOutput record(VkCommandBuffer commandBuffer, uint32_t frame, FrameRingBuffer& frameData, const GpuCullBounds* bounds,
+                       uint32_t objectCount, GpuCullParams params) {
+    GpuCullOutput output;
+    counts[frame] = nullptr;
+    if (objectCount == 0) {
+      return output;
+    }
+    FrameAllocation boundsData = frameData.push(bounds, sizeof(GpuCullBounds) * objectCount, alignof(GpuCullBounds));
+    FrameAllocation commands = frameData.allocate(sizeof(VkDrawIndexedIndirectCommand) * objectCount, sizeof(uint32_t));
+    FrameAllocation count = frameData.allocate(sizeof(uint32_t), sizeof(uint32_t));
+    *static_cast<uint32_t*>(count.data) = 0; //host coherent: visible to the dispatch once submitted
+    counts[frame] = static_cast<const uint32_t*>(count.data);
+    objectsSubmitted[frame] = objectCount;
+
+    VkDescriptorBufferInfo buffers[3] = {
+      {boundsData.buffer, boundsData.offset, boundsData.size},
+      {commands.buffer, commands.offset, commands.size},
+      {count.buffer, count.offset, count.size},
+    };
+    VkWriteDescriptorSet writes[3] = {};
+    for (uint32_t i = 0; i < 3; i++) {
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = descriptorSets[frame]; //not in use: the frame's fence has signalled
+      writes[i].dstBinding = i;
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = &buffers[i];
+    }
+    vkUpdateDescriptorSets(device, 3, writes, 0, nullptr);
+
+    params.objectCount = objectCount;
+    bool compact = compacting && objectCount <= compactLimit;
+    params.compact = compact ? 1 : 0;
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSets[frame], 0, nullptr);
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    vkCmdDispatch(commandBuffer, (objectCount + GPU_CULL_WORKGROUP_SIZE - 1) / GPU_CULL_WORKGROUP_SIZE, 1, 1);
+    //the draw reads the records (and count) as indirect parameters; the host reads the count after the fence
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1,
+                         &barrier, 0, nullptr, 0, nullptr);
+
+    output.commandBuffer = commands.buffer;
+    output.commandOffset = commands.offset;
+    output.maxDrawCount = objectCount;
+    if (compact) {
+      output.countBuffer = count.buffer;
+      output.countOffset = count.offset;
+    }
+    return output;
+  }
+
+  //after the frame's fence: how many objects its culling pass kept
+  void collect(uint32_t frame) {
+    if (frame < counts.size() && counts[frame]) {
+      visibleTotal += *counts[frame];
+      objectTotal += objectsSubmitted[frame];
+      counts[frame] = nullptr;
+    }
+  }
+
+  uint64_t visibleObjects() const { return visibleTotal; }
+  uint64_t culledObjects() const { return objectTotal - visibleTotal; }
+
+private:
+  //the shader and GpuCullParams / the bindings here drifting apart would be a silent garbage draw
+  static void checkInterface(const ShaderReflection& reflection) {
+    if (reflection.stage != VK_SHADER_STAGE_COMPUTE_BIT) {
+      throw std::runtime_error("culling shader isn't a compute shader!");
+    }
+    if (reflection.pushConstantSize != sizeof(GpuCullParams)) {
+      throw std::runtime_error("culling shader push constants take " + std::to_string(reflection.pushConstantSize)
+                               + " bytes but GpuCullParams is " + std::to_string(sizeof(GpuCullParams)) + "!");
+    }
+    bool bindingsMatch = reflection.bindings.size() == 3;
+    for (size_t i = 0; bindingsMatch && i < reflection.bindings.size(); i++) {
+      const ReflectedDescriptorBinding& binding = reflection.bindings[i];
+      bindingsMatch = binding.set == 0 && binding.binding == i && binding.type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER && binding.count == 1;
+    }
+    if (!bindingsMatch) {
+      throw std::runtime_error("culling shader should have storage buffers at set 0, bindings 0 to 2!");
+    }
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  const VkAllocationCallbacks* callbacks = nullptr;
+  bool compacting = false;
+  uint32_t compactLimit = 0;
+  VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+  VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+  std::vector<VkDescriptorSet> descriptorSets; //per frame in flight
+  std::vector<const uint32_t*> counts; //per frame in flight, the mapped count its last dispatch wrote
+  std::vector<uint32_t> objectsSubmitted; //per frame in flight
+  uint64_t visibleTotal = 0;
+  uint64_t objectTotal = 0;
+};
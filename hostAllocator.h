@@ -0,0 +1,371 @@
+/*
+ * Host memory for the driver, through VkAllocationCallbacks. With nullptr as the
+ * allocator every driver allocation is a malloc we can't see; this routes them by
+ * VkSystemAllocationScope and counts bytes and calls per scope, so host allocation
+ * churn (in the frame loop especially) can be measured and then cut.
+ *
+ * Command scope allocations only live until the command that made them returns,
+ * on the thread that called it. They come from a per-thread arena: a bump pointer
+ * that rewinds whenever nothing in the arena is live, which for command scope is
+ * after nearly every call. Object, cache, device and instance scope allocations
+ * live as long as some Vulkan object; they come from size class pools (power of
+ * two slots carved from pages, freed slots kept on a list per class), so creating
+ * and destroying objects recycles the same memory instead of going back to malloc.
+ * Anything too big for either goes to malloc.
+ *
+ * Every block starts with a small header in front of the pointer handed out: the
+ * scope, size and where the block came from, because pfnFree only gets the pointer.
+ * Pools are locked (pipelines are built on other threads), arenas need no lock.
+ */
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const size_t HOST_ARENA_SIZE = 256 * 1024; //per thread, command scope
+const size_t HOST_POOL_PAGE_SIZE = 64 * 1024;
+const size_t HOST_POOL_MIN_SLOT = 64;
+const size_t HOST_POOL_MAX_SLOT = 8192; //bigger blocks go to malloc
+const size_t HOST_SCOPE_COUNT = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+//counters for one VkSystemAllocationScope
+struct HostScopeStats {
+  uint64_t allocations = 0; //pfnAllocation calls, and pfnReallocation calls with no original
+  uint64_t reallocations = 0; //pfnReallocation calls that resize, moving or not; counted here only
+  uint64_t frees = 0;
+  uint64_t bytesAllocated = 0; //over the whole run
+  uint64_t liveBytes = 0;
+  uint64_t peakBytes = 0;
+  uint64_t internalAllocations = 0; //the driver's own allocations it only tells us about (pfnInternalAllocation)
+  uint64_t internalLiveBytes = 0;
+};
+
+using HostAllocationStats = std::array<HostScopeStats, HOST_SCOPE_COUNT>;
+
+inline const char* hostAllocationScopeName(size_t scope) {
+  switch (scope) {
+    case VK_SYSTEM_ALLOCATION_SCOPE_COMMAND: return "command";
+    case VK_SYSTEM_ALLOCATION_SCOPE_OBJECT: return "object";
+    case VK_SYSTEM_ALLOCATION_SCOPE_CACHE: return "cache";
+    case VK_SYSTEM_ALLOCATION_SCOPE_DEVICE: return "device";
+    case VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE: return "instance";
+    default: return "unknown";
+  }
+}
+
+class HostAllocator {
+public:
+  HostAllocator() : id(nextId()) {
+    vkCallbacks.pUserData = this;
+    vkCallbacks.pfnAllocation = &HostAllocator::allocationCallback;
+    vkCallbacks.pfnReallocation = &HostAllocator::reallocationCallback;
+    vkCallbacks.pfnFree = &HostAllocator::freeCallback;
+    vkCallbacks.pfnInternalAllocation = &HostAllocator::internalAllocationCallback;
+    vkCallbacks.pfnInternalFree = &HostAllocator::internalFreeCallback;
+  }
+  HostAllocator(const HostAllocator&) = delete;
+  HostAllocator& operator=(const HostAllocator&) = delete;
+
+  //every object created with these must be destroyed before the allocator is
+  ~HostAllocator() {
+    for (PoolClass& pool : pools) {
+      for (char* page : pool.pages) {
+        std::free(page);
+      }
+    }
+    for (auto& arena : arenas) {
+      std::free(arena->base);
+    }
+  }
+
+  const VkAllocationCallbacks* callbacks() const { return &vkCallbacks; }
+
+  HostAllocationStats stats() const {
+    HostAllocationStats result;
+    for (size_t scope = 0; scope < HOST_SCOPE_COUNT; scope++) {
+      const ScopeCounters& counters = scopes[scope];
+      result[scope].allocations = counters.allocations.load(std::memory_order_relaxed);
+      result[scope].reallocations = counters.reallocations.load(std::memory_order_relaxed);
+      result[scope].frees = counters.frees.load(std::memory_order_relaxed);
+      result[scope].bytesAllocated = counters.bytesAllocated.load(std::memory_order_relaxed);
+      result[scope].liveBytes = counters.liveBytes.load(std::memory_order_relaxed);
+      result[scope].peakBytes = counters.peakBytes.load(std::memory_order_relaxed);
+      result[scope].internalAllocations = counters.internalAllocations.load(std::memory_order_relaxed);
+      result[scope].internalLiveBytes = counters.internalLiveBytes.load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  //where blocks were served from, over the whole run
+  uint64_t arenaAllocations() const { return sourceCounts[ARENA].load(std::memory_order_relaxed); }
+  uint64_t poolAllocations() const { return sourceCounts[POOL].load(std::memory_order_relaxed); }
+  uint64_t systemAllocations() const { return sourceCounts[SYSTEM].load(std::memory_order_relaxed); }
+
+  std::string describeStats() const {
+    HostAllocationStats current = stats();
+    std::ostringstream out;
+    out << "host allocator: " << arenaAllocations() << " arena, " << poolAllocations() << " pool, " << systemAllocations() << " malloc";
+    for (size_t scope = 0; scope < HOST_SCOPE_COUNT; scope++) {
+      const HostScopeStats& s = current[scope];
+      if (s.allocations == 0 && s.internalAllocations == 0) {
+        continue;
+      }
+      out << "\n  " << hostAllocationScopeName(scope) << ": " << s.allocations << " allocations, " << s.reallocations << " reallocations, "
+          << s.frees << " frees, " << s.bytesAllocated / 1024 << " KiB total, peak " << s.peakBytes / 1024 << " KiB, live "
+          << s.liveBytes / 1024 << " KiB";
+      if (s.internalAllocations > 0) {
+        out << ", " << s.internalAllocations << " internal (" << s.internalLiveBytes / 1024 << " KiB live)";
+      }
+    }
+    return out.str();
+  }
+
+private:
+  enum Source : uint8_t { ARENA, POOL, SYSTEM, SOURCE_COUNT };
+
+  //in front of every pointer handed out
+  struct alignas(16) Header {
+    void* raw; //start of the block, what goes back to its source
+    void* owner; //the Arena for ARENA blocks
+    uint64_t size; //as requested
+    uint8_t scope;
+    uint8_t source;
+    uint8_t poolClass;
+  };
+
+  struct Arena {
+    char* base = nullptr;
+    size_t capacity = 0;
+    size_t head = 0; //only the owning thread moves it
+    std::atomic<uint32_t> live{0}; //blocks not yet freed; frees can come from any thread
+  };
+
+  struct PoolClass {
+    std::mutex mutex;
+    void* freeList = nullptr; //each free slot holds the pointer to the next
+    std::vector<char*> pages;
+    size_t carved = HOST_POOL_PAGE_SIZE; //slots taken from the last page; starts "full" so the first allocation adds a page
+  };
+
+  struct ScopeCounters {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> reallocations{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> bytesAllocated{0};
+    std::atomic<uint64_t> liveBytes{0};
+    std::atomic<uint64_t> peakBytes{0};
+    std::atomic<uint64_t> internalAllocations{0};
+    std::atomic<uint64_t> internalLiveBytes{0};
+  };
+
+  static const size_t POOL_CLASS_COUNT = 8; //HOST_POOL_MIN_SLOT << 7 == HOST_POOL_MAX_SLOT
+
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> counter{1};
+    return counter++;
+  }
+
+  static void* VKAPI_PTR allocationCallback(void* userData, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+    return static_cast<HostAllocator*>(userData)->allocate(size, alignment, scope);
+  }
+
+  static void* VKAPI_PTR reallocationCallback(void* userData, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+    HostAllocator* self = static_cast<HostAllocator*>(userData);
+    if (original == nullptr) {
+      return self->allocate(size, alignment, scope);
+    }
+    if (size == 0) {
+      self->release(original);
+      return nullptr;
+    }
+    self->scopes[scopeIndex(scope)].reallocations.fetch_add(1, std::memory_order_relaxed);
+    const Header* header = headerOf(original);
+    if (size <= header->size) {
+      return original; //shrinking: the block already fits. Its size stays as counted, freed in full later
+    }
+    //the original stays valid if this fails, as the spec requires. One call, counted above: not an allocation and a free as well
+    void* moved = self->allocate(size, alignment, scope, false);
+    if (moved != nullptr) {
+      std::memcpy(moved, original, std::min<size_t>(size, header->size));
+      self->release(original, false);
+    }
+    return moved;
+  }
+
+  static void VKAPI_PTR freeCallback(void* userData, void* memory) {
+    if (memory != nullptr) {
+      static_cast<HostAllocator*>(userData)->release(memory);
+    }
+  }
+
+  static void VKAPI_PTR internalAllocationCallback(void* userData, size_t size, VkInternalAllocationType, VkSystemAllocationScope scope) {
+    ScopeCounters& counters = static_cast<HostAllocator*>(userData)->scopes[scopeIndex(scope)];
+    counters.internalAllocations.fetch_add(1, std::memory_order_relaxed);
+    counters.internalLiveBytes.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  static void VKAPI_PTR internalFreeCallback(void* userData, size_t size, VkInternalAllocationType, VkSystemAllocationScope scope) {
+    static_cast<HostAllocator*>(userData)->scopes[scopeIndex(scope)].internalLiveBytes.fetch_sub(size, std::memory_order_relaxed);
+  }
+
+  static size_t scopeIndex(VkSystemAllocationScope scope) {
+    return std::min<size_t>(static_cast<size_t>(scope), HOST_SCOPE_COUNT - 1);
+  }
+
+  static Header* headerOf(void* memory) {
+    return reinterpret_cast<Header*>(static_cast<char*>(memory) - sizeof(Header));
+  }
+
+  //countCall: false when a reallocation moves, which counts itself
+  void* allocate(size_t size, size_t alignment, VkSystemAllocationScope scope, bool countCall = true) {
+    if (size == 0) {
+      return nullptr;
+    }
+    alignment = std::max<size_t>(alignment, alignof(Header));
+    size_t total = size + sizeof(Header) + alignment - 1; //room to align the pointer after the header, wherever the block starts
+
+    Header block = {};
+    block.size = size;
+    block.scope = static_cast<uint8_t>(scopeIndex(scope));
+    if (scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND) {
+      Arena* arena = threadArena();
+      if (arena != nullptr && (block.raw = arenaAllocate(*arena, total)) != nullptr) {
+        block.source = ARENA;
+        block.owner = arena;
+      }
+    } else if (total <= HOST_POOL_MAX_SLOT) {
+      size_t poolClass = poolClassFor(total);
+      if ((block.raw = poolAllocate(poolClass)) != nullptr) {
+        block.source = POOL;
+        block.poolClass = static_cast<uint8_t>(poolClass);
+      }
+    }
+    if (block.raw == nullptr) {
+      block.raw = std::malloc(total);
+      block.source = SYSTEM;
+      if (block.raw == nullptr) {
+        return nullptr; //the driver turns this into VK_ERROR_OUT_OF_HOST_MEMORY
+      }
+    }
+    sourceCounts[block.source].fetch_add(1, std::memory_order_relaxed);
+
+    uintptr_t user = (reinterpret_cast<uintptr_t>(block.raw) + sizeof(Header) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+    std::memcpy(reinterpret_cast<void*>(user - sizeof(Header)), &block, sizeof(Header));
+
+    ScopeCounters& counters = scopes[block.scope];
+    if (countCall) {
+      counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    counters.bytesAllocated.fetch_add(size, std::memory_order_relaxed);
+    uint64_t live = counters.liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+    uint64_t peak = counters.peakBytes.load(std::memory_order_relaxed);
+    while (live > peak && !counters.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    return reinterpret_cast<void*>(user);
+  }
+
+  void release(void* memory, bool countCall = true) {
+    Header block;
+    std::memcpy(&block, headerOf(memory), sizeof(Header));
+    ScopeCounters& counters = scopes[block.scope];
+    if (countCall) {
+      counters.frees.fetch_add(1, std::memory_order_relaxed);
+    }
+    counters.liveBytes.fetch_sub(block.size, std::memory_order_relaxed);
+    switch (block.source) {
+      case ARENA:
+        static_cast<Arena*>(block.owner)->live.fetch_sub(1, std::memory_order_release);
+        break;
+      case POOL: {
+        PoolClass& pool = pools[block.poolClass];
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        *static_cast<void**>(block.raw) = pool.freeList;
+        pool.freeList = block.raw;
+        break;
+      }
+      default:
+        std::free(block.raw);
+    }
+  }
+
+  //this thread's arena, created on its first command scope allocation. nullptr if that failed
+  Arena* threadArena() {
+    thread_local uint64_t cachedFor = 0; //allocator id, so a new allocator at the same address doesn't reuse a dead arena
+    thread_local Arena* cached = nullptr;
+    if (cachedFor != id) {
+      auto arena = std::make_unique<Arena>();
+      arena->base = static_cast<char*>(std::malloc(HOST_ARENA_SIZE));
+      if (arena->base == nullptr) {
+        return nullptr;
+      }
+      arena->capacity = HOST_ARENA_SIZE;
+      std::lock_guard<std::mutex> lock(arenaMutex);
+      arenas.push_back(std::move(arena));
+      cached = arenas.back().get();
+      cachedFor = id;
+    }
+    return cached;
+  }
+
+  static void* arenaAllocate(Arena& arena, size_t total) {
+    if (arena.live.load(std::memory_order_acquire) == 0) {
+      arena.head = 0; //everything handed out so far has been freed
+    }
+    if (arena.head + total > arena.capacity) {
+      return nullptr;
+    }
+    void* block = arena.base + arena.head;
+    arena.head += (total + 15) & ~size_t(15);
+    arena.live.fetch_add(1, std::memory_order_relaxed);
+    return block;
+  }
+
+  static size_t poolClassFor(size_t total) {
+    size_t poolClass = 0;
+    for (size_t slot = HOST_POOL_MIN_SLOT; slot < total; slot <<= 1) {
+      poolClass++;
+    }
+    return poolClass;
+  }
+
+  void* poolAllocate(size_t poolClass) {
+    PoolClass& pool = pools[poolClass];
+    size_t slotSize = HOST_POOL_MIN_SLOT << poolClass;
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.freeList != nullptr) {
+      void* slot = pool.freeList;
+      pool.freeList = *static_cast<void**>(slot);
+      return slot;
+    }
+    if (pool.carved + slotSize > HOST_POOL_PAGE_SIZE) {
+      char* page = static_cast<char*>(std::malloc(HOST_POOL_PAGE_SIZE));
+      if (page == nullptr) {
+        return nullptr;
+      }
+      pool.pages.push_back(page);
+      pool.carved = 0;
+    }
+    void* slot = pool.pages.back() + pool.carved;
+    pool.carved += slotSize;
+    return slot;
+  }
+
+  const uint64_t id;
+  VkAllocationCallbacks vkCallbacks = {};
+  std::array<ScopeCounters, HOST_SCOPE_COUNT> scopes;
+  std::array<std::atomic<uint64_t>, SOURCE_COUNT> sourceCounts = {};
+  std::array<PoolClass, POOL_CLASS_COUNT> pools;
+  std::mutex arenaMutex; //guards arenas, which owns every thread's arena
+  std::vector<std::unique_ptr<Arena>> arenas;
+};
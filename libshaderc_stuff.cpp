@@ -14,15 +14,30 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <glslang/SPIRV/spirv.hpp>
 
 #include <shaderc/shaderc.h>
 
+#include "shaderArchive.h"
+#include "shaderCache.h"
+#include "shaderIncludes.h"
+
 
 // Determines the kind of output required from the compiler.
 enum class OutputType {
@@ -80,8 +95,464 @@ bool ResultContainsValidSpv(shaderc_compilation_result_t result) {
   return bytes[0] == spv::MagicNumber;
 }
 
-int main() {
-    std::cout << "Main Working" << std::endl;
+// Returns true if the given bytes look like a SPIR-V module: at least a full
+// header, a whole number of words and the correct magic number.
+bool BytesContainValidSpv(const char* bytes, size_t length) {
+  if (length < 20 || length % 4 != 0) return false;
+  uint32_t magic;
+  std::memcpy(&magic, bytes, sizeof(magic));
+  return magic == spv::MagicNumber;
+}
+
+// One shader found under the shader directory, plus everything we learn about
+// it while compiling.
+struct ShaderJob {
+  std::filesystem::path path;
+  shaderc_shader_kind kind;
+  bool success = false;
+  bool cached = false;
+  size_t spirv_bytes = 0;
+  double milliseconds = 0.0;
+  std::string error;
+  uint64_t key = 0;
+  std::vector<char> spirv;  // Only kept when packing an archive.
+  std::vector<std::string> changed_includes;  // Why a cached shader rebuilt.
+};
+
+// Recursively finds every file under |directory| with a shader stage extension.
+// Sorted so the report is stable from run to run.
+std::vector<ShaderJob> FindShaders(const std::filesystem::path& directory) {
+  std::vector<ShaderJob> jobs;
+  for (const auto& entry :
+       std::filesystem::recursive_directory_iterator(directory)) {
+    ShaderJob job;
+    if (entry.is_regular_file() &&
+        shaderKindFromPath(entry.path(), job.kind)) {
+      job.path = entry.path();
+      jobs.push_back(job);
+    }
+  }
+  std::sort(jobs.begin(), jobs.end(),
+            [](const ShaderJob& a, const ShaderJob& b) { return a.path < b.path; });
+  return jobs;
+}
+
+// Compiles a single shader with the calling worker's |compiler| and
+// |options|, which have |includer| attached. Results are looked up in and
+// written back to |cache| (when non-null) with the same include aware key
+// main.cpp uses, so a batch run warms the application's startup path and a
+// rerun only recompiles shaders whose source or includes changed.
+void CompileShaderJob(const shaderc_compiler_t compiler,
+                      const shaderc_compile_options_t options,
+                      ShaderIncluder* includer, ShaderCache* cache,
+                      bool keep_spirv, ShaderJob* job) {
+  auto start = std::chrono::steady_clock::now();
+  std::ifstream stream(job->path);
+  std::string source((std::istreambuf_iterator<char>(stream)),
+                     std::istreambuf_iterator<char>());
+  if (!stream.good() && !stream.eof()) {
+    job->error = "failed to read file";
+  } else {
+    const std::string file_name = job->path.generic_string();
+    uint64_t key = 0;
+    std::vector<uint32_t> words;
+    if (cache &&
+        shaderKeyForSource(*cache, file_name, source, job->kind,
+                           SHADER_DEFAULT_OPTIONS_TAG, key,
+                           &job->changed_includes) &&
+        cache->load(key, words)) {
+      job->key = key;
+      const char* bytes = reinterpret_cast<const char*>(words.data());
+      job->cached = true;
+      job->spirv_bytes = words.size() * sizeof(uint32_t);
+      job->success = BytesContainValidSpv(bytes, job->spirv_bytes);
+      if (keep_spirv) job->spirv.assign(bytes, bytes + job->spirv_bytes);
+    } else {
+      includer->clear();
+      shaderc_compilation_result_t result = MakeCompilationResult(
+          compiler, source, job->kind, file_name.c_str(), "main", options,
+          OutputType::SpirvBinary);
+      job->success = ResultContainsValidSpv(result);
+      if (job->success) {
+        const char* bytes = shaderc_result_get_bytes(result);
+        job->spirv_bytes = shaderc_result_get_length(result);
+        job->key = shaderKeyWithDependencies(
+            ShaderCache::makeKey(source, job->kind, "main",
+                                 SHADER_DEFAULT_OPTIONS_TAG),
+            includer->dependencies());
+        if (cache) {
+          if (!includer->dependencies().empty()) {
+            storeShaderDependencies(*cache, file_name, job->kind,
+                                    includer->dependencies());
+          }
+          cache->store(job->key, bytes, job->spirv_bytes);
+        }
+        if (keep_spirv) job->spirv.assign(bytes, bytes + job->spirv_bytes);
+      } else if (!CompilationResultIsSuccess(result)) {
+        job->error = shaderc_result_get_error_message(result);
+      } else {
+        job->error = "compiler produced invalid SPIR-V";
+      }
+      shaderc_result_release(result);
+    }
+  }
+  job->milliseconds = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+}
+
+// Compiles every job on a pool of |thread_count| workers. Each worker owns its
+// own shaderc_compiler_t, options and includer, and pulls the next unclaimed
+// job off a shared counter, so long shaders don't hold up a statically
+// assigned batch.
+void CompileShadersInParallel(std::vector<ShaderJob>* jobs, ShaderCache* cache,
+                              bool keep_spirv, unsigned thread_count) {
+  std::atomic<size_t> next_job(0);
+  auto worker = [&]() {
+    shaderc_compiler_t compiler = shaderc_compiler_initialize();
+    shaderc_compile_options_t options = shaderc_compile_options_initialize();
+    ShaderIncluder includer;
+    includer.attach(options);
+    for (size_t i = next_job++; i < jobs->size(); i = next_job++) {
+      CompileShaderJob(compiler, options, &includer, cache, keep_spirv,
+                       &(*jobs)[i]);
+    }
+    shaderc_compile_options_release(options);
+    shaderc_compiler_release(compiler);
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < thread_count; ++i) {
+    workers.emplace_back(worker);
+  }
+  for (auto& thread : workers) {
+    thread.join();
+  }
+}
+
+// Packs every successfully compiled job into one memory-mappable archive
+// (see shaderArchive.h). Entries are named by the path they were compiled
+// from, e.g. "shaders/vertexShader.vert", which is what main.cpp looks up.
+void PackShaderArchive(const std::vector<ShaderJob>& jobs,
+                       const std::string& archive_path) {
+  std::vector<ShaderArchiveInput> inputs;
+  for (const ShaderJob& job : jobs) {
+    if (!job.success) continue;
+    inputs.push_back({job.path.generic_string(), job.key,
+                      static_cast<uint32_t>(job.kind), job.spirv});
+  }
+  writeShaderArchive(archive_path, inputs);
+  std::cout << "packed " << inputs.size() << " shaders into " << archive_path
+            << std::endl;
+}
+
+// One row of the benchmark report: how long one compile configuration takes
+// for one shader and how big its output is.
+struct BenchSample {
+  std::string label;
+  bool success = false;
+  double median_ms = 0.0;
+  double min_ms = 0.0;
+  size_t output_bytes = 0;
+};
+
+double Median(std::vector<double> values) {
+  if (values.empty()) return 0.0;
+  std::sort(values.begin(), values.end());
+  size_t middle = values.size() / 2;
+  return values.size() % 2 ? values[middle]
+                           : (values[middle - 1] + values[middle]) / 2.0;
+}
+
+// Runs |run| |iterations| times. |run| returns the size of what it produced,
+// or 0 on failure, which stops the sample early.
+BenchSample TimeIterations(const std::string& label, int iterations,
+                           const std::function<size_t()>& run) {
+  BenchSample sample;
+  sample.label = label;
+  std::vector<double> times;
+  for (int i = 0; i < iterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes = run();
+    times.push_back(std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+    if (bytes == 0) return sample;
+    sample.output_bytes = bytes;
+  }
+  sample.success = true;
+  sample.median_ms = Median(times);
+  sample.min_ms = *std::min_element(times.begin(), times.end());
+  return sample;
+}
+
+// Compiles |source| through MakeCompilationResult and returns the output size,
+// or 0 if it failed.
+size_t CompileOnce(const shaderc_compiler_t compiler, const std::string& source,
+                   const ShaderJob& job, const shaderc_compile_options_t options,
+                   OutputType output_type) {
+  const std::string file_name = job.path.string();
+  shaderc_compilation_result_t result = MakeCompilationResult(
+      compiler, source, job.kind, file_name.c_str(), "main", options,
+      output_type);
+  size_t bytes = 0;
+  if (output_type == OutputType::SpirvBinary ? ResultContainsValidSpv(result)
+                                             : CompilationResultIsSuccess(result)) {
+    bytes = shaderc_result_get_length(result);
+  }
+  shaderc_result_release(result);
+  return bytes;
+}
+
+// Compile latency benchmark. For every shader it times, single threaded and
+// |iterations| times each:
+//   - preprocessing alone, as a floor for what any compile costs
+//   - a full compile at each shaderc optimization level (zero is also what
+//     main.cpp ships with, since it passes default options)
+//   - a cold start: compile and store into an empty shader cache
+//   - a warm start: load from that cache
+// and reports median/min latency plus output size, then totals per
+// configuration. The very first compile in the process is reported on its own
+// since it includes glslang's one-time initialization, which every cold
+// application start pays. Returns the number of shaders that failed.
+int RunBenchmark(const std::vector<ShaderJob>& jobs, int iterations) {
+  struct Level {
+    const char* label;
+    shaderc_optimization_level level;
+  };
+  const Level levels[] = {
+      {"O0 zero", shaderc_optimization_level_zero},
+      {"Os size", shaderc_optimization_level_size},
+      {"O  performance", shaderc_optimization_level_performance},
+  };
+  ShaderIncluder includer;
+  shaderc_compile_options_t default_options =
+      shaderc_compile_options_initialize();
+  includer.attach(default_options);
+  std::vector<shaderc_compile_options_t> level_options;
+  for (const Level& level : levels) {
+    shaderc_compile_options_t options = shaderc_compile_options_initialize();
+    shaderc_compile_options_set_optimization_level(options, level.level);
+    includer.attach(options);
+    level_options.push_back(options);
+  }
+  // A private cache so the cold numbers really are cold and the user's cache
+  // is left alone.
+  std::filesystem::path bench_cache_dir =
+      std::filesystem::temp_directory_path() /
+      ("shader_bench_cache_" +
+       std::to_string(
+           std::chrono::steady_clock::now().time_since_epoch().count()));
+  ShaderCache cache(bench_cache_dir.string());
+  shaderc_compiler_t compiler = shaderc_compiler_initialize();
+
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "benchmarking " << jobs.size() << " shaders, " << iterations
+            << " iterations each" << std::endl;
+  std::vector<std::string> labels;
+  std::unordered_map<std::string, double> total_ms;
+  std::unordered_map<std::string, size_t> total_bytes;
+  int failures = 0;
+  bool first = true;
+  for (const ShaderJob& job : jobs) {
+    std::ifstream stream(job.path);
+    std::string source((std::istreambuf_iterator<char>(stream)),
+                       std::istreambuf_iterator<char>());
+    std::vector<BenchSample> samples;
+    if (first) {
+      samples.push_back(TimeIterations("first compile", 1, [&]() {
+        return CompileOnce(compiler, source, job, default_options,
+                           OutputType::SpirvBinary);
+      }));
+      first = false;
+    }
+    samples.push_back(TimeIterations("preprocess", iterations, [&]() {
+      return CompileOnce(compiler, source, job, default_options,
+                         OutputType::PreprocessedText);
+    }));
+    for (size_t i = 0; i < level_options.size(); ++i) {
+      samples.push_back(TimeIterations(levels[i].label, iterations, [&]() {
+        return CompileOnce(compiler, source, job, level_options[i],
+                           OutputType::SpirvBinary);
+      }));
+    }
+    includer.clear();
+    CompileOnce(compiler, source, job, default_options,
+                OutputType::SpirvBinary);
+    uint64_t key = shaderKeyWithDependencies(
+        ShaderCache::makeKey(source, job.kind, "main",
+                             SHADER_DEFAULT_OPTIONS_TAG),
+        includer.dependencies());
+    const std::string file_name = job.path.string();
+    samples.push_back(TimeIterations("cold (compile+store)", iterations, [&]() {
+      shaderc_compilation_result_t result = MakeCompilationResult(
+          compiler, source, job.kind, file_name.c_str(), "main",
+          default_options, OutputType::SpirvBinary);
+      size_t bytes = 0;
+      if (ResultContainsValidSpv(result)) {
+        bytes = shaderc_result_get_length(result);
+        cache.store(key, shaderc_result_get_bytes(result), bytes);
+      }
+      shaderc_result_release(result);
+      return bytes;
+    }));
+    samples.push_back(TimeIterations("warm (cache load)", iterations, [&]() {
+      std::vector<uint32_t> words;
+      return cache.load(key, words) ? words.size() * sizeof(uint32_t) : 0;
+    }));
+
+    std::cout << job.path.string() << std::endl;
+    bool job_failed = false;
+    for (const BenchSample& sample : samples) {
+      if (!sample.success) {
+        std::cout << "  " << std::setw(22) << std::left << sample.label
+                  << std::right << "FAILED" << std::endl;
+        job_failed = true;
+        continue;
+      }
+      std::cout << "  " << std::setw(22) << std::left << sample.label
+                << std::right << std::setw(10) << sample.median_ms
+                << " ms median " << std::setw(10) << sample.min_ms
+                << " ms min " << std::setw(8) << sample.output_bytes
+                << " bytes" << std::endl;
+      if (total_ms.count(sample.label) == 0) labels.push_back(sample.label);
+      total_ms[sample.label] += sample.median_ms;
+      total_bytes[sample.label] += sample.output_bytes;
+    }
+    if (job_failed) ++failures;
+  }
+
+  std::cout << "totals (sum of medians over all shaders)" << std::endl;
+  for (const std::string& label : labels) {
+    std::cout << "  " << std::setw(22) << std::left << label << std::right
+              << std::setw(10) << total_ms[label] << " ms       "
+              << std::setw(10) << total_bytes[label] << " bytes" << std::endl;
+  }
+  if (total_ms["warm (cache load)"] > 0.0) {
+    std::cout << "cache speedup: "
+              << total_ms["cold (compile+store)"] / total_ms["warm (cache load)"]
+              << "x" << std::endl;
+  }
+
+  shaderc_compiler_release(compiler);
+  shaderc_compile_options_release(default_options);
+  for (shaderc_compile_options_t options : level_options) {
+    shaderc_compile_options_release(options);
+  }
+  std::error_code ec;
+  std::filesystem::remove_all(bench_cache_dir, ec);
+  return failures;
+}
+
+// Batch shader compiler. Compiles everything under a shader directory in
+// parallel, validates the results and reports per-shader timings. With
+// --pack it also writes the results into a single shader archive. With
+// --bench it runs the compile latency benchmark (RunBenchmark()) instead.
+//
+//   libshaderc_stuff [shader_dir] [-j threads] [--cache dir] [--no-cache]
+//                    [--pack archive] [--bench [--iterations n]]
+//
+// Built like main.cpp, minus the window system libraries:
+//   clang++ -std=c++17 libshaderc_stuff.cpp -I<sdk>/include -L<sdk>/lib
+//       -lshaderc_combined -lpthread -o libshaderc_stuff
+//
+// Exits non-zero if any shader fails to compile.
+int main(int argc, char** argv) {
+  std::filesystem::path shader_dir = "shaders";
+  std::string cache_dir = "shader_cache";
+  bool use_cache = true;
+  std::string archive_path;
+  unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+  bool bench = false;
+  int bench_iterations = 10;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--bench") {
+      bench = true;
+    } else if (arg == "--iterations" && i + 1 < argc) {
+      bench_iterations = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "-j" && i + 1 < argc) {
+      thread_count = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--cache" && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (arg == "--no-cache") {
+      use_cache = false;
+    } else if (arg == "--pack" && i + 1 < argc) {
+      archive_path = argv[++i];
+    } else {
+      shader_dir = arg;
+    }
+  }
+
+  std::vector<ShaderJob> jobs;
+  try {
+    jobs = FindShaders(shader_dir);
+  } catch (const std::filesystem::filesystem_error& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (jobs.empty()) {
+    std::cerr << "no shaders found under " << shader_dir << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (bench) {
+    return RunBenchmark(jobs, bench_iterations) == 0 ? EXIT_SUCCESS
+                                                     : EXIT_FAILURE;
+  }
+  thread_count = std::min<unsigned>(thread_count, jobs.size());
+
+  ShaderCache cache(cache_dir);
+  auto start = std::chrono::steady_clock::now();
+  CompileShadersInParallel(&jobs, use_cache ? &cache : nullptr,
+                           !archive_path.empty(), thread_count);
+  double wall_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  int failures = 0;
+  double total_ms = 0.0;
+  std::cout << std::fixed << std::setprecision(2);
+  for (const ShaderJob& job : jobs) {
+    total_ms += job.milliseconds;
+    std::cout << std::setw(9) << job.milliseconds << " ms  "
+              << (job.success ? (job.cached ? "cached " : "ok     ")
+                              : "FAILED ")
+              << std::setw(7) << job.spirv_bytes << " bytes  "
+              << job.path.string();
+    if (!job.changed_includes.empty()) {
+      std::cout << "  (changed:";
+      for (const std::string& include : job.changed_includes) {
+        std::cout << " " << include;
+      }
+      std::cout << ")";
+    }
+    std::cout << std::endl;
+    if (!job.success) {
+      std::cout << job.error << std::endl;
+      ++failures;
+    }
+  }
+  std::cout << jobs.size() << " shaders, " << failures << " failed, "
+            << thread_count << " threads: " << wall_ms << " ms wall, "
+            << total_ms << " ms summed";
+  if (use_cache) {
+    std::cout << " (cache: " << cache.hits() << " hits, " << cache.misses()
+              << " misses)";
+  }
+  std::cout << std::endl;
+
+  if (!archive_path.empty()) {
+    if (failures != 0) {
+      std::cerr << "not packing " << archive_path << ": " << failures
+                << " shaders failed" << std::endl;
+      return EXIT_FAILURE;
+    }
+    try {
+      PackShaderArchive(jobs, archive_path);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
 
-    return 0;
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -35,6 +35,42 @@
 
 //for compiling to SPIR-V internally
 #include <shaderc/shaderc.h>
+//on-disk SPIR-V cache so we don't run shaderc on every launch
+#include "shaderCache.h"
+//#include support, and cache keys that cover included files
+#include "shaderIncludes.h"
+//packed, memory mapped SPIR-V written by libshaderc_stuff --pack
+#include "shaderArchive.h"
+//vertex input and pipeline layout come from the shaders themselves
+#include "spirvReflect.h"
+//builds pipelines on worker threads so the render loop never waits for the driver
+#include "pipelineCompiler.h"
+//scoped timings for every startup stage, written as a Chrome trace at exit
+#include "startupProfiler.h"
+//ranks GPUs instead of taking the first one, with the probing cached per driver
+#include "deviceSelection.h"
+//sub-allocates buffers and images from large device memory blocks
+#include "gpuAllocator.h"
+//uploads into device local buffers through a persistently mapped ring
+#include "stagingRing.h"
+//big uploads on the transfer queue, overlapping rendering
+#include "asyncUpload.h"
+//bump allocated, persistently mapped memory for data that changes every frame
+#include "frameRing.h"
+//device memory budget/usage per heap, with per-frame samples and warnings before running out
+#include "memoryTelemetry.h"
+//VkAllocationCallbacks: per-thread arenas and pools for the driver's host memory, counted per scope
+#include "hostAllocator.h"
+//per-frame transient command pools, reset in bulk when the frame's fence signals
+#include "frameContext.h"
+//records each frame's draws on worker threads into secondary command buffers
+#include "commandRecorder.h"
+//passes declare the images they read and write; render passes, barriers and transient memory follow
+#include "renderGraph.h"
+//frustum culling in a compute shader that writes the indirect draws (--gpu-driven)
+#include "gpuCulling.h"
+//triangle lists to indexed meshes: deduplicated, reordered for the vertex cache and for fetching
+#include "meshOptimizer.h"
 
 //for shaders
 #include <glm/glm.hpp>
@@ -48,6 +84,25 @@
 #include <optional>
 #include <set>
 #include <fstream>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <future>
+#include <tuple>
+#include <map>
+#include <algorithm>
+#include <cctype>
+
+#ifdef __linux__
+//inotify, for shader hot reload
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 
 const int WIDTH = 800;
@@ -66,83 +121,191 @@ const std::vector<const char*> deviceExtensions = { //for determining swapchain
 #else
     const bool enableValidationLayers = true;
 #endif
+//recompile and swap in shaders when files in shaders/ change (debug builds only, needs inotify)
+#ifdef NDEBUG
+    const bool enableShaderHotReload = false;
+#else
+    const bool enableShaderHotReload = true;
+#endif
 
 const int MAX_FRAMES_IN_FLIGHT = 2; //max number of concurrent frames to be processed in the pipeline
-
+const char* const VERT_SHADER_FILE = "shaders/vertexShader.vert";
+const char* const FRAG_SHADER_FILE = "shaders/fragmentShaderHack.frag";
+const char* const CULL_SHADER_FILE = "shaders/cullObjects.comp"; //GPU-driven mode only
+const char* const SHADER_ARCHIVE_FILE = "shaders.spvpak"; //packed SPIR-V, used instead of compiling when present (override with SHADER_ARCHIVE_PATH)
+const char* const PIPELINE_CACHE_FILE = "pipeline_cache.bin"; //driver pipeline cache saved between runs (override with PIPELINE_CACHE_PATH)
+const char* const STARTUP_TRACE_FILE = "startup_trace.json"; //Chrome trace of startup, written at exit (override with STARTUP_TRACE_PATH)
+const int VERTEX_BENCHMARK_WARMUP_FRAMES = 30; //dropped from the results: pipeline warm up, and timestamps of the previous run
+const uint32_t VERTEX_BENCHMARK_GRID = 256; //256x256 quads = 262144 unique vertices (~5 MB, through the transfer queue) and 393216 32-bit indices (1.5 MB, through the staging ring)
+const VkDeviceSize ASYNC_UPLOAD_MIN_BYTES = 1024 * 1024; //device local data at least this big goes through the transfer queue instead of the staging ring
+const uint32_t DRAW_BATCH_INDICES = 768; //indices per draw in the draw list (256 triangles)
+const uint32_t INSTANCE_FIRST_LOCATION = 2; //vertex shader inputs from this location on are per instance (binding 1)
+const int INSTANCING_BENCHMARK_WARMUP_FRAMES = 30;
+const uint32_t INSTANCING_BENCHMARK_COUNTS[] = {1, 16, 256, 4096, 32768}; //copies of the quad, per-object draws need one draw each
+const char* const DEVICE_PROBE_CACHE_FILE = "device_probe.bin"; //GPU capabilities probed on earlier runs (override with DEVICE_PROBE_CACHE_PATH)
+
+//a shader permutation: specialization constant values by constant_id (bools are 0/1, floats their bit pattern).
+//ids left out keep the default written in the shader, see getPipelineVariant()
+using ShaderVariant = std::map<uint32_t, uint32_t>;
+const uint32_t SPEC_COLOR_MODE = 0; //fragmentShaderHack.frag: 0 vertex colour, 1 grayscale, 2 inverted (C key cycles)
+const uint32_t SPEC_SCANLINES = 1; //fragmentShaderHack.frag: bool (S key toggles)
+//while a shader variant's pipeline is still compiling, draw with the default variant (true) or skip the draw (false)
+const bool drawFallbackWhilePipelineCompiles = true;
+
+//per-vertex data, laid out in the same order as the vertex shader's inputs (location 0, 1, ...).
+//the binding and attribute descriptions are reflected from the SPIR-V, see createVertexInputState().
+//no padding: optimizeMesh() compares vertices as bytes
 struct Vertex {
-  glm::vec2 pos;
-  glm::vec3 color;
-
-  static VkVertexInputBindingDescription getBindingDescription() { //binding descriptions
-        VkVertexInputBindingDescription bindingDescription = {};
-        bindingDescription.binding = 0;
-        bindingDescription.stride = sizeof(Vertex);
-        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-        return bindingDescription;
-  }
-
-  static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() { //attr discriptions (pos and color)
-    std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions = {};
-    attributeDescriptions[0].binding = 0; //which binding the per-vertex data comes
-    attributeDescriptions[0].location = 0; //location from .vert file ex. layout(location = 0)
-    attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT; //not actually for RG, but for XY (pos), implicitly defines the byte size of attribute data 
-    attributeDescriptions[0].offset = offsetof(Vertex, pos); //specifies the number of bytes since the start of the per-vertex data to read from
-    attributeDescriptions[1].binding = 0;
-    attributeDescriptions[1].location = 1;
-    attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT; //this is the real RGB (for color)
-    attributeDescriptions[1].offset = offsetof(Vertex, color);
-    return attributeDescriptions;
-  }
+  glm::vec2 pos; //layout(location = 0) in vec2
+  glm::vec3 color; //layout(location = 1) in vec3
+};
+
+//per-instance data, binding 1 (VK_VERTEX_INPUT_RATE_INSTANCE), locations INSTANCE_FIRST_LOCATION on.
+//written to frameData every frame, so instances can move without touching the mesh
+struct InstanceData {
+  glm::vec4 transform; //layout(location = 2) in vec4: xy scale, zw offset
+  glm::vec3 color; //layout(location = 3) in vec3: multiplies the vertex colour
 };
 
+//a triangle list; createMesh() merges the shared corners into an indexed mesh
 const std::vector<Vertex> vertices = {
     {{-1.0f, -1.0f}, {1.0f, 0.0f, 0.0f}},
     {{1.0f, -1.0f}, {0.0f, 1.0f, 0.0f}},
     {{1.0f, 1.0f}, {0.0f, 0.0f, 1.0f}},
 
-    {{-1.0f, -1.0f}, {1.0f, 1.0f, 0.0f}},
-    {{1.0f, 1.0f}, {1.0f, 0.0f, 1.0f}},
+    {{-1.0f, -1.0f}, {1.0f, 0.0f, 0.0f}},
+    {{1.0f, 1.0f}, {0.0f, 0.0f, 1.0f}},
     {{-1.0f, 1.0f}, {0.0f, 1.0f, 1.0f}},
 };
 
 class HelloTriangleApplication {
 
 public:
+    //an exception out of run() skips cleanup(), and destroying a joinable std::thread would terminate
+    ~HelloTriangleApplication() {
+      stopShaderWatcher();
+    }
+
+    //index or name substring of the GPU to use, instead of the highest scoring one (--gpu, GPU_DEVICE)
+    void setDeviceSelection(const std::string& selection) {
+        deviceSelection = selection;
+    }
+
+    //instead of the normal loop, time frames with the vertex buffer in host visible and then device local memory (--bench-vertex-memory)
+    void setVertexMemoryBenchmark(int frames) {
+        vertexBenchmarkFrames = frames;
+    }
+
+    //instead of the normal loop, time N copies of the mesh as one instanced draw and as N draws (--bench-instancing)
+    void setInstancingBenchmark(int frames) {
+        instancingBenchmarkFrames = frames;
+    }
+
+    //cull on the GPU and draw the scene with one indirect draw (--gpu-driven, GPU_DRIVEN=1)
+    void setGpuDriven(bool enabled) {
+        gpuDriven = enabled;
+    }
+
     void run() {
-        initWindow();
+        startShaderLoads(); //no Vulkan needed, so the shaders compile while the window, instance and device come up
+        {
+          ProfileScope scope("initWindow");
+          initWindow();
+        }
         initVulkan();
-        mainLoop();
+        if (vertexBenchmarkFrames > 0) {
+          runVertexMemoryBenchmark();
+        } else if (instancingBenchmarkFrames > 0) {
+          runInstancingBenchmark();
+        } else {
+          mainLoop();
+        }
         cleanup();
+        writeStartupProfile();
     }
 
 private:
     GLFWwindow* window;
+    HostAllocator hostAllocator; //outlives every Vulkan object, it's declared first
+    const VkAllocationCallbacks* hostCallbacks = nullptr; //passed to every vkCreate*/vkDestroy*; nullptr with HOST_ALLOCATOR=driver
     VkInstance instance;
+    bool physicalDeviceProperties2Enabled = false; //instance extension, needed to query VK_EXT_memory_budget
     VkSurfaceKHR surface;
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    DeviceProbe physicalDeviceProbe = {}; //what pickPhysicalDevice() ranked it by: queue layout, memory, limits
+    std::string deviceSelection; //user override, empty to go by score
     VkDevice device; //logical device
+    bool memoryBudgetEnabled = false; //VK_EXT_memory_budget enabled on device
+    bool multiDrawIndirectEnabled = false; //device features and extension GPU-driven drawing uses when present
+    bool drawIndirectFirstInstanceEnabled = false;
+    PFN_vkCmdDrawIndexedIndirectCountKHR cmdDrawIndexedIndirectCount = nullptr; //VK_KHR_draw_indirect_count, nullptr without it
+    uint32_t maxDrawIndirectCount = 1; //VkPhysicalDeviceLimits, draws per multi-draw call
     VkQueue graphicsQueue; //from logical device
     VkQueue presentQueue; //what to present on the surface
+    VkQueue transferQueue; //dedicated transfer family if there is one, else the graphics queue
     VkSwapchainKHR swapChain; //struct
     std::vector<VkImage> swapChainImages; //actual images to queue in swapChain
     VkFormat swapChainImageFormat; //in the swap chain, but used later
     VkExtent2D swapChainExtent; //in the swap chain, but used later
     std::vector<VkImageView> swapChainImageViews;//To use any VkImage, like ones in swap chain, in the render pipeline we have to create a VkImageView object
-    VkRenderPass renderPass;
-    VkPipelineLayout pipelineLayout; //for uniform shader values (TODO)
+    RenderGraph renderGraph; //the frame's passes, rebuilt with the swapchain
+    RenderPassId scenePass = 0;
+    VkRenderPass renderPass; //scenePass's, owned by renderGraph
+    VkPipelineLayout pipelineLayout; //for uniform shader values, built from shader reflection
+    std::vector<VkDescriptorSetLayout> descriptorSetLayouts; //one per set number the shaders use, see createPipelineLayout()
+    ShaderReflection vertShaderReflection; //interface of the shaders the pipeline layout was built from
+    ShaderReflection fragShaderReflection;
+    std::vector<VkVertexInputBindingDescription> vertexBindingDescriptions; //reflected from the vertex shader: per vertex, then per instance if used
+    std::vector<VkVertexInputAttributeDescription> vertexAttributeDescriptions;
     VkPipeline graphicsPipeline;
-    std::vector<VkFramebuffer> swapChainFramebuffers;
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE; //driver's compiled pipeline state, persisted to PIPELINE_CACHE_FILE
+    bool pipelineCacheWarm = false; //true if we loaded valid cache data for this device
+    double coldPipelineCreateMs = 0.0; //pipeline creation time measured with an empty cache, saved alongside the cache
     //Render Ready up to this point
-    VkCommandPool commandPool;
+    FrameContexts frameContexts; //per-frame transient command pools, every command buffer the render loop records comes from here
     VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
-    std::vector<VkCommandBuffer> commandBuffers;
+    GpuAllocator gpuAllocator; //all device memory comes from here
+    GpuAllocation vertexBufferAllocation;
+    uint32_t vertexCount = 0; //what's in vertexBuffer
+    glm::vec4 meshBounds = {}; //the mesh's xy min (xy) and max (zw), for culling
+    VkBuffer indexBuffer = VK_NULL_HANDLE;
+    GpuAllocation indexBufferAllocation;
+    uint32_t indexCount = 0; //what's in indexBuffer
+    VkIndexType indexType = VK_INDEX_TYPE_UINT32; //UINT16 when the mesh has few enough vertices
+    StagingRing stagingRing; //uploads to device local buffers, see stagingRing.h
+    AsyncUploader asyncUploader; //large uploads on transferQueue, see asyncUpload.h
+    FrameRingBuffer frameData; //per-frame dynamic data (uniforms, instance data, ...), rewound when the frame's fence signals
+    MemoryTelemetry memoryTelemetry; //budget/usage samples, logged every frame to MEMORY_TELEMETRY_PATH if set
+    uint64_t frameNumber = 0; //frames drawn so far
+    UploadTicket pendingVertexUpload = 0; //vertexBuffer's async upload, until drawFrame() hands it over
+    uint32_t pendingVertexCount = 0; //vertexCount once it has
+    ParallelRecorder commandRecorder; //records drawList across threads into secondaries, see commandRecorder.h
+    std::vector<DrawCommand> drawList; //this frame's draws, rebuilt by buildDrawList()
+    std::vector<InstanceData> sceneInstances; //copies of the mesh to draw, streamed to frameData every frame (INSTANCE_COUNT)
+    bool drawPerObject = false; //benchmark only: one draw per instance instead of one instanced draw
+    bool gpuDriven = false; //cull sceneInstances in a compute shader and draw them indirectly, see gpuCulling.h
+    GpuCuller gpuCuller;
+    std::vector<GpuCullBounds> objectBounds; //sceneInstances' clip space boxes, rebuilt with the draw list
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
     std::vector<VkFence> inFlightFences;
     std::vector<VkFence> imagesInFlight; //tracking swapchain images to pair with fences and don't render to an image already in flight
     size_t currentFrame = 0;
+    int vertexBenchmarkFrames = 0; //0: normal run
+    int instancingBenchmarkFrames = 0;
+    VkQueryPool timestampQueryPool = VK_NULL_HANDLE; //benchmark only: a begin/end timestamp pair per swapchain image
+    uint32_t timestampQueryCount = 0;
+    float timestampPeriodNs = 0.0f;
+    std::vector<double> frameGpuMs; //render pass GPU time of each frame, collected while timestampQueryPool exists
     bool framebufferResized = false; //triggers swapchain recreation
+    ShaderCache shaderCache; //compiled SPIR-V keyed by source hash, see shaderCache.h
+    ShaderArchive shaderArchive; //mmapped SHADER_ARCHIVE_FILE, see shaderArchive.h
+    std::thread shaderWatchThread; //shader hot reload: recompiles and builds pipelines in the background
+    std::atomic<bool> shaderWatchRunning{false};
+    int shaderWatchFd = -1; //inotify instance watching shaders/
+    int shaderIncludeWatch = -1; //watch descriptor for SHADER_INCLUDE_DIR, if it exists
+    std::mutex pendingPipelineMutex; //guards pendingReload, activeVariant and the shader reflections
+    std::shared_mutex renderPassMutex; //exclusive while renderPass is rebuilt, shared by background pipeline builds
 
     void initWindow() {
       glfwInit();
@@ -151,6 +314,7 @@ private:
       window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan window", nullptr, nullptr);
       glfwSetWindowUserPointer(window, this);
       glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+      glfwSetKeyCallback(window, keyCallback);
     }
 
     static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
@@ -158,22 +322,74 @@ private:
       app->framebufferResized = true;
     }
 
+    //picks shader variants; drawFrame() switches to them (see selectPipelineVariant())
+    static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+      auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+      if (action != GLFW_PRESS) {
+        return;
+      }
+      ShaderVariant& variant = app->requestedVariant;
+      if (key == GLFW_KEY_C) {
+        variant[SPEC_COLOR_MODE] = (variant[SPEC_COLOR_MODE] + 1) % 3;
+      } else if (key == GLFW_KEY_S) {
+        variant[SPEC_SCANLINES] = !variant[SPEC_SCANLINES];
+      }
+    }
+
+    /*
+      Init is a small dependency graph rather than one sequence. Everything below
+      depends on the stage before it, except the shaders: GLSL -> SPIR-V (or the
+      cache/archive lookup) and reflection need no Vulkan objects, so run() starts
+      them on worker threads before the window even exists, and
+      createGraphicsPipeline() is the one place that joins them:
+
+        startShaderLoads ---(vert, frag on workers)----------------.
+        initWindow -> createInstance -> ... -> createRenderGraph -> createGraphicsPipeline -> ...
+
+      Every stage is timed for the startup trace (see writeStartupProfile()).
+    */
     void initVulkan() {
-      createInstance();
-      createSurface();
-      pickPhysicalDevice();
-      createLogicalDevice();
-      createSwapChain();
-      createImageViews();
-      createRenderPass();
+      ProfileScope initScope("initVulkan");
+      profileStage("createInstance", &HelloTriangleApplication::createInstance);
+      profileStage("createSurface", &HelloTriangleApplication::createSurface);
+      profileStage("pickPhysicalDevice", &HelloTriangleApplication::pickPhysicalDevice);
+      profileStage("createLogicalDevice", &HelloTriangleApplication::createLogicalDevice);
+      profileStage("createAllocator", &HelloTriangleApplication::createAllocator);
+      profileStage("createMemoryTelemetry", &HelloTriangleApplication::createMemoryTelemetry);
+      profileStage("createPipelineCache", &HelloTriangleApplication::createPipelineCache);
+      profileStage("createSwapChain", &HelloTriangleApplication::createSwapChain);
+      profileStage("createImageViews", &HelloTriangleApplication::createImageViews);
+      profileStage("createRenderGraph", &HelloTriangleApplication::createRenderGraph);
+      if (enableValidationLayers) {
+        profileStage("checkRenderGraph", &HelloTriangleApplication::checkRenderGraph);
+      }
       //this is the piece that we're gonna abstract for classwork
-      createGraphicsPipeline();
-      createFramebuffers();
+      profileStage("createGraphicsPipeline", &HelloTriangleApplication::createGraphicsPipeline);
       //Render Ready up to this point
-      createCommandPool();
-      createVertexBuffer();
-      createCommandBuffers();
-      createSynchObjects();
+      profileStage("createFrameContexts", &HelloTriangleApplication::createFrameContexts);
+      profileStage("createStagingRing", &HelloTriangleApplication::createStagingRing);
+      profileStage("createAsyncUploader", &HelloTriangleApplication::createAsyncUploader);
+      profileStage("createFrameRing", &HelloTriangleApplication::createFrameRing);
+      profileStage("createGpuCulling", &HelloTriangleApplication::createGpuCulling);
+      profileStage("createVertexBuffer", &HelloTriangleApplication::createVertexBuffer);
+      profileStage("createCommandRecorder", &HelloTriangleApplication::createCommandRecorder);
+      profileStage("createSynchObjects", &HelloTriangleApplication::createSynchObjects);
+      profileStage("startShaderHotReload", &HelloTriangleApplication::startShaderHotReload);
+    }
+
+    void profileStage(const char* name, void (HelloTriangleApplication::*stage)()) {
+      ProfileScope scope(name);
+      (this->*stage)();
+    }
+
+    //trace for chrome://tracing or ui.perfetto.dev, plus one machine readable line to grep out of logs
+    void writeStartupProfile() {
+      const char* path = std::getenv("STARTUP_TRACE_PATH");
+      std::string tracePath = path ? path : STARTUP_TRACE_FILE;
+      if (!StartupProfiler::instance().writeChromeTrace(tracePath)) {
+        std::cerr << "startup profile: can't write " << tracePath << std::endl;
+      }
+      std::cout << "startup_profile " << StartupProfiler::instance().summaryJson() << std::endl;
     }
 
   /**** Create Vulkan Instance ****/
@@ -187,6 +403,10 @@ private:
         throw std::runtime_error("validation layers requested, but not available!");
       }
 
+      //HOST_ALLOCATOR=driver leaves host memory to the driver, to compare against
+      const char* hostAllocatorMode = std::getenv("HOST_ALLOCATOR");
+      hostCallbacks = hostAllocatorMode && strcmp(hostAllocatorMode, "driver") == 0 ? nullptr : hostAllocator.callbacks();
+
       //optional struct, good habit)
       VkApplicationInfo appInfo = {};
       appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
@@ -216,12 +436,24 @@ private:
       uint32_t glfwExtensionCount = 0;
       const char** glfwExtensions;
       glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-      createInfo.enabledExtensionCount = glfwExtensionCount; //number of global extensions to enable
-      createInfo.ppEnabledExtensionNames = glfwExtensions; //array of names of extensions to enable
+      std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+      //optional: VK_EXT_memory_budget is queried through vkGetPhysicalDeviceMemoryProperties2KHR, which this provides on Vulkan 1.0
+      uint32_t availableCount = 0;
+      vkEnumerateInstanceExtensionProperties(nullptr, &availableCount, nullptr);
+      std::vector<VkExtensionProperties> available(availableCount);
+      vkEnumerateInstanceExtensionProperties(nullptr, &availableCount, available.data());
+      for (const auto& extension : available) {
+        if (strcmp(extension.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0) {
+          extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+          physicalDeviceProperties2Enabled = true;
+        }
+      }
+      createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size()); //number of global extensions to enable
+      createInfo.ppEnabledExtensionNames = extensions.data(); //array of names of extensions to enable
 
       //create an vulkan instance, put it into VkInstance instance
       //                  pCreateInfo pAllocator pInstance
-      if(vkCreateInstance(&createInfo, nullptr, &instance)!=VK_SUCCESS){
+      if(vkCreateInstance(&createInfo, hostCallbacks, &instance)!=VK_SUCCESS){
         //means either VK_ERROR_LAYER_NOT_PRESENT or VK_ERROR_EXTENSION_NOT_PRESENT
         throw std::runtime_error("createInstance() failed!");
       }
@@ -289,15 +521,21 @@ private:
 
   /**** Create Window Surface ****/
     void createSurface() {
-      if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS) {
+      if (glfwCreateWindowSurface(instance, window, hostCallbacks, &surface) != VK_SUCCESS) {
         throw std::runtime_error("failed to create window surface!");
       }
     }
   /**** Create Window Surface ****/
 
   /**** Pick Compatiable Physical Device ****/
+    /*
+      Every device is scored (see scorePhysicalDevice() in deviceSelection.h) and the
+      best one that can present to our surface wins. The scoring inputs come from
+      DEVICE_PROBE_CACHE_FILE when the driver hasn't changed since the last run, so
+      only the cheap vkGetPhysicalDeviceProperties call (needed to tell whether it
+      has) and the surface checks happen on every launch.
+    */
     void pickPhysicalDevice() {
-      //pick the gpu(s) to use
       uint32_t deviceCount = 0;
       vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
       if (deviceCount == 0) {
@@ -305,54 +543,90 @@ private:
       }
       std::vector<VkPhysicalDevice> devices(deviceCount);
       vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
-      //just pick the first valid one
-      for (const auto& device : devices) {
-        if (isDeviceSuitable(device)) {
-          physicalDevice = device;
+
+      const char* cachePath = std::getenv("DEVICE_PROBE_CACHE_PATH");
+      DeviceProbeCache probeCache(cachePath ? cachePath : DEVICE_PROBE_CACHE_FILE);
+      probeCache.load();
+      uint64_t extensionsHash = hashDeviceExtensions(deviceExtensions);
+      struct Candidate {
+        size_t index; //enumeration order, what an index override refers to
+        VkPhysicalDevice device;
+        DeviceProbe probe;
+        int64_t score;
+        bool cached;
+      };
+      std::vector<Candidate> candidates;
+      for (size_t i = 0; i < devices.size(); i++) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(devices[i], &properties);
+        Candidate candidate = {i, devices[i], {}, 0, false};
+        if (const DeviceProbe* cached = probeCache.find(properties, extensionsHash)) {
+          candidate.probe = *cached;
+          candidate.cached = true;
+        } else {
+          ProfileScope scope("probePhysicalDevice");
+          candidate.probe = probePhysicalDevice(devices[i], properties, deviceExtensions);
+          probeCache.store(candidate.probe);
+        }
+        candidate.score = scorePhysicalDevice(candidate.probe);
+        candidates.push_back(candidate);
+      }
+      if (!probeCache.save()) {
+        std::cout << "device probe: can't write cache" << std::endl;
+      }
+      //best first; equal scores keep enumeration order
+      std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.score > b.score;
+      });
+
+      std::string selection = deviceSelection;
+      if (selection.empty()) {
+        if (const char* env = std::getenv("GPU_DEVICE")) {
+          selection = env;
+        }
+      }
+      const Candidate* chosen = nullptr;
+      for (const auto& candidate : candidates) {
+        if (candidate.score >= 0 && deviceMatchesOverride(candidate.probe, candidate.index, selection)
+            && isDeviceSuitable(candidate.device)) {
+          chosen = &candidate;
           break;
         }
       }
-      if (physicalDevice == VK_NULL_HANDLE) {
+
+      std::cout << "GPUs, best first:" << std::endl;
+      for (const auto& candidate : candidates) {
+        const DeviceProbe& probe = candidate.probe;
+        std::cout << (&candidate == chosen ? " * " : "   ") << "[" << candidate.index << "] " << probe.deviceName
+                  << " (" << deviceTypeName(probe.deviceType) << ", " << (probe.deviceLocalBytes >> 20) << " MiB"
+                  << (probe.dedicatedTransferFamily != NO_QUEUE_FAMILY ? ", transfer queue" : "")
+                  << (probe.dedicatedComputeFamily != NO_QUEUE_FAMILY ? ", compute queue" : "")
+                  << ") score " << candidate.score << (candidate.cached ? ", cached probe" : "") << std::endl;
+      }
+      if (!chosen) {
+        if (!selection.empty()) {
+          throw std::runtime_error("no suitable GPU matches \"" + selection + "\" (--gpu / GPU_DEVICE)");
+        }
         throw std::runtime_error("failed to find a suitable GPU!");
       }
+      physicalDevice = chosen->device;
+      physicalDeviceProbe = chosen->probe;
     }
 
+    //the surface dependent half of suitability; extensions and the rest were settled by the probe
     bool isDeviceSuitable(VkPhysicalDevice device) {
-      //could search for and rank physical devices based on below vk command
-      /* VkPhysicalDeviceProperties deviceProperties;
-      // vkGetPhysicalDeviceProperties(device, &deviceProperties);
-      // VkPhysicalDeviceFeatures deviceFeatures;
-      // vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
-      // int score = 0;
-      // // Discrete GPUs have a significant performance advantage
-      // if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-      //   score += 1000;
-      // }
-      // // Maximum possible size of textures affects graphics quality
-      // score += deviceProperties.limits.maxImageDimension2D;
-      // // Application can't function without geometry shaders
-      // if (!deviceFeatures.geometryShader) {
-      //   return 0;
-      // }
-      // return score;
-      */
-
       //see if pysical device queue family supports queues for logical device
       QueueFamilyIndices indices = findQueueFamilies(device);
-      //see if physical device supports extensions needed for swapchain
-      bool extensionsSupported = checkDeviceExtensionSupport(device);
       //confirm that swapchain and window surface are compatable
-      bool swapChainAdequate = false;
-      if (extensionsSupported) {
-        SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
-        swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
-      }
-      return indices.isComplete() && extensionsSupported && swapChainAdequate;
+      SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
+      bool swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
+      return indices.isComplete() && swapChainAdequate;
     }
 
     struct QueueFamilyIndices {
       std::optional<uint32_t> graphicsFamily; //optional<> allows has_value() query
       std::optional<uint32_t> presentFamily; //for ensuring device surface is compatible
+      std::optional<uint32_t> transferFamily; //transfer only (no graphics or compute): copies there overlap rendering. Not required
       bool isComplete() {
         return graphicsFamily.has_value() && presentFamily.has_value();
       }
@@ -373,36 +647,27 @@ private:
       */
       int i = 0;
       for (const auto& queueFamily : queueFamilies) {
-        if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-          indices.graphicsFamily = i;
-        }
-        //if we find valid graphics, see if also valid surface compatibility
-        VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
-        if (presentSupport) {
-          indices.presentFamily = i;
+        //keep looking for a transfer family after graphics and present are settled
+        if (!indices.isComplete()) {
+          if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            indices.graphicsFamily = i;
+          }
+          //if we find valid graphics, see if also valid surface compatibility
+          VkBool32 presentSupport = false;
+          vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+          if (presentSupport) {
+            indices.presentFamily = i;
+          }
         }
-        if (indices.isComplete()) {
-          break; //dunno why this isn't just above but okay
+        if (!indices.transferFamily && queueFamily.queueCount > 0 && (queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT)
+            && !(queueFamily.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+          indices.transferFamily = i;
         }
         i++;
       }
       return indices;
     }
 
-    bool checkDeviceExtensionSupport(VkPhysicalDevice device) {
-      //enumerate the extensions and check if all of the required extensions are amongst them
-      uint32_t extensionCount;
-      vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
-      std::vector<VkExtensionProperties> availableExtensions(extensionCount);
-      vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
-      std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
-      for (const auto& extension : availableExtensions) {
-          requiredExtensions.erase(extension.extensionName);
-      }
-
-      return requiredExtensions.empty();
-    }
   /**** Pick Compatiable Physical Device ****/
 
   /**** Use Compatable Physical Device to create Logical Device ****/
@@ -411,6 +676,10 @@ private:
       std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
       //after finding queue indices, figure out which ones in the family(s) are unique
       std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+      if (indices.transferFamily) {
+        uniqueQueueFamilies.insert(indices.transferFamily.value());
+      }
+      float queuePriority = 1.0f; //outlives the loop, pQueuePriorities points at it until vkCreateDevice
       for (uint32_t queueFamily : uniqueQueueFamilies) {
         //logical device queue
         VkDeviceQueueCreateInfo queueCreateInfo = {};
@@ -419,12 +688,16 @@ private:
         //queueCreateInfo.flags = VkInstanceCreateFlags struct //bitmask indicating behavior of the queue
         queueCreateInfo.queueFamilyIndex = queueFamily;//indices.[graphics/present]Family.value();
         queueCreateInfo.queueCount = 1; //THIS DESCRIBES THE NUMBER OF QUEUES TO USE IN A SINGLE QUEUE FAMILY https://vulkan-tutorial.com/Drawing_a_triangle/Setup/Logical_device_and_queues#page_Specifying-the-queues-to-be-created
-        float queuePriority = 1.0f;
         queueCreateInfo.pQueuePriorities = &queuePriority;
         queueCreateInfos.push_back(queueCreateInfo);
       }
       //logical device features from physical device
       VkPhysicalDeviceFeatures deviceFeatures = {}; //coulg get these to put into VkDeviceCreateInfo struct, but optional
+      //GPU-driven drawing: many indirect draws per call, and firstInstance in the commands picking each object's instance data
+      multiDrawIndirectEnabled = physicalDeviceProbe.multiDrawIndirect != 0;
+      drawIndirectFirstInstanceEnabled = physicalDeviceProbe.drawIndirectFirstInstance != 0;
+      deviceFeatures.multiDrawIndirect = multiDrawIndirectEnabled ? VK_TRUE : VK_FALSE;
+      deviceFeatures.drawIndirectFirstInstance = drawIndirectFirstInstanceEnabled ? VK_TRUE : VK_FALSE;
 
       //logical device!
       VkDeviceCreateInfo createInfo = {};
@@ -439,21 +712,187 @@ private:
       } else {
           createInfo.enabledLayerCount = 0;
       }
-      //currently only used for swapchain extension
-      createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-      createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+      //the swapchain, plus VK_EXT_memory_budget (see memoryTelemetry.h) and VK_KHR_draw_indirect_count (see gpuCulling.h) when the device has them
+      std::vector<const char*> extensions = deviceExtensions;
+      memoryBudgetEnabled = physicalDeviceProperties2Enabled && physicalDeviceProbe.memoryBudgetSupported;
+      if (memoryBudgetEnabled) {
+        extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+      }
+      bool drawIndirectCountEnabled = physicalDeviceProbe.drawIndirectCountSupported != 0;
+      if (drawIndirectCountEnabled) {
+        extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+      }
+      createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+      createInfo.ppEnabledExtensionNames = extensions.data();
       createInfo.pEnabledFeatures = &deviceFeatures;
 
-      if (vkCreateDevice(physicalDevice, &createInfo, nullptr, &device) != VK_SUCCESS) {
+      if (vkCreateDevice(physicalDevice, &createInfo, hostCallbacks, &device) != VK_SUCCESS) {
         throw std::runtime_error("failed to create logical device!");
       }
+      if (drawIndirectCountEnabled) {
+        cmdDrawIndexedIndirectCount = reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR"));
+      }
       //use build in fn to get logical device's queue handle (for the graphicsQueue)
       vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
       //use build in fn to get logical device's queue handle (for the graphicsQueue)
       vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+      //no transfer only family: uploads share the graphics queue (AsyncUploader then skips the ownership transfers)
+      vkGetDeviceQueue(device, indices.transferFamily.value_or(indices.graphicsFamily.value()), 0, &transferQueue);
     }
   /**** Use Compatable Physical Device to create Logical Device ****/
 
+  /**** Pipeline Cache ****/
+    /*
+      Building a pipeline makes the driver compile our SPIR-V down to the GPU's own
+      instructions, which is the slow part of vkCreateGraphicsPipelines. A
+      VkPipelineCache keeps those results, and vkGetPipelineCacheData lets us save
+      them to disk so the next launch can skip the work.
+      The data is only valid for the exact device and driver that produced it. Every
+      blob starts with a header (length, version, vendorID, deviceID, pipelineCacheUUID),
+      and we check it ourselves before handing the data back to the driver. Drivers
+      are supposed to reject foreign data, but not all of them do it gracefully.
+      Our file wraps the driver's blob in a small header of our own with a checksum
+      and the cold creation time, so we can log how much time the cache saves.
+    */
+    struct PipelineCacheFileHeader {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t dataSize; //bytes of driver cache data following this header
+      uint64_t dataChecksum; //fnv1a64 of the driver data, catches truncated writes
+      double coldCreateMs; //pipeline creation time without a cache, for the savings log
+    };
+    static const uint32_t PIPELINE_CACHE_FILE_MAGIC = 0x43504B56; //"VKPC"
+    static const uint32_t PIPELINE_CACHE_FILE_VERSION = 1;
+
+    std::string pipelineCachePath() {
+      const char* path = std::getenv("PIPELINE_CACHE_PATH");
+      return path ? path : PIPELINE_CACHE_FILE;
+    }
+
+    //the first 16 + VK_UUID_SIZE bytes of any cache blob are the header version one layout
+    bool pipelineCacheDataMatchesDevice(const std::vector<char>& data) {
+      const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+      if (data.size() < headerSize) {
+        return false;
+      }
+      uint32_t header[4]; //headerLength, headerVersion, vendorID, deviceID
+      std::memcpy(header, data.data(), sizeof(header));
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+      return header[0] >= headerSize && header[0] <= data.size()
+          && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+          && header[2] == properties.vendorID
+          && header[3] == properties.deviceID
+          && std::memcmp(data.data() + sizeof(header), properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    }
+
+    std::vector<char> loadPipelineCacheData() {
+      std::vector<char> data;
+      std::string path = pipelineCachePath();
+      std::ifstream file(path, std::ios::binary);
+      if (!file.is_open()) {
+        std::cout << "pipeline cache: no saved cache, starting cold" << std::endl;
+        return data;
+      }
+      PipelineCacheFileHeader header = {};
+      file.read(reinterpret_cast<char*>(&header), sizeof(header));
+      if (!file.good() || header.magic != PIPELINE_CACHE_FILE_MAGIC || header.version != PIPELINE_CACHE_FILE_VERSION) {
+        std::cout << "pipeline cache: unrecognized file, discarding" << std::endl;
+        return data;
+      }
+      //check the size against the file before allocating it, a damaged header could ask for anything
+      std::error_code ec;
+      uintmax_t fileSize = std::filesystem::file_size(path, ec);
+      if (ec || header.dataSize != fileSize - sizeof(header)) {
+        std::cout << "pipeline cache: truncated or corrupt, discarding" << std::endl;
+        return data;
+      }
+      data.resize(header.dataSize);
+      file.read(data.data(), header.dataSize);
+      if (file.gcount() != static_cast<std::streamsize>(header.dataSize) || fnv1a64(data.data(), data.size()) != header.dataChecksum) {
+        std::cout << "pipeline cache: truncated or corrupt, discarding" << std::endl;
+        data.clear();
+        return data;
+      }
+      if (!pipelineCacheDataMatchesDevice(data)) {
+        std::cout << "pipeline cache: saved for a different device or driver, discarding" << std::endl;
+        data.clear();
+        return data;
+      }
+      coldPipelineCreateMs = header.coldCreateMs;
+      return data;
+    }
+
+    void createPipelineCache() {
+      std::vector<char> initialData = loadPipelineCacheData();
+      VkPipelineCacheCreateInfo cacheInfo = {};
+      cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+      cacheInfo.initialDataSize = initialData.size();
+      cacheInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+      if (vkCreatePipelineCache(device, &cacheInfo, hostCallbacks, &pipelineCache) != VK_SUCCESS) {
+        //the driver is allowed to refuse data it doesn't like, so retry empty before giving up
+        cacheInfo.initialDataSize = 0;
+        cacheInfo.pInitialData = nullptr;
+        initialData.clear();
+        if (vkCreatePipelineCache(device, &cacheInfo, hostCallbacks, &pipelineCache) != VK_SUCCESS) {
+          throw std::runtime_error("failed to create pipeline cache!");
+        }
+      }
+      pipelineCacheWarm = !initialData.empty();
+      if (pipelineCacheWarm) {
+        std::cout << "pipeline cache: loaded " << initialData.size() << " bytes" << std::endl;
+      }
+    }
+
+    //called from cleanup(), writes to a temp file first so a crash mid-write can't leave a torn cache
+    void savePipelineCache() {
+      size_t dataSize = 0;
+      if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0) {
+        return;
+      }
+      std::vector<char> data(dataSize);
+      if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data()) != VK_SUCCESS) {
+        return;
+      }
+      data.resize(dataSize);
+      PipelineCacheFileHeader header = {};
+      header.magic = PIPELINE_CACHE_FILE_MAGIC;
+      header.version = PIPELINE_CACHE_FILE_VERSION;
+      header.dataSize = data.size();
+      header.dataChecksum = fnv1a64(data.data(), data.size());
+      header.coldCreateMs = coldPipelineCreateMs;
+      std::string path = pipelineCachePath();
+      std::string tempPath = path + ".tmp";
+      std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+      if (!file.is_open()) {
+        std::cout << "pipeline cache: can't write " << tempPath << std::endl;
+        return;
+      }
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.write(data.data(), data.size());
+      file.close();
+      if (!file.good() || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+        std::cout << "pipeline cache: failed to save " << path << std::endl;
+        return;
+      }
+      std::cout << "pipeline cache: saved " << data.size() << " bytes to " << path << std::endl;
+    }
+
+    //logs creation time, and how much of it the cache saved when we started warm
+    void reportPipelineCreateTime(double createMs) {
+      if (!pipelineCacheWarm) {
+        coldPipelineCreateMs = createMs;
+        std::cout << "pipeline creation: " << createMs << " ms (cold cache)" << std::endl;
+      } else if (coldPipelineCreateMs > 0.0) {
+        std::cout << "pipeline creation: " << createMs << " ms (warm cache, cold was " << coldPipelineCreateMs
+                  << " ms, saved " << coldPipelineCreateMs - createMs << " ms)" << std::endl;
+      } else {
+        std::cout << "pipeline creation: " << createMs << " ms (warm cache)" << std::endl;
+      }
+    }
+  /**** Pipeline Cache ****/
+
   /**** Create SwapChain ****/
     /*
       infrastructure that will own the buffers we will render to before 
@@ -504,7 +943,7 @@ private:
       createInfo.presentMode = presentMode;
       createInfo.clipped = VK_TRUE; //ignore pixels with other things in front of them
       //createInfo.oldSwapchain;//assume we only ever make one swapchain, come back to this later TODO
-      if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS) {
+      if (vkCreateSwapchainKHR(device, &createInfo, hostCallbacks, &swapChain) != VK_SUCCESS) {
         throw std::runtime_error("failed to create swap chain!");
       }
       //now get the images
@@ -619,7 +1058,7 @@ private:
         createInfo.subresourceRange.levelCount = 1;
         createInfo.subresourceRange.baseArrayLayer = 0;
         createInfo.subresourceRange.layerCount = 1; 
-        if (vkCreateImageView(device, &createInfo, nullptr, &swapChainImageViews[i]) != VK_SUCCESS) {
+        if (vkCreateImageView(device, &createInfo, hostCallbacks, &swapChainImageViews[i]) != VK_SUCCESS) {
           throw std::runtime_error("failed to create image views!");
         }
       }
@@ -633,83 +1072,415 @@ private:
       how many color and depth buffers there will be
       how many samples to use for each of them
       how their contents should be handled throughout the rendering operations
-      All of this information is wrapped in a render pass object
+      All of this information is wrapped in a render pass object.
+      The render graph (see renderGraph.h) works all of that out from what each pass
+      reads and writes, along with the barriers between passes and their framebuffers;
+      renderPass is the scene pass's, which the pipelines are built against.
     */
-    void createRenderPass() {
-      //subpass dependencies added for transitions
-      VkSubpassDependency dependency = {};
-      dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-      dependency.dstSubpass = 0;
-      dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-      dependency.srcAccessMask = 0;
-      dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-      dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
-      //attachment description
-      VkAttachmentDescription colorAttachment = {};
-      colorAttachment.format = swapChainImageFormat; //format of the color attachment should match the format of the swap chain images
-      colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT; //no multisampling yet
-      colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR; //what to do with the data in the attachment before rendering: CLEAR them (PRESERVE, DONT_CARE)
-      colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE; //what to do with the data in the attachment after rendering: STORE them to read (and render) later (DONT_CARE)
-      colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE; //we don't do anything with the stencil buffer
-      colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-      colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; //what we use images in the buffer for (color, actual image, destination)
-      colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; //layout to automatically transition to when the render pass finishes
-      //subpasses and attachment references
-      VkAttachmentReference colorAttachmentRef = {};
-      colorAttachmentRef.attachment = 0;
-      colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-      VkSubpassDescription subpass = {};
-      subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-      subpass.colorAttachmentCount = 1;
-      subpass.pColorAttachments = &colorAttachmentRef;
-      //build the render pass!
-      VkRenderPassCreateInfo renderPassInfo = {};
-      renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-      renderPassInfo.attachmentCount = 1;
-      renderPassInfo.pAttachments = &colorAttachment;
-      renderPassInfo.subpassCount = 1;
-      renderPassInfo.pSubpasses = &subpass;
-      renderPassInfo.dependencyCount = 1;
-      renderPassInfo.pDependencies = &dependency;
-
-      if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) {
-          throw std::runtime_error("failed to create render pass!");
-      }
+    void createRenderGraph() {
+      renderGraph.init(device, gpuAllocator, hostCallbacks);
+      RenderImageDesc swapChainDesc;
+      swapChainDesc.format = swapChainImageFormat;
+      swapChainDesc.extent = swapChainExtent;
+      //the acquire semaphore is waited on at COLOR_ATTACHMENT_OUTPUT; contents don't matter, the scene clears them
+      RenderResource swapChainImage = renderGraph.importImage("swapchain", swapChainDesc, swapChainImageViews, VK_IMAGE_LAYOUT_UNDEFINED,
+                                                              VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0);
+      VkClearColorValue clearColor = {{0.0f, 0.0f, 0.0f, 1.0f}};
+      scenePass = renderGraph.addPass("scene",
+          [&](RenderGraph::PassBuilder& pass) {
+            pass.writeColor(swapChainImage, clearColor);
+            pass.contents(VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS); //draws are recorded on several threads, see executeScene()
+          },
+          [this](const RenderPassContext& context) { executeScene(context); });
+      renderGraph.markOutput(swapChainImage); //presented
+      renderGraph.compile();
+      renderPass = renderGraph.renderPass(scenePass);
+    }
+
+    //debug builds: culling and transient aliasing on a throwaway offscreen graph, under the validation layers
+    void checkRenderGraph() {
+      std::cout << "render graph check passed: " << ::checkRenderGraph(device, gpuAllocator, hostCallbacks) << std::endl;
     }
   /**** Create Render Pass ****/
 
   /**** Create Graphics Pipeline ****/
+    /*
+      SPIR-V for one shader stage. When it comes from the shader archive it points
+      straight into the mapping (no copy); otherwise it owns the compiled words.
+    */
+    struct ShaderCode {
+      const uint32_t* mapped = nullptr;
+      size_t mappedSize = 0;
+      std::vector<uint32_t> owned;
+      uint64_t key = 0; //shader cache key of the source it came from, 0 if unknown (then reflection isn't cached)
+      const uint32_t* data() const { return mapped ? mapped : owned.data(); }
+      size_t size() const { return mapped ? mappedSize : owned.size() * sizeof(uint32_t); } //in bytes, like codeSize
+    };
+
+    /*
+      Shader permutations. Variant switches are specialization constants, so one SPIR-V
+      module serves every variant and only the VkSpecializationInfo differs between
+      pipelines. Nothing is built up front: getPipelineVariant() queues a variant on the
+      pipeline compiler the first time it is asked for and keeps the handle after that.
+      Only the default variant is built synchronously, at startup, because it is the
+      fallback that draws while other variants compile.
+    */
+    std::future<std::pair<ShaderCode, ShaderReflection>> vertShaderLoad; //started by startShaderLoads(), joined in createGraphicsPipeline()
+    std::future<std::pair<ShaderCode, ShaderReflection>> fragShaderLoad;
+    ShaderCode activeVertShaderCode; //kept so variants can be built after startup
+    ShaderCode activeFragShaderCode;
+    PipelineCompiler pipelineCompiler; //worker threads for variant builds, see pipelineCompiler.h
+    std::map<ShaderVariant, PipelineHandle> pipelineVariants; //every variant asked for so far (normalized), built or building
+    std::vector<PipelineHandle> abandonedBuilds; //dropped by destroyPipelineVariants() while still building, destroyed once done
+    VkPipeline fallbackPipeline = VK_NULL_HANDLE; //the default variant
+    ShaderVariant activeVariant; //variant the draws ask for (normalized); graphicsPipeline is it, or the fallback until it's built
+    bool waitingForPipeline = false; //activeVariant is still compiling
+    size_t fallbackFrames = 0; //frames drawn with the fallback (or skipped) while waiting
+    ShaderVariant requestedVariant; //what the user asked for, applied at the next frame
+    ShaderVariant appliedRequest; //the last requestedVariant drawFrame() acted on
+
     void createGraphicsPipeline() {
       //use libshaderc to compile shaders internally! (NOT FROM TUTORIAL)
-      //first, convert .vert and .frag to strings
-      std::ifstream vertStream("shaders/vertexShader.vert");
-      std::string vertShaderString((std::istreambuf_iterator<char>(vertStream)), std::istreambuf_iterator<char>());
-      std::ifstream fragStream("shaders/fragmentShaderHack.frag");
-      std::string fragShaderString((std::istreambuf_iterator<char>(fragStream)), std::istreambuf_iterator<char>());
-      //second, compile into SPIR-V, which return a shaderc_compilation_result_t
-      shaderc_compiler_t compiler = shaderc_compiler_initialize();
-      shaderc_compilation_result_t vertShaderCode = shaderc_compile_into_spv(
-         compiler, vertShaderString.c_str(), vertShaderString.size(),
-         shaderc_glsl_vertex_shader, "shaders/vertexShaderHack.vert", "main", nullptr);
-      shaderc_compilation_result_t fragShaderCode = shaderc_compile_into_spv(
-         compiler, fragShaderString.c_str(), fragShaderString.size(),
-         shaderc_glsl_fragment_shader, "shaders/fragmentShaderHack.frag", "main", nullptr);
-      //initialize vectors from the getter functions of the shaderc_compilation_result_t (|byte| == |char|)
-      std::vector<char> vertShaderCodeVector(shaderc_result_get_bytes(vertShaderCode),
-                          shaderc_result_get_bytes(vertShaderCode)+shaderc_result_get_length(vertShaderCode));
-      std::vector<char> fragShaderCodeVector(shaderc_result_get_bytes(fragShaderCode),
-                          shaderc_result_get_bytes(fragShaderCode)+shaderc_result_get_length(fragShaderCode));
-      shaderc_result_release(vertShaderCode);
-      shaderc_result_release(fragShaderCode);
-      shaderc_compiler_release(compiler);
+      //the shaders have been loading since startShaderLoads(), usually they are done by now
+      ShaderCode vertShaderCode, fragShaderCode;
+      {
+        ProfileScope scope("wait for shaders", "shader");
+        std::tie(vertShaderCode, vertShaderReflection) = vertShaderLoad.get(); //rethrows compile errors
+        std::tie(fragShaderCode, fragShaderReflection) = fragShaderLoad.get();
+      }
+      std::cout << "shader cache: " << shaderCache.hits() << " hits, " << shaderCache.misses() << " misses" << std::endl;
       
       // // if you were to do manual compilation (and produce vert.spv and frag.spv), you could read the binary code like this
       // auto vertShaderCodeVector1 = readFileSPV("shaders/vert.spv"); //compile command: vulkansdk-macos-1.1.126.0/macOS/bin/glslc vertexShader.frag -o vert.spv
       // auto fragShaderCodeVector1 = readFileSPV("shaders/frag.spv"); //compile command: vulkansdk-macos-1.1.126.0/macOS/bin/glslc fragmentShader.frag -o frag.spv
-      
-      VkShaderModule vertShaderModule = createShaderModule(vertShaderCodeVector);
-      VkShaderModule fragShaderModule = createShaderModule(fragShaderCodeVector);
+
+      createVertexInputState(vertShaderReflection);
+      createPipelineLayout(vertShaderReflection, fragShaderReflection);
+      activeVertShaderCode = std::move(vertShaderCode);
+      activeFragShaderCode = std::move(fragShaderCode);
+      //the pipeline cache lets the driver skip recompiling pipelines it has seen before (see createPipelineCache())
+      auto pipelineStart = std::chrono::steady_clock::now();
+      graphicsPipeline = buildGraphicsPipeline(activeVertShaderCode, activeFragShaderCode);
+      reportPipelineCreateTime(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pipelineStart).count());
+      fallbackPipeline = graphicsPipeline;
+      pipelineVariants[ShaderVariant()] = PipelineHandle::completed(graphicsPipeline);
+    }
+
+    /*
+      Kicks off both shader stages on their own threads. loadShaderCode() prefers the
+      mmapped shader archive, then the on-disk shader cache, and only runs shaderc when
+      both miss; each task reflects its result too. The archive is opened up front so
+      the two tasks don't race to open it; the cache is safe to share between them.
+    */
+    void startShaderLoads() {
+      configureShaderCache();
+      {
+        ProfileScope scope("openShaderArchive", "shader");
+        openShaderArchive();
+      }
+      auto load = [this](const char* filename, shaderc_shader_kind kind) {
+        ProfileScope scope(std::string("load shader ") + filename, "shader");
+        ShaderCode code = loadShaderCode(filename, kind);
+        ShaderReflection reflection = reflectShader(code);
+        return std::make_pair(std::move(code), std::move(reflection));
+      };
+      vertShaderLoad = std::async(std::launch::async, load, VERT_SHADER_FILE, shaderc_glsl_vertex_shader);
+      fragShaderLoad = std::async(std::launch::async, load, FRAG_SHADER_FILE, shaderc_glsl_fragment_shader);
+    }
+
+    //queues the variant on first use. Variants are normalized first, so {} and {COLOR_MODE: 0} are the same pipeline
+    PipelineHandle getPipelineVariant(const ShaderVariant& variant) {
+      ShaderVariant key = normalizeVariant(variant);
+      auto found = pipelineVariants.find(key);
+      if (found != pipelineVariants.end()) {
+        return found->second;
+      }
+      //the job gets its own copy of the code, a hot reload may replace the members before it runs
+      ShaderCode vertShaderCode = activeVertShaderCode;
+      ShaderCode fragShaderCode = activeFragShaderCode;
+      PipelineHandle handle = pipelineCompiler.submit([this, vertShaderCode, fragShaderCode, key]() {
+        std::shared_lock<std::shared_mutex> lock(renderPassMutex); //see buildGraphicsPipeline()
+        return buildGraphicsPipeline(vertShaderCode, fragShaderCode, key);
+      });
+      pipelineVariants[key] = handle;
+      return handle;
+    }
+
+    //drops values equal to the shader's default and throws on constant ids neither stage declares
+    ShaderVariant normalizeVariant(const ShaderVariant& variant) const {
+      ShaderVariant normalized;
+      for (const auto& constant : variant) {
+        const ReflectedSpecConstant* declared = nullptr;
+        for (const ShaderReflection* reflection : {&vertShaderReflection, &fragShaderReflection}) {
+          for (const auto& specConstant : reflection->specConstants) {
+            if (specConstant.constantId == constant.first) {
+              declared = &specConstant;
+            }
+          }
+        }
+        if (!declared) {
+          throw std::runtime_error("no shader stage declares specialization constant " + std::to_string(constant.first) + "!");
+        }
+        if (declared->size != sizeof(uint32_t)) {
+          throw std::runtime_error("specialization constant " + std::to_string(constant.first) + " is not 32 bits!");
+        }
+        if (constant.second != declared->defaultValue) {
+          normalized.insert(constant);
+        }
+      }
+      return normalized;
+    }
+
+    static std::string describeVariant(const ShaderVariant& variant) {
+      std::string description = "{";
+      for (const auto& constant : variant) {
+        description += (description.size() > 1 ? ", " : "") + std::to_string(constant.first) + "=" + std::to_string(constant.second);
+      }
+      return description + "}";
+    }
+
+    /*
+      Called from drawFrame() on a frame boundary when a different variant was asked
+      for. Never waits for a build: if the variant isn't ready yet, updateDrawPipeline()
+      draws with the fallback until it is. Built variants stay in pipelineVariants, so
+      switching back is free.
+    */
+    void selectPipelineVariant(const ShaderVariant& variant) {
+      ShaderVariant key;
+      try {
+        key = normalizeVariant(variant);
+        getPipelineVariant(key);
+      } catch (const std::exception& e) {
+        std::cerr << "shader variant " << describeVariant(variant) << ": " << e.what() << std::endl;
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(pendingPipelineMutex);
+        activeVariant = key;
+      }
+      waitingForPipeline = true;
+      fallbackFrames = 0;
+      updateDrawPipeline();
+    }
+
+    /*
+      Once per frame while waitingForPipeline. Frames are recorded after this, so the
+      next one draws with whatever graphicsPipeline is now. Pipelines aren't destroyed
+      here, so frames still in flight can keep using the old one.
+    */
+    void updateDrawPipeline() {
+      PipelineHandle handle = pipelineVariants[activeVariant];
+      VkPipeline pipeline;
+      if (handle.ready()) {
+        pipeline = handle.get();
+        waitingForPipeline = false;
+        if (fallbackFrames > 0) { //not for variants that were already built
+          std::cout << "shader variant " << describeVariant(activeVariant) << ": built in " << handle.buildMs() << " ms, "
+                    << fallbackFrames << " frames " << (drawFallbackWhilePipelineCompiles ? "drawn with the fallback" : "skipped")
+                    << " meanwhile (" << pipelineVariants.size() << " variants)" << std::endl;
+        }
+      } else if (handle.failed()) {
+        std::cerr << "shader variant " << describeVariant(activeVariant) << ": " << handle.error() << std::endl;
+        pipelineVariants.erase(activeVariant); //asking again retries
+        {
+          std::lock_guard<std::mutex> lock(pendingPipelineMutex);
+          activeVariant = ShaderVariant();
+        }
+        pipeline = fallbackPipeline;
+        waitingForPipeline = false;
+      } else {
+        pipeline = drawFallbackWhilePipelineCompiles ? fallbackPipeline : VK_NULL_HANDLE;
+        fallbackFrames++;
+      }
+      graphicsPipeline = pipeline;
+    }
+
+    //destroys every built variant. In-flight builds aren't waited for (this runs on the render thread),
+    //they go to abandonedBuilds and destroyAbandonedBuilds() gets their pipelines
+    void destroyPipelineVariants() {
+      for (const auto& variant : pipelineVariants) {
+        PipelineStatus status = variant.second.status(); //read once, a build may finish meanwhile
+        if (status == PipelineStatus::Ready) {
+          vkDestroyPipeline(device, variant.second.get(), hostCallbacks);
+        } else if (status == PipelineStatus::Pending) {
+          abandonedBuilds.push_back(variant.second);
+        }
+      }
+      pipelineVariants.clear();
+      graphicsPipeline = VK_NULL_HANDLE;
+      fallbackPipeline = VK_NULL_HANDLE;
+    }
+
+    //once per frame, and at cleanup once the compiler has stopped. Nothing ever drew with these, so no fence to wait on
+    void destroyAbandonedBuilds() {
+      auto finished = std::remove_if(abandonedBuilds.begin(), abandonedBuilds.end(), [this](const PipelineHandle& handle) {
+        PipelineStatus status = handle.status();
+        if (status == PipelineStatus::Ready) {
+          vkDestroyPipeline(device, handle.get(), hostCallbacks);
+        }
+        return status != PipelineStatus::Pending;
+      });
+      abandonedBuilds.erase(finished, abandonedBuilds.end());
+    }
+
+    /*
+      Reflection is keyed like the SPIR-V it was taken from, and stored next to it in
+      the shader cache (as <key>.refl), so a warm start reads a few bytes instead of
+      walking the module again.
+    */
+    ShaderReflection reflectShader(const ShaderCode& code) {
+      ProfileScope scope("reflectShader", "shader");
+      ShaderReflection reflection;
+      std::vector<char> blob;
+      if (code.key != 0 && shaderCache.loadBlob(code.key, ".refl", blob) && deserializeReflection(blob, reflection)) {
+        return reflection;
+      }
+      reflection = reflectSpirv(code.data(), code.size());
+      if (code.key != 0) {
+        shaderCache.storeBlob(code.key, ".refl", serializeReflection(reflection));
+      }
+      return reflection;
+    }
+
+    /*
+      Vertex input: vertex shader inputs below INSTANCE_FIRST_LOCATION come from binding
+      0, per vertex, tightly packed in location order, which is how struct Vertex is
+      laid out. Inputs from INSTANCE_FIRST_LOCATION on come from binding 1, per
+      instance, laid out like struct InstanceData; a shader without any gets no binding
+      1. The stride checks catch the shader and the structs drifting apart, which used
+      to be a silent garbage draw.
+    */
+    void createVertexInputState(const ShaderReflection& vertReflection) {
+      vertexAttributeDescriptions.clear();
+      uint32_t strides[2] = {0, 0}; //per binding
+      for (const auto& input : vertReflection.inputs) {
+        uint32_t binding = input.location < INSTANCE_FIRST_LOCATION ? 0 : 1;
+        VkVertexInputAttributeDescription attribute = {};
+        attribute.binding = binding; //which binding the data comes from
+        attribute.location = input.location; //location from .vert file ex. layout(location = 0)
+        attribute.format = input.format; //implicitly defines the byte size of attribute data
+        attribute.offset = strides[binding]; //specifies the number of bytes since the start of the per-vertex data to read from
+        vertexAttributeDescriptions.push_back(attribute);
+        strides[binding] += input.size;
+      }
+      if (strides[0] != sizeof(Vertex)) {
+        throw std::runtime_error("vertex shader inputs take " + std::to_string(strides[0]) + " bytes but struct Vertex is "
+                                 + std::to_string(sizeof(Vertex)) + "!");
+      }
+      if (strides[1] != 0 && strides[1] != sizeof(InstanceData)) {
+        throw std::runtime_error("vertex shader instance inputs take " + std::to_string(strides[1]) + " bytes but struct InstanceData is "
+                                 + std::to_string(sizeof(InstanceData)) + "!");
+      }
+      vertexBindingDescriptions.clear();
+      VkVertexInputBindingDescription perVertex = {};
+      perVertex.binding = 0;
+      perVertex.stride = strides[0];
+      perVertex.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+      vertexBindingDescriptions.push_back(perVertex);
+      if (strides[1] != 0) {
+        VkVertexInputBindingDescription perInstance = {};
+        perInstance.binding = 1;
+        perInstance.stride = strides[1];
+        perInstance.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE; //advances once per instance, not per vertex
+        vertexBindingDescriptions.push_back(perInstance);
+      }
+    }
+
+    /*
+      Pipeline layout: specify uniform values (uniform values in shaders, used to pass
+      the transformation matrix to the vertex shader, to create texture samplers in the
+      fragment shader.) Built from the reflected descriptor bindings and push constant
+      blocks of both stages. A binding used by both stages gets both stage flags, and
+      set numbers the shaders skip get an empty layout so set N stays at index N.
+    */
+    void createPipelineLayout(const ShaderReflection& vertReflection, const ShaderReflection& fragReflection) {
+      std::vector<std::vector<VkDescriptorSetLayoutBinding>> sets;
+      std::vector<VkPushConstantRange> pushConstantRanges;
+      for (const ShaderReflection* reflection : {&vertReflection, &fragReflection}) {
+        for (const auto& reflected : reflection->bindings) {
+          if (reflected.set >= sets.size()) {
+            sets.resize(reflected.set + 1);
+          }
+          auto& bindings = sets[reflected.set];
+          auto existing = std::find_if(bindings.begin(), bindings.end(), [&reflected](const VkDescriptorSetLayoutBinding& b) {
+            return b.binding == reflected.binding;
+          });
+          if (existing != bindings.end()) {
+            if (existing->descriptorType != reflected.type || existing->descriptorCount != reflected.count) {
+              throw std::runtime_error("shader stages disagree about set " + std::to_string(reflected.set) + " binding "
+                                       + std::to_string(reflected.binding) + "!");
+            }
+            existing->stageFlags |= reflection->stage;
+            continue;
+          }
+          VkDescriptorSetLayoutBinding binding = {};
+          binding.binding = reflected.binding;
+          binding.descriptorType = reflected.type;
+          binding.descriptorCount = reflected.count;
+          binding.stageFlags = reflection->stage;
+          bindings.push_back(binding);
+        }
+        if (reflection->pushConstantSize > 0) {
+          //glslang lays out every stage's block from offset 0, so each stage's range starts there too
+          pushConstantRanges.push_back({static_cast<VkShaderStageFlags>(reflection->stage), 0, reflection->pushConstantSize});
+        }
+      }
+
+      descriptorSetLayouts.resize(sets.size());
+      for (size_t i = 0; i < sets.size(); i++) {
+        VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = static_cast<uint32_t>(sets[i].size());
+        layoutInfo.pBindings = sets[i].data();
+        if (vkCreateDescriptorSetLayout(device, &layoutInfo, hostCallbacks, &descriptorSetLayouts[i]) != VK_SUCCESS) {
+          throw std::runtime_error("failed to create descriptor set layout!");
+        }
+      }
+
+      VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+      pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+      pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(descriptorSetLayouts.size());
+      pipelineLayoutInfo.pSetLayouts = descriptorSetLayouts.data();
+      pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(pushConstantRanges.size());
+      pipelineLayoutInfo.pPushConstantRanges = pushConstantRanges.data();
+      if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, hostCallbacks, &pipelineLayout) != VK_SUCCESS) {
+          throw std::runtime_error("failed to create pipeline layout!");
+      }
+    }
+
+    //true if the pipeline layout and vertex input built from a can be reused for b. Specialization constants don't matter here
+    static bool sameShaderInterface(ShaderReflection a, ShaderReflection b) {
+      a.specConstants.clear();
+      b.specConstants.clear();
+      return serializeReflection(a) == serializeReflection(b);
+    }
+
+    /*
+      Everything that goes into a graphics pipeline except the layout and render pass,
+      which are shared. Split out of createGraphicsPipeline() so shader hot reload can
+      build replacement pipelines from freshly compiled code. Safe to call from another
+      thread: vkCreateGraphicsPipelines and the pipeline cache are internally synchronized.
+      The caller holds renderPassMutex.
+    */
+    VkPipeline buildGraphicsPipeline(const ShaderCode& vertShaderCode, const ShaderCode& fragShaderCode, const ShaderVariant& variant = {}) {
+      ProfileScope scope("buildGraphicsPipeline", "pipeline");
+      VkShaderModule vertShaderModule = createShaderModule(vertShaderCode.data(), vertShaderCode.size());
+      VkShaderModule fragShaderModule = createShaderModule(fragShaderCode.data(), fragShaderCode.size());
+
+      //specialization constants: every value is one 32 bit word. The same info goes to both stages,
+      //entries for ids a stage doesn't declare are ignored by Vulkan
+      std::vector<VkSpecializationMapEntry> specializationEntries;
+      std::vector<uint32_t> specializationData;
+      for (const auto& constant : variant) {
+        specializationEntries.push_back({constant.first, static_cast<uint32_t>(specializationData.size() * sizeof(uint32_t)), sizeof(uint32_t)});
+        specializationData.push_back(constant.second);
+      }
+      VkSpecializationInfo specializationInfo = {};
+      specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+      specializationInfo.pMapEntries = specializationEntries.data();
+      specializationInfo.dataSize = specializationData.size() * sizeof(uint32_t);
+      specializationInfo.pData = specializationData.data();
+      const VkSpecializationInfo* specialization = variant.empty() ? nullptr : &specializationInfo;
 
       //explicit declaration: Shader info
       //vertex shader in pipeline
@@ -718,14 +1489,14 @@ private:
       vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
       vertShaderStageInfo.module = vertShaderModule;
       vertShaderStageInfo.pName = "main"; //function to invoke aka entrypoint
-      vertShaderStageInfo.pSpecializationInfo = nullptr; //specify values for shader constants
+      vertShaderStageInfo.pSpecializationInfo = specialization; //specify values for shader constants
       //fragment shader in pipeline
       VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
       fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
       fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
       fragShaderStageInfo.module = fragShaderModule;
       fragShaderStageInfo.pName = "main";
-      fragShaderStageInfo.pSpecializationInfo = nullptr; //specify values for shader constants
+      fragShaderStageInfo.pSpecializationInfo = specialization; //specify values for shader constants
       //for reference later
       VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
 
@@ -733,13 +1504,12 @@ private:
       VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
       vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
       //Bindings: spacing between data and whether the data is per-vertex or per-instance
-      auto bindingDescription = Vertex::getBindingDescription();
       //Attribute descriptions: type of the attributes passed to the vertex shader, which binding to load them from and at which offset
-      auto attributeDescriptions = Vertex::getAttributeDescriptions();
-      vertexInputInfo.vertexBindingDescriptionCount = 1;
-      vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-      vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-      vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+      //both reflected from the vertex shader in createVertexInputState()
+      vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(vertexBindingDescriptions.size());
+      vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(vertexAttributeDescriptions.size());
+      vertexInputInfo.pVertexBindingDescriptions = vertexBindingDescriptions.data();
+      vertexInputInfo.pVertexAttributeDescriptions = vertexAttributeDescriptions.data();
 
       //explicit declaration: Input assembly:  what kind of geometry will be drawn from the vertices and if primitive restart should be enabled.
       VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
@@ -747,7 +1517,7 @@ private:
       inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST; //we're draing a triangle
       inputAssembly.primitiveRestartEnable = VK_FALSE;
 
-      // DYNAMIC STATE NOW, SEE createCommandBuffers();. We still need to make all of this on the first pass
+      // DYNAMIC STATE NOW, SEE recordDraws();. We still need to make all of this on the first pass
       //explicit declaration: Viewport: where in the buffer we render to (usually 0,0 to width,height)
       VkViewport viewport = {};
       viewport.x = 0.0f;
@@ -769,9 +1539,9 @@ private:
       VkPipelineViewportStateCreateInfo viewportState = {};
       viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
       viewportState.viewportCount = 1;
-      viewportState.pViewports = nullptr; //now dynamic, see createCommandBuffers()
+      viewportState.pViewports = nullptr; //now dynamic, see recordDraws()
       viewportState.scissorCount = 1;
-      viewportState.pScissors = nullptr; //now dynamic, see createCommandBuffers()
+      viewportState.pScissors = nullptr; //now dynamic, see recordDraws()
 
       //explicit declaration: Rasterizer: The rasterizer takes the geometry that is shaped by the vertices from the vertex shader and turns it into fragments to be colored by the fragment shader. It also performs depth testing, face culling and the scissor test, and it can be configured to output fragments that fill entire polygons or just the edges (wireframe rendering)
       VkPipelineRasterizationStateCreateInfo rasterizer = {};
@@ -838,17 +1608,6 @@ private:
       dynamicState.dynamicStateCount = 2;
       dynamicState.pDynamicStates = dynamicStates;
 
-      //explicit declaration: Pipeline layout: specify uniform values (uniform values in shaders, used to pass the transformation matrix to the vertex shader, to create texture samplers in the fragment shader.) (TODO cuz we don't have any yet)
-      VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-      pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-      pipelineLayoutInfo.setLayoutCount = 0; // Optional
-      pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
-      pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-      pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
-      if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-          throw std::runtime_error("failed to create pipeline layout!");
-      }
-
       /* Final declaration of pipeline information. Summary:
        * VkPiplineShaderStageCreateInfo
        * VkPipelineVertexInputStateCreateInfo
@@ -859,7 +1618,7 @@ private:
        * Depth and stencil testing (not done yet)
        * VkPipelineColorBlendStateCreateInfo
        * VkPipelineDynamicStateCreateInfo
-       * VkPipelineLayoutCreateInfo
+       * VkPipelineLayout (createPipelineLayout())
        * VkRenderPass
       */ 
       VkGraphicsPipelineCreateInfo pipelineInfo = {};
@@ -879,23 +1638,122 @@ private:
       pipelineInfo.subpass = 0;
       pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
       pipelineInfo.basePipelineIndex = -1; // Optional
-      if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
+      VkPipeline pipeline;
+      VkResult result = vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, hostCallbacks, &pipeline);
+      vkDestroyShaderModule(device, fragShaderModule, hostCallbacks);
+      vkDestroyShaderModule(device, vertShaderModule, hostCallbacks);
+      if (result != VK_SUCCESS) {
           throw std::runtime_error("failed to create graphics pipeline!");
       }
-      vkDestroyShaderModule(device, fragShaderModule, nullptr);
-      vkDestroyShaderModule(device, vertShaderModule, nullptr);
+      return pipeline;
+    }
+
+    //SHADER_CACHE_MAX_BYTES caps the on-disk cache so it can't grow forever on long lived hosts
+    void configureShaderCache() {
+      if (const char* maxBytes = std::getenv("SHADER_CACHE_MAX_BYTES")) {
+        shaderCache.setMaxBytes(std::strtoull(maxBytes, nullptr, 10));
+      }
     }
 
-    //for reading the shader's binary spirv code
-    static std::vector<char> readFileSPV(const std::string& filename) {
+    /*
+      GLSL -> SPIR-V through the shader cache. The key covers the source text, the
+      content of every file it #includes, the shader kind, the entry point and the
+      compile options, so any change to those is a miss. On a hit we never even
+      initialize a shaderc compiler. key is set to the key the code is cached under.
+    */
+    std::vector<uint32_t> compileShader(const std::string& filename, const std::string& source, shaderc_shader_kind kind, uint64_t& key) {
+      const char* entryPoint = "main";
+      std::vector<uint32_t> code;
+      {
+        ProfileScope scope("shader cache lookup " + filename, "shader");
+        if (shaderKeyForSource(shaderCache, filename, source, kind, SHADER_DEFAULT_OPTIONS_TAG, key) && shaderCache.load(key, code)) {
+          return code;
+        }
+      }
+      ProfileScope scope("shaderc compile " + filename, "shaderc");
+      //the include callbacks don't change the output, so these still count as default options for the cache tag
+      shaderc_compiler_t compiler = shaderc_compiler_initialize();
+      shaderc_compile_options_t options = shaderc_compile_options_initialize();
+      ShaderIncluder includer;
+      includer.attach(options);
+      shaderc_compilation_result_t result = shaderc_compile_into_spv(
+         compiler, source.c_str(), source.size(), kind, filename.c_str(), entryPoint, options);
+      shaderc_compile_options_release(options);
+      if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) {
+        std::string error = shaderc_result_get_error_message(result);
+        shaderc_result_release(result);
+        shaderc_compiler_release(compiler);
+        throw std::runtime_error("failed to compile " + filename + ":\n" + error);
+      }
+      //copy into whole words, std::vector<uint32_t> storage is always aligned for pCode
+      code.resize(shaderc_result_get_length(result) / sizeof(uint32_t));
+      std::memcpy(code.data(), shaderc_result_get_bytes(result), code.size() * sizeof(uint32_t));
+      shaderc_result_release(result);
+      shaderc_compiler_release(compiler);
+      //key from what the compiler actually saw, and the record that lets the next run find it without compiling
+      key = shaderKeyWithDependencies(ShaderCache::makeKey(source, kind, entryPoint, SHADER_DEFAULT_OPTIONS_TAG), includer.dependencies());
+      if (!includer.dependencies().empty()) {
+        storeShaderDependencies(shaderCache, filename, kind, includer.dependencies());
+      }
+      shaderCache.store(key, reinterpret_cast<const char*>(code.data()), code.size() * sizeof(uint32_t));
+      return code;
+    }
+
+    static bool readShaderSource(const std::string& filename, std::string& source) {
+      std::ifstream stream(filename);
+      if (!stream.is_open()) {
+        return false;
+      }
+      source.assign((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+      return true;
+    }
+
+    void openShaderArchive() {
+      if (shaderArchive.isOpen()) {
+        return;
+      }
+      const char* path = std::getenv("SHADER_ARCHIVE_PATH");
+      if (shaderArchive.open(path ? path : SHADER_ARCHIVE_FILE)) {
+        std::cout << "shader archive: mapped " << shaderArchive.entryCount() << " shaders" << std::endl;
+      }
+    }
+
+    /*
+      Archive first, compiler second. If the GLSL source is around (a dev tree) the
+      archived copy is only used when it was built from that exact source (and includes),
+      so a stale archive can't hide shader edits. Without the source (a packaged build) the
+      archive is all we have, so it is used as is.
+    */
+    ShaderCode loadShaderCode(const std::string& filename, shaderc_shader_kind kind) {
+      ShaderCode code;
+      std::string source;
+      bool haveSource = readShaderSource(filename, source);
+      const ShaderArchiveEntry* entry = shaderArchive.find(filename);
+      uint64_t key = 0;
+      if (entry && entry->kind == static_cast<uint32_t>(kind)
+          && (!haveSource || (shaderKeyForSource(shaderCache, filename, source, kind, SHADER_DEFAULT_OPTIONS_TAG, key) && entry->key == key))) {
+        code.mapped = shaderArchive.code(*entry);
+        code.mappedSize = entry->size;
+        code.key = entry->key;
+        return code;
+      }
+      if (!haveSource) {
+        throw std::runtime_error("failed to open shader " + filename + "!");
+      }
+      code.owned = compileShader(filename, source, kind, code.key);
+      return code;
+    }
+
+    //for reading the shader's binary spirv code (read into words so the buffer is aligned for pCode)
+    static std::vector<uint32_t> readFileSPV(const std::string& filename) {
       std::ifstream file(filename, std::ios::ate | std::ios::binary);
       if (!file.is_open()) {
           throw std::runtime_error("failed to open file!");
       }
       size_t fileSize = (size_t) file.tellg();
-      std::vector<char> buffer(fileSize);
+      std::vector<uint32_t> buffer(fileSize / sizeof(uint32_t));
       file.seekg(0);
-      file.read(buffer.data(), fileSize);
+      file.read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(uint32_t));
       file.close();
       return buffer;
     }
@@ -905,59 +1763,25 @@ private:
       buffer with the bytecode and the length of it. This information is specified
       in a VkShaderModuleCreateInfo structure. The one catch is that the size of
       the bytecode is specified in bytes, but the bytecode pointer is a uint32_t
-      pointer rather than a char pointer. Therefore we will need to cast the
-      pointer with reinterpret_cast as shown below. When you perform a cast like
-      this, you also need to ensure that the data satisfies the alignment
-      requirements of uint32_t. Lucky for us, the data is stored in an std::vector
-      where the default allocator already ensures that the data satisfies the
-      worst case alignment requirements.
+      pointer rather than a char pointer, and the data has to satisfy the alignment
+      requirements of uint32_t. We only ever hand it std::vector<uint32_t> storage
+      or pointers into the shader archive, whose entries are aligned by the packer,
+      so both are fine without a copy.
     */
-    VkShaderModule createShaderModule(const std::vector<char>& code) {
+    VkShaderModule createShaderModule(const uint32_t* code, size_t codeSize) {
       VkShaderModuleCreateInfo createInfo = {};
       createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
       //pNext, flags
-      createInfo.codeSize = code.size();
-      createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+      createInfo.codeSize = codeSize; //in bytes
+      createInfo.pCode = code;
       VkShaderModule shaderModule;
-      if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
+      if (vkCreateShaderModule(device, &createInfo, hostCallbacks, &shaderModule) != VK_SUCCESS) {
         throw std::runtime_error("failed to create shader module!");
       }
       return shaderModule;
     }
   /**** Create Graphics Pipeline ****/
 
-  /**** Create Framebuffers ****/
-    /* we've set up the render pass to expect a single framebuffer with the same format as 
-     * the swap chain images. A framebuffer object references all of the VkImageView objects 
-     * that represent the attachments. In our case that will be only a single one: the 
-     * color attachment. However, the image that we have to use for the attachment depends 
-     * on which image the swap chain returns when we retrieve one for presentation. That 
-     * means that we have to create a framebuffer for all of the images in the swap chain 
-     * and use the one that corresponds to the retrieved image at drawing time.
-     */
-    void createFramebuffers() {
-      //resize vector to hold all the swapchain images, since we need one framebuffer per image
-      swapChainFramebuffers.resize(swapChainImageViews.size()); //recall the image views are how we see the images
-      for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-        VkImageView attachments[] = {
-          swapChainImageViews[i]
-        };
-
-        VkFramebufferCreateInfo framebufferInfo = {};
-        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebufferInfo.renderPass = renderPass;
-        framebufferInfo.attachmentCount = 1;
-        framebufferInfo.pAttachments = attachments;
-        framebufferInfo.width = swapChainExtent.width;
-        framebufferInfo.height = swapChainExtent.height;
-        framebufferInfo.layers = 1; //number of layers in image arrays. Our swap chain images are single images, so the number of layers is 1.
-
-        if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &swapChainFramebuffers[i]) != VK_SUCCESS) {
-          throw std::runtime_error("failed to create framebuffer!");
-        }
-      }
-    }
-  /**** Create Framebuffers ****/
     
   //EVERYTHING IS SET UP FOR RENDERING AT THIS POINT NOW LET'S DO IT!
 
@@ -973,134 +1797,614 @@ private:
      * to the type of queue they are submitted on. 
      * In other words: Pools contain buffers, and both are specific to (and sit on top of) queue family
      */
-    void createCommandPool() {
+    /*
+     * Everything the render loop records is re-recorded every frame, so command buffers
+     * come from FrameContexts (see frameContext.h): a VK_COMMAND_POOL_CREATE_TRANSIENT_BIT
+     * pool per frame in flight and recording thread, reset in bulk when the frame's
+     * fence signals. Renderer code asks frameContexts.commandBuffer() for what it needs.
+     * RECORD_THREADS overrides how many threads record draws (1 records everything on the render thread)
+     */
+    void createFrameContexts() {
       QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
-      VkCommandPoolCreateInfo poolInfo = {};
-      poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-      poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value(); //we're drawing, so we want to use the graphics family
-      poolInfo.flags = 0; // Optional, consists of either VK_COMMAND_POOL_CREATE_TRANSIENT_BIT: Hint that command buffers are rerecorded with new commands very often (may change memory allocation behavior) or VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT: Allow command buffers to be rerecorded individually, without this flag they all have to be reset together
-      if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create command pool!");
-      }
-    }
-
-    void createCommandBuffers() {
-      commandBuffers.resize(swapChainFramebuffers.size());
-      VkCommandBufferAllocateInfo allocInfo = {};
-      allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-      allocInfo.commandPool = commandPool;
-      allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY; //VK_COMMAND_BUFFER_LEVEL_PRIMARY: Can be submitted to a queue for execution, but cannot be called from other command buffers. VK_COMMAND_BUFFER_LEVEL_SECONDARY: Cannot be submitted directly, but can be called from primary command buffers.
-      allocInfo.commandBufferCount = (uint32_t) commandBuffers.size();
-      if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate command buffers!");
-      }
-      //begin recording command buffer
-      for (size_t i = 0; i < commandBuffers.size(); i++) {
-        VkCommandBufferBeginInfo beginInfo = {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = 0; // Optional. VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT: The command buffer will be rerecorded right after executing it once. VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT: This is a secondary command buffer that will be entirely within a single render pass. VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT: The command buffer can be resubmitted while it is also already pending execution.
-        beginInfo.pInheritanceInfo = nullptr; // Used for secondary cbs to inherit state from primary
-        if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS) {
-          throw std::runtime_error("failed to begin recording command buffer!");
+      unsigned threads = defaultRecordThreadCount();
+      if (const char* env = std::getenv("RECORD_THREADS")) {
+        threads = std::max(1u, static_cast<unsigned>(std::strtoul(env, nullptr, 10)));
+      }
+      //we're drawing, so we want to use the graphics family
+      frameContexts.init(device, queueFamilyIndices.graphicsFamily.value(), MAX_FRAMES_IN_FLIGHT, threads, hostCallbacks);
+    }
+
+    void createCommandRecorder() {
+      commandRecorder.init(frameContexts);
+      std::cout << "recording draws on up to " << commandRecorder.threadCount() << " threads" << std::endl;
+    }
+
+    /*
+      What to draw this frame: the mesh once for all of sceneInstances, one instanced
+      indexed draw per batch. The instance data goes into frameData every frame, so
+      it can change freely. The index buffer goes in batches, so big scenes spread
+      over the recording threads. drawPerObject draws the same instances one draw each
+      instead, which is what the instancing benchmark compares against.
+      In GPU-driven mode the draws are decided on the GPU instead, see buildIndirectDraws().
+    */
+    void buildDrawList(VkCommandBuffer commandBuffer) {
+      drawList.clear();
+      if (graphicsPipeline == VK_NULL_HANDLE || sceneInstances.empty()) {
+        return; //the variant is still compiling and drawFallbackWhilePipelineCompiles is off, so only clear
+      }
+      FrameAllocation instances = frameData.push(sceneInstances.data(), sizeof(InstanceData) * sceneInstances.size(), alignof(InstanceData));
+      if (gpuDriven) {
+        buildIndirectDraws(commandBuffer, instances);
+        return;
+      }
+      if (vertexCount == 0) {
+        return; //the mesh is still on its way
+      }
+      uint32_t instanceCount = static_cast<uint32_t>(sceneInstances.size());
+      uint32_t objects = drawPerObject ? instanceCount : 1;
+      for (uint32_t object = 0; object < objects; object++) {
+        for (uint32_t first = 0; first < indexCount; first += DRAW_BATCH_INDICES) {
+          DrawCommand draw;
+          draw.vertexBuffer = vertexBuffer;
+          draw.indexBuffer = indexBuffer;
+          draw.indexType = indexType;
+          draw.firstIndex = first;
+          draw.indexCount = std::min(DRAW_BATCH_INDICES, indexCount - first);
+          draw.instanceBuffer = instances.buffer;
+          draw.instanceOffset = instances.offset;
+          draw.firstInstance = drawPerObject ? object : 0; //per object: same binding, instance data picked by firstInstance
+          draw.instanceCount = drawPerObject ? 1 : instanceCount;
+          drawList.push_back(draw);
+        }
+      }
+    }
+
+    /*
+      GPU-driven mode: the CPU only works out each object's box, and the culling
+      dispatch, recorded into the frame's commandBuffer ahead of the render pass, writes
+      an indexed indirect draw per visible object (see gpuCulling.h). The draw list is
+      then a single indirect draw however many objects there are; without the count
+      extension, or with more objects than one count draw takes, the records are
+      drawn maxDrawIndirectCount at a time, culled ones drawing no instances.
+    */
+    void buildIndirectDraws(VkCommandBuffer commandBuffer, const FrameAllocation& instances) {
+      if (vertexCount == 0 || indexCount == 0) {
+        return; //the mesh is still on its way
+      }
+      objectBounds.resize(sceneInstances.size());
+      for (size_t i = 0; i < sceneInstances.size(); i++) {
+        const glm::vec4& transform = sceneInstances[i].transform; //xy scale, zw offset, as the vertex shader applies it
+        float x0 = meshBounds.x * transform.x + transform.z, x1 = meshBounds.z * transform.x + transform.z;
+        float y0 = meshBounds.y * transform.y + transform.w, y1 = meshBounds.w * transform.y + transform.w;
+        objectBounds[i] = {std::min(x0, x1), std::min(y0, y1), std::max(x0, x1), std::max(y0, y1)}; //a negative scale mirrors
+      }
+      GpuCullParams params = {};
+      GpuCuller::clipSpaceFrustum(params.planes);
+      params.indexCount = indexCount;
+      GpuCullOutput culled = gpuCuller.record(commandBuffer, static_cast<uint32_t>(currentFrame), frameData, objectBounds.data(),
+                                              static_cast<uint32_t>(objectBounds.size()), params);
+      DrawCommand draw;
+      draw.vertexBuffer = vertexBuffer;
+      draw.instanceBuffer = instances.buffer;
+      draw.instanceOffset = instances.offset;
+      draw.indexBuffer = indexBuffer;
+      draw.indexType = indexType;
+      draw.indirectBuffer = culled.commandBuffer;
+      if (culled.countBuffer != VK_NULL_HANDLE) {
+        draw.indirectOffset = culled.commandOffset;
+        draw.maxDrawCount = culled.maxDrawCount; //only compacted when it's within maxDrawIndirectCount
+        draw.countBuffer = culled.countBuffer;
+        draw.countOffset = culled.countOffset;
+        drawList.push_back(draw);
+        return;
+      }
+      for (uint32_t first = 0; first < culled.maxDrawCount; first += maxDrawIndirectCount) {
+        draw.indirectOffset = culled.commandOffset + first * sizeof(VkDrawIndexedIndirectCommand);
+        draw.maxDrawCount = std::min(maxDrawIndirectCount, culled.maxDrawCount - first);
+        drawList.push_back(draw);
+      }
+    }
+
+    //count copies of a mesh spanning -1..1, shrunk into a square grid over the window; a single one covers it unchanged
+    static std::vector<InstanceData> makeInstanceGrid(uint32_t count) {
+      std::vector<InstanceData> instances;
+      instances.reserve(count);
+      uint32_t cells = 1;
+      while (cells * cells < count) {
+        cells++;
+      }
+      float scale = 1.0f / cells;
+      for (uint32_t i = 0; i < count; i++) {
+        uint32_t x = i % cells, y = i / cells;
+        InstanceData instance;
+        instance.transform = {scale, scale, -1.0f + (2 * x + 1) * scale, -1.0f + (2 * y + 1) * scale};
+        instance.color = {1.0f - 0.5f * x / cells, 1.0f - 0.5f * y / cells, 1.0f};
+        instances.push_back(instance);
+      }
+      return instances;
+    }
+
+    //draws [begin, end) of drawList into a secondary; runs on the recording threads, so it only reads app state
+    void recordDraws(VkCommandBuffer commandBuffer, size_t begin, size_t end) {
+      //dynamic state isn't inherited from the primary, every secondary sets its own
+      VkViewport viewport = {};
+      viewport.x = 0.0f;
+      viewport.y = 0.0f;
+      viewport.width = (float) swapChainExtent.width;
+      viewport.height = (float) swapChainExtent.height;
+      viewport.minDepth = 0.0f;
+      viewport.maxDepth = 1.0f;
+      /*Remember that the size of the swap chain and its images may differ from
+      the WIDTH and HEIGHT of the window. The swap chain images will be used as
+      framebuffers later on, so we should stick to their size.
+      The minDepth and maxDepth values specify the range of depth values to use
+      for the framebuffer. These values must be within the [0.0f, 1.0f] range,
+      but minDepth may be higher than maxDepth. If you aren't doing anything
+      special, then you should stick to the standard values of 0.0f and 1.0f.*/
+      VkRect2D scissor = {};
+      scissor.offset = {0, 0};
+      scissor.extent = swapChainExtent;
+      vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+      vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+      vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+      VkBuffer boundBuffers[2] = {VK_NULL_HANDLE, VK_NULL_HANDLE}; //per vertex, per instance
+      VkDeviceSize boundOffsets[2] = {0, 0};
+      VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+      for (size_t i = begin; i < end; i++) {
+        const DrawCommand& draw = drawList[i];
+        if (draw.vertexBuffer != boundBuffers[0] || draw.vertexOffset != boundOffsets[0] || draw.instanceBuffer != boundBuffers[1]
+            || draw.instanceOffset != boundOffsets[1]) {
+          boundBuffers[0] = draw.vertexBuffer;
+          boundOffsets[0] = draw.vertexOffset;
+          boundBuffers[1] = draw.instanceBuffer;
+          boundOffsets[1] = draw.instanceOffset;
+          vkCmdBindVertexBuffers(commandBuffer, 0, draw.instanceBuffer != VK_NULL_HANDLE ? 2 : 1, boundBuffers, boundOffsets);
+        }
+        if (draw.indexBuffer != VK_NULL_HANDLE && draw.indexBuffer != boundIndexBuffer) {
+          boundIndexBuffer = draw.indexBuffer;
+          vkCmdBindIndexBuffer(commandBuffer, draw.indexBuffer, 0, draw.indexType);
         }
-        //Stuff to start the render pass
-        VkRenderPassBeginInfo renderPassInfo = {};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = renderPass;
-        renderPassInfo.framebuffer = swapChainFramebuffers[i];
-        renderPassInfo.renderArea.offset = {0, 0};
-        renderPassInfo.renderArea.extent = swapChainExtent;
-        VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
-        renderPassInfo.clearValueCount = 1;
-        renderPassInfo.pClearValues = &clearColor;
-                            //record the cmd to //details of rp //primary or secondary cb exectution related
-        vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-        vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-        //MIGRATED FROM PIPELINE CREATION FOR DYNAMIC USAGE (not from tutorial)
-        //explicit declaration: Viewport: where in the buffer we render to (usually 0,0 to width,height)
-        VkViewport viewport = {};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = (float) swapChainExtent.width;
-        viewport.height = (float) swapChainExtent.height;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
-        /*Remember that the size of the swap chain and its images may differ from
-        the WIDTH and HEIGHT of the window. The swap chain images will be used as
-        framebuffers later on, so we should stick to their size.
-        The minDepth and maxDepth values specify the range of depth values to use
-        for the framebuffer. These values must be within the [0.0f, 1.0f] range,
-        but minDepth may be higher than maxDepth. If you aren't doing anything
-        special, then you should stick to the standard values of 0.0f and 1.0f.*/
-        VkRect2D scissor = {};
-        scissor.offset = {0, 0};
-        scissor.extent = swapChainExtent;
-        VkPipelineViewportStateCreateInfo viewportState = {};
-        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-        viewportState.viewportCount = 1;
-        viewportState.pViewports = nullptr; //now dynamic, see next line
-        vkCmdSetViewport(commandBuffers[i], 0, 1, &viewport); 
-        viewportState.scissorCount = 1;
-        viewportState.pScissors = nullptr; //now dynamic, see next line
-        vkCmdSetScissor(commandBuffers[i], 0, 1, &scissor);
-        //END MIGRATION
-        //Binding the vertex buffer
-        VkBuffer vertexBuffers[] = {vertexBuffer};
-        VkDeviceSize offsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
-        //draw, conclude, repeat
-        vkCmdDraw(commandBuffers[i], static_cast<uint32_t>(vertices.size()), 1, 0, 0);
-        vkCmdEndRenderPass(commandBuffers[i]);
-        if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-          throw std::runtime_error("failed to record command buffer!");
+        const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+        if (draw.countBuffer != VK_NULL_HANDLE) {
+          cmdDrawIndexedIndirectCount(commandBuffer, draw.indirectBuffer, draw.indirectOffset, draw.countBuffer, draw.countOffset, draw.maxDrawCount,
+                                      stride);
+        } else if (draw.indirectBuffer != VK_NULL_HANDLE) {
+          vkCmdDrawIndexedIndirect(commandBuffer, draw.indirectBuffer, draw.indirectOffset, draw.maxDrawCount, stride);
+        } else if (draw.indexBuffer != VK_NULL_HANDLE) {
+          vkCmdDrawIndexed(commandBuffer, draw.indexCount, draw.instanceCount, draw.firstIndex, 0, draw.firstInstance);
+        } else {
+          vkCmdDraw(commandBuffer, draw.vertexCount, draw.instanceCount, draw.firstVertex, draw.firstInstance);
         }
       }
     }
+
+    //the scene pass's contents: draws recorded across threads into secondaries, executed in draw order
+    void executeScene(const RenderPassContext& context) {
+      VkCommandBufferInheritanceInfo inheritance = {};
+      inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+      inheritance.renderPass = context.renderPass;
+      inheritance.subpass = context.subpass;
+      inheritance.framebuffer = context.framebuffer;
+      const std::vector<VkCommandBuffer>& secondaries = commandRecorder.record(inheritance, drawList.size(),
+          [this](VkCommandBuffer secondary, size_t begin, size_t end) { recordDraws(secondary, begin, end); });
+      if (!secondaries.empty()) {
+        vkCmdExecuteCommands(context.commandBuffer, static_cast<uint32_t>(secondaries.size()), secondaries.data());
+      }
+    }
+
+    /*
+      The frame's primary: the render graph's passes on the acquired image. The scene
+      pass executes the secondaries the recording threads filled with this frame's
+      draw list (executeScene()); in GPU-driven mode the culling dispatch that feeds
+      that list goes first, outside the render pass. Recorded every frame after the fence wait, so a new
+      pipeline, vertex buffer or swapchain is simply picked up by the next frame;
+      nothing is re-recorded ahead.
+    */
+    VkCommandBuffer recordFrameCommands(uint32_t imageIndex) {
+      VkCommandBuffer commandBuffer = frameContexts.commandBuffer();
+      VkCommandBufferBeginInfo beginInfo = {};
+      beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!");
+      }
+      //benchmark: GPU time of the whole render pass, read back in drawFrame()
+      bool timed = timestampQueryPool != VK_NULL_HANDLE && 2 * imageIndex + 1 < timestampQueryCount;
+      if (timed) {
+        vkCmdResetQueryPool(commandBuffer, timestampQueryPool, 2 * imageIndex, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, 2 * imageIndex);
+      }
+      buildDrawList(commandBuffer);
+      renderGraph.execute(commandBuffer, imageIndex); //every pass, each in its render pass with its barriers
+      if (timed) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, 2 * imageIndex + 1);
+      }
+      if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer!");
+      }
+      return commandBuffer;
+    }
   /**** Command Buffers and Pools ****/
 
     /**** Creating Vertex Buffer and Allocating GPU Memory for it ****/
+    //one allocator for every buffer and image, so resources share a few big vkAllocateMemory blocks (see gpuAllocator.h)
+    void createAllocator() {
+      gpuAllocator.init(physicalDevice, device, hostCallbacks);
+    }
+
+    void createMemoryTelemetry() {
+      memoryTelemetry.init(instance, physicalDevice, memoryBudgetEnabled, std::getenv("MEMORY_TELEMETRY_PATH"));
+    }
+
+    void createStagingRing() {
+      stagingRing.init(gpuAllocator, STAGING_RING_SIZE, MAX_FRAMES_IN_FLIGHT);
+    }
+
+    void createAsyncUploader() {
+      QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+      uint32_t graphicsFamily = indices.graphicsFamily.value();
+      asyncUploader.init(device, gpuAllocator, transferQueue, indices.transferFamily.value_or(graphicsFamily), graphicsFamily, MAX_FRAMES_IN_FLIGHT,
+                         hostCallbacks);
+      std::cout << "async uploads: " << (asyncUploader.dedicated() ? "dedicated transfer queue" : "graphics queue (no transfer only family)") << std::endl;
+    }
+
+    void createFrameRing() {
+      const VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+                                       | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+      frameData.init(gpuAllocator, FRAME_RING_REGION_SIZE, MAX_FRAMES_IN_FLIGHT, usage, FrameRingBuffer::alignmentFor(properties.limits, usage));
+    }
+
+    /*
+      GPU-driven mode's culling pipeline. The dispatch goes in the frame's own command
+      buffer, ahead of the render pass, so the graphics family has to do compute too.
+      Without drawIndirectFirstInstance the indirect draws can't pick each object's
+      instance data, so the scene is drawn from the CPU as before.
+    */
+    void createGpuCulling() {
+      if (const char* env = std::getenv("GPU_DRIVEN")) {
+        gpuDriven = gpuDriven || std::strtoul(env, nullptr, 10) != 0;
+      }
+      if (!gpuDriven) {
+        return;
+      }
+      QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+      uint32_t familyCount = 0;
+      vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+      std::vector<VkQueueFamilyProperties> families(familyCount);
+      vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+      if (!(families[indices.graphicsFamily.value()].queueFlags & VK_QUEUE_COMPUTE_BIT) || !drawIndirectFirstInstanceEnabled) {
+        std::cout << "gpu-driven drawing: needs compute on the graphics queue and drawIndirectFirstInstance, drawing from the CPU" << std::endl;
+        gpuDriven = false;
+        return;
+      }
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+      maxDrawIndirectCount = multiDrawIndirectEnabled ? std::max(1u, properties.limits.maxDrawIndirectCount) : 1;
+      //the count draw takes up to maxDrawCount draws in one call, so it needs multiDrawIndirect as well
+      bool compact = cmdDrawIndexedIndirectCount != nullptr && multiDrawIndirectEnabled;
+      ShaderCode code = loadShaderCode(CULL_SHADER_FILE, shaderc_glsl_compute_shader);
+      gpuCuller.init(device, pipelineCache, code.data(), code.size(), reflectShader(code), MAX_FRAMES_IN_FLIGHT, compact, maxDrawIndirectCount,
+                     hostCallbacks);
+      std::cout << "gpu-driven drawing: "
+                << (compact ? "compacted by the GPU, vkCmdDrawIndexedIndirectCountKHR"
+                    : multiDrawIndirectEnabled ? "a record per object, one multi-draw" : "a record per object, one indirect draw each")
+                << std::endl;
+    }
+
+    //the scene: the quad, INSTANCE_COUNT copies of it (default 1) drawn instanced
     void createVertexBuffer() {
+      createMesh("quad", vertices, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      uint32_t instanceCount = 1;
+      if (const char* env = std::getenv("INSTANCE_COUNT")) {
+        instanceCount = std::max(1u, static_cast<uint32_t>(std::strtoul(env, nullptr, 10)));
+      }
+      sceneInstances = makeInstanceGrid(instanceCount);
+    }
+
+    /*
+      A triangle list in, vertexBuffer and indexBuffer out. The list is optimized on
+      the way (see meshOptimizer.h); every mesh pays for that once at load, and every
+      frame that draws it gets fewer vertices to fetch and shade.
+    */
+    void createMesh(const char* name, const std::vector<Vertex>& triangles, VkMemoryPropertyFlags placement) {
+      std::vector<Vertex> meshVertices;
+      std::vector<uint32_t> meshIndices;
+      MeshStats stats = optimizeMesh(triangles, meshVertices, meshIndices);
+      std::cout << stats.describe(name) << std::endl;
+      createVertexBuffer(meshVertices, placement);
+      createIndexBuffer(meshIndices);
+    }
+
+    /*
+      DEVICE_LOCAL: the GPU reads it at full speed. Small data is staged in the ring and
+      copied in by the upload command buffer of the next frame, which is submitted
+      ahead of the draw. Big data (ASYNC_UPLOAD_MIN_BYTES) goes to the transfer queue;
+      vertexCount stays 0, so nothing draws from the buffer, until drawFrame() has
+      taken ownership of it.
+      HOST_VISIBLE: written directly, and the GPU fetches every vertex across the bus
+      on a discrete card. Only the benchmark still asks for this.
+    */
+    void createVertexBuffer(const std::vector<Vertex>& data, VkMemoryPropertyFlags placement) {
+      bool deviceLocal = (placement & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0;
       //memory allocation object for storing vertex data
       VkBufferCreateInfo bufferInfo = {};
       bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-      bufferInfo.size = sizeof(vertices[0]) * vertices.size(); //single vert * num verts
-      bufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+      bufferInfo.size = sizeof(data[0]) * data.size(); //single vert * num verts
+      bufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | (deviceLocal ? VK_BUFFER_USAGE_TRANSFER_DST_BIT : 0);
       bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;  //exclusively used by graphics queue
-      if (vkCreateBuffer(device, &bufferInfo, nullptr, &vertexBuffer) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create vertex buffer!");
-      }
-      //now actually allocate memory
-      VkMemoryRequirements memRequirements;
-      vkGetBufferMemoryRequirements(device, vertexBuffer, &memRequirements);
-      VkMemoryAllocateInfo allocInfo = {};
-      allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-      allocInfo.allocationSize = memRequirements.size;
-      allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-      if (vkAllocateMemory(device, &allocInfo, nullptr, &vertexBufferMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate vertex buffer memory!");
-      }
-      //associate the memory and the buffer!
-      vkBindBufferMemory(device, vertexBuffer, vertexBufferMemory, 0);
-      //use memory mapping io to point fill the buffer with data
-      void* data;
-      vkMapMemory(device, vertexBufferMemory, 0, bufferInfo.size, 0, &data); //map the memory from cpu to gpu
-        memcpy(data, vertices.data(), (size_t) bufferInfo.size); //copy the vertex data in
-      vkUnmapMemory(device, vertexBufferMemory); //unmap the cpu gpu connection
-    }
-
-    //find the type of GPU memory to use for vertex buffer
-    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-      VkPhysicalDeviceMemoryProperties memProperties;
-      vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties); //find available types of memory
-      //
-      for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-        if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-          return i;
+      //creates the buffer, sub-allocates memory for it and binds the two
+      vertexBufferAllocation = gpuAllocator.createBuffer(bufferInfo, placement, vertexBuffer, GpuMemoryCategory::Vertex);
+      vertexCount = static_cast<uint32_t>(data.size());
+      meshBounds = {data[0].pos.x, data[0].pos.y, data[0].pos.x, data[0].pos.y};
+      for (const Vertex& vertex : data) {
+        meshBounds.x = std::min(meshBounds.x, vertex.pos.x);
+        meshBounds.y = std::min(meshBounds.y, vertex.pos.y);
+        meshBounds.z = std::max(meshBounds.z, vertex.pos.x);
+        meshBounds.w = std::max(meshBounds.w, vertex.pos.y);
+      }
+      if (vertexBufferAllocation.mapped) {
+        //host visible blocks stay mapped, so just copy the vertex data in (also covers device local memory the CPU can see)
+        memcpy(vertexBufferAllocation.mapped, data.data(), (size_t) bufferInfo.size);
+        gpuAllocator.flush(vertexBufferAllocation); //device local and host visible need not be coherent
+      } else if (bufferInfo.size >= ASYNC_UPLOAD_MIN_BYTES) {
+        pendingVertexUpload = asyncUploader.uploadBuffer(vertexBuffer, 0, data.data(), bufferInfo.size,
+                                                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+        pendingVertexCount = vertexCount;
+        vertexCount = 0;
+      } else if (!stagingRing.upload(vertexBuffer, 0, data.data(), bufferInfo.size)) {
+        throw std::runtime_error("vertex data doesn't fit in the staging ring!");
+      }
+    }
+
+    //device local indices into vertexBuffer, through the staging ring like small vertex data. 16-bit when they fit, half the bytes to fetch
+    void createIndexBuffer(const std::vector<uint32_t>& data) {
+      std::vector<uint16_t> shortIndices;
+      if (!data.empty() && *std::max_element(data.begin(), data.end()) <= UINT16_MAX) {
+        shortIndices.assign(data.begin(), data.end());
+      }
+      indexType = shortIndices.empty() ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16;
+      const void* indexData = shortIndices.empty() ? static_cast<const void*>(data.data()) : shortIndices.data();
+      VkBufferCreateInfo bufferInfo = {};
+      bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+      bufferInfo.size = (shortIndices.empty() ? sizeof(uint32_t) : sizeof(uint16_t)) * data.size();
+      bufferInfo.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+      bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+      indexBufferAllocation = gpuAllocator.createBuffer(bufferInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, GpuMemoryCategory::Index);
+      indexCount = static_cast<uint32_t>(data.size());
+      if (indexBufferAllocation.mapped) {
+        memcpy(indexBufferAllocation.mapped, indexData, (size_t) bufferInfo.size);
+        gpuAllocator.flush(indexBufferAllocation);
+      } else if (!stagingRing.upload(indexBuffer, 0, indexData, bufferInfo.size)) {
+        throw std::runtime_error("index data doesn't fit in the staging ring!");
+      }
+    }
+
+    /*
+      The frame's upload command buffer if the staging ring has copies queued or
+      transfer queue uploads finished, else VK_NULL_HANDLE. Finished uploads add
+      their semaphores to the submit's wait list.
+    */
+    VkCommandBuffer recordUploads(std::vector<VkSemaphore>& waitSemaphores, std::vector<VkPipelineStageFlags>& waitStages) {
+      if (!stagingRing.hasPendingCopies() && !asyncUploader.hasFinishedTransfers()) {
+        return VK_NULL_HANDLE;
+      }
+      VkCommandBuffer commandBuffer = frameContexts.commandBuffer(); //only recorded on frames with copies or acquires to do
+      VkCommandBufferBeginInfo beginInfo = {};
+      beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording upload command buffer!");
+      }
+      stagingRing.recordCopies(commandBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT);
+      asyncUploader.handOver(commandBuffer, static_cast<uint32_t>(currentFrame), waitSemaphores, waitStages);
+      if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record upload command buffer!");
+      }
+      return commandBuffer;
+    }
+
+  /**** Shader Hot Reload ****/
+    /*
+      Iterating on a shader used to mean restarting the app. Instead, a background
+      thread watches shaders/ with inotify. When one of our shader files is written it
+      recompiles both stages and builds a replacement pipeline right there on the
+      watcher thread, so the render loop never waits on shaderc or the driver.
+      drawFrame() swaps the new pipeline in at the next frame boundary. If the shader
+      doesn't compile, the shaderc error is printed and the old pipeline stays.
+      Only the active shader variant (and the default one, which is the fallback) is
+      rebuilt; the others are dropped with the old code and come back lazily through
+      getPipelineVariant().
+    */
+    struct ReloadedShaders {
+      VkPipeline pipeline = VK_NULL_HANDLE; //built for variant
+      VkPipeline fallbackPipeline = VK_NULL_HANDLE; //the default variant, same as pipeline when variant is empty
+      ShaderVariant variant;
+      ShaderCode vertShaderCode;
+      ShaderCode fragShaderCode;
+      ShaderReflection vertReflection;
+      ShaderReflection fragReflection;
+    };
+    std::optional<ReloadedShaders> pendingReload; //built by the watcher thread, swapped in by drawFrame()
+
+    void startShaderHotReload() {
+      if (!enableShaderHotReload) {
+        return;
+      }
+#ifdef __linux__
+      shaderWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      //editors either rewrite the file (close_write) or write a temp file and rename it over (moved_to)
+      if (shaderWatchFd < 0 || inotify_add_watch(shaderWatchFd, "shaders", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        std::cout << "shader hot reload: can't watch shaders/, disabled" << std::endl;
+        if (shaderWatchFd >= 0) {
+          close(shaderWatchFd);
+          shaderWatchFd = -1;
+        }
+        return;
+      }
+      //shared includes live in their own directory; any change there triggers a reload, which only recompiles
+      //the stages whose includes actually changed (the others hit the shader cache)
+      shaderIncludeWatch = inotify_add_watch(shaderWatchFd, SHADER_INCLUDE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO);
+      shaderWatchRunning = true;
+      shaderWatchThread = std::thread(&HelloTriangleApplication::watchShaders, this);
+      std::cout << "shader hot reload: watching shaders/" << std::endl;
+#else
+      std::cout << "shader hot reload: needs inotify, disabled on this platform" << std::endl;
+#endif
+    }
+
+    void stopShaderHotReload() {
+      stopShaderWatcher();
+      //built but never swapped in
+      if (pendingReload) {
+        destroyReloadedPipelines(*pendingReload);
+        pendingReload.reset();
+      }
+    }
+
+    //joins the watcher thread and closes its inotify instance; safe to call twice
+    void stopShaderWatcher() {
+      shaderWatchRunning = false;
+      if (shaderWatchThread.joinable()) {
+        shaderWatchThread.join();
+      }
+#ifdef __linux__
+      if (shaderWatchFd >= 0) {
+        close(shaderWatchFd);
+        shaderWatchFd = -1;
+      }
+#endif
+    }
+
+    void destroyReloadedPipelines(const ReloadedShaders& reload) {
+      if (reload.fallbackPipeline != reload.pipeline) {
+        vkDestroyPipeline(device, reload.fallbackPipeline, hostCallbacks);
+      }
+      vkDestroyPipeline(device, reload.pipeline, hostCallbacks);
+    }
+
+#ifdef __linux__
+    void watchShaders() {
+      alignas(struct inotify_event) char buffer[4096];
+      while (shaderWatchRunning) {
+        pollfd pollInfo = {shaderWatchFd, POLLIN, 0};
+        if (poll(&pollInfo, 1, 100) <= 0) { //wake up regularly to notice shaderWatchRunning going false
+          continue;
+        }
+        //saving a file can produce a burst of events, so keep draining until it has been quiet for a bit
+        bool changed = false;
+        auto quietUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+        while (std::chrono::steady_clock::now() < quietUntil) {
+          ssize_t length;
+          while ((length = read(shaderWatchFd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + length; ) {
+              const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+              if (event->len > 0 && (event->wd == shaderIncludeWatch || isWatchedShader(event->name))) {
+                changed = true;
+                quietUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+              }
+              p += sizeof(inotify_event) + event->len;
+            }
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (changed) {
+          reloadShaders();
+        }
+      }
+    }
+#endif
+
+    static bool isWatchedShader(const std::string& name) {
+      std::string path = "shaders/" + name;
+      return path == VERT_SHADER_FILE || path == FRAG_SHADER_FILE;
+    }
+
+    //runs on the watcher thread
+    void reloadShaders() {
+      ReloadedShaders reload;
+      ShaderReflection currentVertReflection, currentFragReflection;
+      {
+        std::lock_guard<std::mutex> lock(pendingPipelineMutex);
+        reload.variant = activeVariant;
+        currentVertReflection = vertShaderReflection;
+        currentFragReflection = fragShaderReflection;
+      }
+      try {
+        //loadShaderCode() only takes archived code built from the current source, so edits always recompile
+        reload.vertShaderCode = loadShaderCode(VERT_SHADER_FILE, shaderc_glsl_vertex_shader);
+        reload.fragShaderCode = loadShaderCode(FRAG_SHADER_FILE, shaderc_glsl_fragment_shader);
+        reload.vertReflection = reflectShader(reload.vertShaderCode);
+        reload.fragReflection = reflectShader(reload.fragShaderCode);
+        //the layout and vertex input are shared with the running pipeline, so they can't change under it
+        if (!sameShaderInterface(reload.vertReflection, currentVertReflection)
+            || !sameShaderInterface(reload.fragReflection, currentFragReflection)) {
+          std::cerr << "shader hot reload: keeping the current pipeline, inputs, descriptors or push constants changed (restart to pick them up)" << std::endl;
+          return;
         }
+      } catch (const std::exception& e) {
+        std::cerr << "shader hot reload: keeping the current pipeline, " << e.what() << std::endl;
+        return;
       }
-      throw std::runtime_error("failed to find suitable memory type!"); //in case of no suitable memory found
+      try {
+        std::shared_lock<std::shared_mutex> lock(renderPassMutex);
+        reload.pipeline = buildGraphicsPipeline(reload.vertShaderCode, reload.fragShaderCode, reload.variant);
+        reload.fallbackPipeline = reload.pipeline;
+        if (!reload.variant.empty()) {
+          reload.fallbackPipeline = buildGraphicsPipeline(reload.vertShaderCode, reload.fragShaderCode);
+        }
+      } catch (const std::exception& e) {
+        if (reload.pipeline != VK_NULL_HANDLE) {
+          vkDestroyPipeline(device, reload.pipeline, hostCallbacks);
+        }
+        std::cerr << "shader hot reload: keeping the current pipeline, " << e.what() << std::endl;
+        return;
+      }
+      std::lock_guard<std::mutex> lock(pendingPipelineMutex);
+      if (pendingReload) {
+        destroyReloadedPipelines(*pendingReload); //superseded before it was ever drawn with
+      }
+      pendingReload = std::move(reload);
+      std::cout << "shader hot reload: new pipeline ready" << std::endl;
     }
 
+    /*
+      Called at the top of drawFrame(), i.e. on a frame boundary. The command buffers
+      have the old pipeline baked in, so they get re-recorded, and the old pipeline can
+      only be destroyed once no submitted frame can still be using it. The per-frame
+      fences tell us exactly that; unlike vkDeviceWaitIdle we don't wait on anything
+      that isn't one of our frames. Every variant built from the old code goes too;
+      ones still building are destroyed when they finish, not waited for.
+    */
+    void swapPendingPipeline() {
+      ReloadedShaders reload;
+      {
+        std::lock_guard<std::mutex> lock(pendingPipelineMutex);
+        if (!pendingReload) {
+          return;
+        }
+        reload = std::move(*pendingReload);
+        pendingReload.reset();
+        vertShaderReflection = reload.vertReflection;
+        fragShaderReflection = reload.fragReflection;
+      }
+      vkWaitForFences(device, static_cast<uint32_t>(inFlightFences.size()), inFlightFences.data(), VK_TRUE, UINT64_MAX);
+      destroyPipelineVariants();
+      activeVertShaderCode = std::move(reload.vertShaderCode);
+      activeFragShaderCode = std::move(reload.fragShaderCode);
+      fallbackPipeline = reload.fallbackPipeline;
+      pipelineVariants[ShaderVariant()] = PipelineHandle::completed(reload.fallbackPipeline);
+      pipelineVariants[reload.variant] = PipelineHandle::completed(reload.pipeline);
+      graphicsPipeline = reload.pipeline;
+      waitingForPipeline = false;
+      //the user picked another variant while the reload was building
+      if (reload.variant != activeVariant) {
+        selectPipelineVariant(activeVariant);
+      }
+    }
+  /**** Shader Hot Reload ****/
+
   /**** draw time ****/
     /* Now we need to 
      * 1. acquire an image from the swap chain, 
@@ -1135,17 +2439,32 @@ private:
       fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
       fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; //this is the bit that is flipped when the fence is t/f 
       for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
-            vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
-            vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
+        if (vkCreateSemaphore(device, &semaphoreInfo, hostCallbacks, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
+            vkCreateSemaphore(device, &semaphoreInfo, hostCallbacks, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
+            vkCreateFence(device, &fenceInfo, hostCallbacks, &inFlightFences[i]) != VK_SUCCESS) {
           throw std::runtime_error("failed to create synchronization objects for a frame!");
         }
       }
     }
 
     void drawFrame() {
+      //new shaders from hot reload and shader variant switches go in between frames
+      swapPendingPipeline();
+      destroyAbandonedBuilds();
+      if (requestedVariant != appliedRequest) {
+        appliedRequest = requestedVariant;
+        selectPipelineVariant(requestedVariant);
+      } else if (waitingForPipeline) {
+        updateDrawPipeline();
+      }
       //0
       vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+      stagingRing.beginFrame(static_cast<uint32_t>(currentFrame)); //the copies this frame did last time are done, so is their staging space
+      asyncUploader.beginFrame(static_cast<uint32_t>(currentFrame));
+      frameData.beginFrame(static_cast<uint32_t>(currentFrame)); //anything written to frameData from here on is this frame's
+      frameContexts.begin(static_cast<uint32_t>(currentFrame)); //resets the frame's command pools; command buffers come from them from here on
+      memoryTelemetry.frame(gpuAllocator, frameNumber++);
+      gpuCuller.collect(static_cast<uint32_t>(currentFrame)); //the frame's culling pass is done, count what it kept
       //1
       uint32_t imageIndex; //refers to the VkImage in our swapChainImages array, so we can pick the right command buffer
       VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
@@ -1160,6 +2479,9 @@ private:
       // Check if a previous frame is using this image (i.e. there is its fence to wait on)
       if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
         vkWaitForFences(device, 1, &imagesInFlight[imageIndex], VK_TRUE, UINT64_MAX);
+        if (timestampQueryPool != VK_NULL_HANDLE) {
+          collectFrameTimestamps(imageIndex); //the image's last submission is done, so are its timestamps
+        }
       }
       // Mark the image as now being in use by this frame
       imagesInFlight[imageIndex] = inFlightFences[currentFrame];
@@ -1167,14 +2489,23 @@ private:
       VkSubmitInfo submitInfo = {};
       submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
       //until the image is ready: what are we waiting on, and which states of the pipeline do we wait to do
-      VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]}; //1.5
-      VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT}; //VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT can substitutes the subpass we wrote into the render pass to signal that image is aquired and proper image layout transitions can occur
-      submitInfo.waitSemaphoreCount = 1;
-      submitInfo.pWaitSemaphores = waitSemaphores;
-      submitInfo.pWaitDstStageMask = waitStages;
+      std::vector<VkSemaphore> waitSemaphores = {imageAvailableSemaphores[currentFrame]}; //1.5
+      std::vector<VkPipelineStageFlags> waitStages = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT}; //VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT can substitutes the subpass we wrote into the render pass to signal that image is aquired and proper image layout transitions can occur
       //which command buffer to submit: the command buffer that binds the swap chain image we just acquired as color attachment.
-      submitInfo.commandBufferCount = 1;
-      submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+      //queued uploads go first in the same submit; their barrier makes the copies visible to the draw's vertex input
+      VkCommandBuffer uploads = recordUploads(waitSemaphores, waitStages);
+      if (pendingVertexUpload && asyncUploader.ready(pendingVertexUpload)) {
+        //the vertex buffer is ours as of this submit: draw it from this frame on
+        pendingVertexUpload = 0;
+        vertexCount = pendingVertexCount;
+      }
+      VkCommandBuffer frameCommands = recordFrameCommands(imageIndex);
+      submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+      submitInfo.pWaitSemaphores = waitSemaphores.data();
+      submitInfo.pWaitDstStageMask = waitStages.data();
+      VkCommandBuffer submitBuffers[] = {uploads, frameCommands};
+      submitInfo.commandBufferCount = uploads != VK_NULL_HANDLE ? 2 : 1;
+      submitInfo.pCommandBuffers = uploads != VK_NULL_HANDLE ? submitBuffers : &frameCommands;
       //now we've finished the render part, so mark the semaphore that says we're ready for 3
       VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]}; //2.5
       submitInfo.signalSemaphoreCount = 1;
@@ -1211,29 +2542,242 @@ private:
   /**** draw time ****/
 
     void mainLoop() {
+      bool firstFrame = true;
+      HostAllocationStats loopStart = hostAllocator.stats();
+      uint64_t loopStartFrame = frameNumber;
       while (!glfwWindowShouldClose(window)) {
         glfwPollEvents();
         drawFrame();
+        if (firstFrame) {
+          StartupProfiler::instance().mark("first frame"); //time to first frame: the number startup work is judged by
+          firstFrame = false;
+        }
       }
       vkDeviceWaitIdle(device); //all of the operations in drawFrame are asynchronous. That means that when we exit the loop in mainLoop, drawing and presentation operations may still be going on.
+      printHostAllocationChurn(loopStart, frameNumber - loopStartFrame);
+      std::cout << "command recording: " << commandRecorder.averageRecordMs() << " ms per frame on up to " << commandRecorder.maxThreadsUsed()
+                << " of " << commandRecorder.threadCount() << " threads, " << frameContexts.allocations() << " command buffers allocated, "
+                << frameContexts.resets() << " pool resets" << std::endl;
+      std::cout << renderGraph.describe() << std::endl;
     }
 
+    //driver host allocations per frame since start, per scope. Steady state should be close to zero
+    void printHostAllocationChurn(const HostAllocationStats& start, uint64_t frames) {
+      if (hostCallbacks == nullptr || frames == 0) {
+        return;
+      }
+      HostAllocationStats end = hostAllocator.stats();
+      std::cout << "host allocations per frame over " << frames << " frames:";
+      for (size_t scope = 0; scope < HOST_SCOPE_COUNT; scope++) {
+        uint64_t calls = end[scope].allocations - start[scope].allocations + end[scope].reallocations - start[scope].reallocations;
+        uint64_t bytes = end[scope].bytesAllocated - start[scope].bytesAllocated;
+        std::cout << " " << hostAllocationScopeName(scope) << " " << static_cast<double>(calls) / frames << " ("
+                  << bytes / frames << " B)";
+      }
+      std::cout << std::endl;
+    }
+
+  /**** Vertex Memory Benchmark ****/
+    /*
+      --bench-vertex-memory [frames]: draws a grid of small triangles covering the
+      window (so vertex fetch, not fill rate, dominates) with its vertex buffer first
+      in HOST_VISIBLE | HOST_COHERENT memory, then DEVICE_LOCAL memory uploaded
+      through the staging ring, and compares the render pass GPU time of the two.
+      GPU timestamps rather than frame times, so vsync doesn't flatten the result.
+      The grid goes through createMesh() like any mesh; its index buffer is device
+      local both times.
+    */
+    std::vector<Vertex> makeBenchmarkGrid(uint32_t cells) {
+      std::vector<Vertex> grid;
+      grid.reserve(cells * cells * 6);
+      float step = 2.0f / cells;
+      for (uint32_t y = 0; y < cells; y++) {
+        for (uint32_t x = 0; x < cells; x++) {
+          float x0 = -1.0f + x * step, y0 = -1.0f + y * step;
+          glm::vec3 color = {float(x) / cells, float(y) / cells, 0.5f};
+          grid.push_back({{x0, y0}, color});
+          grid.push_back({{x0 + step, y0}, color});
+          grid.push_back({{x0 + step, y0 + step}, color});
+          grid.push_back({{x0, y0}, color});
+          grid.push_back({{x0 + step, y0 + step}, color});
+          grid.push_back({{x0, y0 + step}, color});
+        }
+      }
+      return grid;
+    }
+
+    void createTimestampQueryPool() {
+      uint32_t queueFamilyCount = 0;
+      vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+      std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+      vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+      if (queueFamilies[findQueueFamilies(physicalDevice).graphicsFamily.value()].timestampValidBits == 0) {
+        throw std::runtime_error("graphics queue doesn't support timestamps, can't benchmark!");
+      }
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+      timestampPeriodNs = properties.limits.timestampPeriod;
+      timestampQueryCount = static_cast<uint32_t>(2 * swapChainImages.size());
+      VkQueryPoolCreateInfo queryPoolInfo = {};
+      queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+      queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+      queryPoolInfo.queryCount = timestampQueryCount;
+      if (vkCreateQueryPool(device, &queryPoolInfo, hostCallbacks, &timestampQueryPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create timestamp query pool!");
+      }
+    }
+
+    void collectFrameTimestamps(uint32_t imageIndex) {
+      if (2 * imageIndex + 1 >= timestampQueryCount) {
+        return;
+      }
+      uint64_t timestamps[2];
+      //no WAIT_BIT: after a swapchain rebuild the queries may not have been written, which would wait forever
+      if (vkGetQueryPoolResults(device, timestampQueryPool, 2 * imageIndex, 2, sizeof(timestamps), timestamps,
+                                sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+        return;
+      }
+      frameGpuMs.push_back((timestamps[1] - timestamps[0]) * timestampPeriodNs / 1e6);
+    }
+
+    void runVertexMemoryBenchmark() {
+      std::vector<Vertex> grid = makeBenchmarkGrid(VERTEX_BENCHMARK_GRID);
+      createTimestampQueryPool();
+      struct Placement {
+        const char* name;
+        VkMemoryPropertyFlags flags;
+        double medianMs;
+      };
+      Placement placements[] = {
+        {"host visible", VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0.0},
+        {"device local", VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0.0},
+      };
+      std::cout << "vertex memory benchmark: " << grid.size() / 3 << " triangles, " << vertexBenchmarkFrames << " frames per placement" << std::endl;
+      for (auto& placement : placements) {
+        vkDeviceWaitIdle(device);
+        //the previous mesh's copies may still be queued (no frame has run since initVulkan()), and a new buffer can reuse its handle
+        stagingRing.cancel(vertexBuffer);
+        stagingRing.cancel(indexBuffer);
+        gpuAllocator.destroyBuffer(vertexBuffer, vertexBufferAllocation);
+        gpuAllocator.destroyBuffer(indexBuffer, indexBufferAllocation);
+        createMesh("benchmark grid", grid, placement.flags); //the next frame recorded draws from it
+        //a big device local buffer arrives through the transfer queue; don't time frames that skip the draw
+        while (pendingVertexUpload && !glfwWindowShouldClose(window)) {
+          glfwPollEvents();
+          drawFrame();
+        }
+        frameGpuMs.clear();
+        for (int frame = 0; frame < VERTEX_BENCHMARK_WARMUP_FRAMES + vertexBenchmarkFrames && !glfwWindowShouldClose(window); frame++) {
+          glfwPollEvents();
+          drawFrame();
+        }
+        vkDeviceWaitIdle(device);
+        if (frameGpuMs.size() <= static_cast<size_t>(VERTEX_BENCHMARK_WARMUP_FRAMES)) {
+          std::cout << "  " << placement.name << ": not enough frames timed" << std::endl;
+          continue;
+        }
+        std::vector<double> samples(frameGpuMs.begin() + VERTEX_BENCHMARK_WARMUP_FRAMES, frameGpuMs.end());
+        std::sort(samples.begin(), samples.end());
+        placement.medianMs = samples[samples.size() / 2];
+        double meanMs = 0.0;
+        for (double sample : samples) {
+          meanMs += sample / samples.size();
+        }
+        std::cout << "  " << placement.name << ": median " << placement.medianMs << " ms, mean " << meanMs << " ms over "
+                  << samples.size() << " frames, " << (grid.size() / 3) / (placement.medianMs * 1000.0) << " Mtri/s" << std::endl;
+      }
+      if (placements[0].medianMs > 0.0 && placements[1].medianMs > 0.0) {
+        std::cout << "  device local is " << placements[0].medianMs / placements[1].medianMs << "x the throughput of host visible" << std::endl;
+      }
+      vkDestroyQueryPool(device, timestampQueryPool, hostCallbacks);
+      timestampQueryPool = VK_NULL_HANDLE;
+    }
+  /**** Vertex Memory Benchmark ****/
+
+  /**** Instancing Benchmark ****/
+    /*
+      --bench-instancing [frames]: for each count in INSTANCING_BENCHMARK_COUNTS, draws
+      that many copies of the quad as one instanced draw and then as one draw per copy
+      (same instance data, picked with firstInstance, so the GPU shades exactly the same
+      thing). Reports the render pass GPU time and the CPU time spent recording, where
+      per-object draws are expected to lose first. With --gpu-driven the copies are
+      also drawn through the culling pass, whose GPU time includes the dispatch.
+    */
+    struct InstancingResult {
+      double gpuMs = 0.0; //median
+      double recordMs = 0.0; //mean, all recording threads
+    };
+
+    InstancingResult timeInstancedFrames(uint32_t count, bool perObject) {
+      sceneInstances = makeInstanceGrid(count);
+      drawPerObject = perObject;
+      for (int frame = 0; frame < INSTANCING_BENCHMARK_WARMUP_FRAMES && !glfwWindowShouldClose(window); frame++) {
+        glfwPollEvents();
+        drawFrame();
+      }
+      vkDeviceWaitIdle(device);
+      frameGpuMs.clear();
+      commandRecorder.resetStats();
+      for (int frame = 0; frame < instancingBenchmarkFrames && !glfwWindowShouldClose(window); frame++) {
+        glfwPollEvents();
+        drawFrame();
+      }
+      vkDeviceWaitIdle(device);
+      InstancingResult result;
+      result.recordMs = commandRecorder.averageRecordMs();
+      if (!frameGpuMs.empty()) {
+        std::sort(frameGpuMs.begin(), frameGpuMs.end());
+        result.gpuMs = frameGpuMs[frameGpuMs.size() / 2];
+      }
+      return result;
+    }
+
+    void runInstancingBenchmark() {
+      createTimestampQueryPool();
+      //the quad arrives through the staging ring or the transfer queue; frames before that draw nothing
+      while (pendingVertexUpload && !glfwWindowShouldClose(window)) {
+        glfwPollEvents();
+        drawFrame();
+      }
+      std::cout << "instancing benchmark: " << vertexCount << " vertices per copy, " << instancingBenchmarkFrames << " frames per run" << std::endl;
+      bool withGpuDriven = gpuDriven;
+      for (uint32_t count : INSTANCING_BENCHMARK_COUNTS) {
+        gpuDriven = false;
+        InstancingResult instanced = timeInstancedFrames(count, false);
+        InstancingResult perObject = timeInstancedFrames(count, true);
+        std::cout << "  " << count << " copies: instanced " << instanced.gpuMs << " ms GPU, " << instanced.recordMs << " ms recording; per object "
+                  << perObject.gpuMs << " ms GPU, " << perObject.recordMs << " ms recording";
+        if (instanced.gpuMs > 0.0 && instanced.recordMs > 0.0) {
+          std::cout << " (" << perObject.gpuMs / instanced.gpuMs << "x GPU, " << perObject.recordMs / instanced.recordMs << "x CPU)";
+        }
+        if (withGpuDriven) {
+          gpuDriven = true;
+          InstancingResult culled = timeInstancedFrames(count, false);
+          std::cout << "; gpu-driven " << culled.gpuMs << " ms GPU, " << culled.recordMs << " ms recording";
+        }
+        std::cout << std::endl;
+      }
+      sceneInstances = makeInstanceGrid(1);
+      drawPerObject = false;
+      gpuDriven = withGpuDriven;
+      vkDestroyQueryPool(device, timestampQueryPool, hostCallbacks);
+      timestampQueryPool = VK_NULL_HANDLE;
+    }
+  /**** Instancing Benchmark ****/
+
     /**** EVERYTHING ABOVE HERE IS WHAT DRAWS THE TRIANGLE. but, we need to handle some extra stuff ****/
 
     /**** Swapchain recreation on surface change, etc... ****/
     void cleanupOldSwapChain() {
-      for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
-        vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
-      }
-      vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
       //with dynmaic states, these stay in cleanup()
       //vkDestroyPipeline(device, graphicsPipeline, nullptr);
       //vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-      vkDestroyRenderPass(device, renderPass, nullptr);
+      renderGraph.destroy(); //render passes, framebuffers and transient images
+      renderPass = VK_NULL_HANDLE;
       for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-        vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+        vkDestroyImageView(device, swapChainImageViews[i], hostCallbacks);
       }
-      vkDestroySwapchainKHR(device, swapChain, nullptr);
+      vkDestroySwapchainKHR(device, swapChain, hostCallbacks);
     }
 
     void recreateSwapChain() {
@@ -1247,42 +2791,87 @@ private:
       //don't do anything until everything is done
       vkDeviceWaitIdle(device);
       //get rid of old one
+      std::unique_lock<std::shared_mutex> renderPassLock(renderPassMutex); //background pipeline builds may be using the render pass
       cleanupOldSwapChain();
       //rebuild
       createSwapChain();
       createImageViews();
-      createRenderPass();
+      createRenderGraph(); //framebuffers too; frames record against them from here on, see recordFrameCommands()
+      renderPassLock.unlock();
       // createGraphicsPipeline(); not needed with dynamic states
-      createFramebuffers();
-      createCommandBuffers();
     }
 
     /**** FINAL CLEANUP ****/
     void cleanup() {
+      stopShaderHotReload();
+      pipelineCompiler.stop(); //cancels queued variant builds and finishes running ones, before the render pass goes
       cleanupOldSwapChain();
 
-      vkDestroyBuffer(device, vertexBuffer, nullptr); //doesn't depend on swapchain
-      vkFreeMemory(device, vertexBufferMemory, nullptr);
-
-      vkDestroyPipeline(device, graphicsPipeline, nullptr);
-      vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+      std::cout << gpuAllocator.describeStats() << std::endl; //usage at exit, before anything is freed
+      memoryTelemetry.sample(gpuAllocator, frameNumber);
+      std::cout << memoryTelemetry.describe() << std::endl;
+      memoryTelemetry.close();
+      gpuAllocator.destroyBuffer(vertexBuffer, vertexBufferAllocation); //doesn't depend on swapchain
+      gpuAllocator.destroyBuffer(indexBuffer, indexBufferAllocation);
+      if (gpuDriven) {
+        std::cout << "gpu culling: " << gpuCuller.visibleObjects() << " objects drawn, " << gpuCuller.culledObjects() << " culled" << std::endl;
+      }
+      gpuCuller.destroy();
+      stagingRing.destroy();
+      asyncUploader.destroy();
+      std::cout << "frame data: peak " << frameData.peakBytes() << " of " << frameData.bytesPerFrame() << " bytes per frame" << std::endl;
+      frameData.destroy();
+
+      destroyPipelineVariants(); //graphicsPipeline is one of these
+      destroyAbandonedBuilds(); //every build is done since pipelineCompiler.stop()
+      vkDestroyPipelineLayout(device, pipelineLayout, hostCallbacks);
+      for (auto setLayout : descriptorSetLayouts) {
+        vkDestroyDescriptorSetLayout(device, setLayout, hostCallbacks);
+      }
+      savePipelineCache();
+      vkDestroyPipelineCache(device, pipelineCache, hostCallbacks);
 
       for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-        vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-        vkDestroyFence(device, inFlightFences[i], nullptr);
-      }
-      vkDestroyCommandPool(device, commandPool, nullptr);
-      vkDestroyDevice(device, nullptr);
-      vkDestroySurfaceKHR(instance, surface, nullptr);
-      vkDestroyInstance(instance, nullptr);
+        vkDestroySemaphore(device, renderFinishedSemaphores[i], hostCallbacks);
+        vkDestroySemaphore(device, imageAvailableSemaphores[i], hostCallbacks);
+        vkDestroyFence(device, inFlightFences[i], hostCallbacks);
+      }
+      commandRecorder.destroy();
+      frameContexts.destroy();
+      gpuAllocator.destroy();
+      vkDestroyDevice(device, hostCallbacks);
+      vkDestroySurfaceKHR(instance, surface, hostCallbacks);
+      vkDestroyInstance(instance, hostCallbacks);
+      if (hostCallbacks) {
+        std::cout << hostAllocator.describeStats() << std::endl; //anything still live here leaked
+      }
       glfwDestroyWindow(window);
       glfwTerminate();
     }
 };
 
-int main() {
+int main(int argc, char** argv) {
+    StartupProfiler::instance(); //starts the startup clock
     HelloTriangleApplication app;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--gpu" && i + 1 < argc) {
+            app.setDeviceSelection(argv[++i]); //index or part of the name, overrides GPU_DEVICE
+        } else if (std::string(argv[i]) == "--bench-vertex-memory") {
+            int frames = 500;
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                frames = std::atoi(argv[++i]);
+            }
+            app.setVertexMemoryBenchmark(frames);
+        } else if (std::string(argv[i]) == "--gpu-driven") {
+            app.setGpuDriven(true);
+        } else if (std::string(argv[i]) == "--bench-instancing") {
+            int frames = 200;
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                frames = std::atoi(argv[++i]);
+            }
+            app.setInstancingBenchmark(frames);
+        }
+    }
 
     try {
         app.run();
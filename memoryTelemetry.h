@@ -0,0 +1,222 @@
+/*
+ * Device memory budget and usage. Without this the first sign of running out is
+ * vkAllocateMemory returning VK_ERROR_OUT_OF_DEVICE_MEMORY, and by then it's too
+ * late to do anything but crash.
+ *
+ * With VK_EXT_memory_budget the driver reports, per heap, how much this process
+ * may use (the budget, which shrinks when other applications take memory) and how
+ * much it currently uses, including memory the driver allocated on our behalf.
+ * Without it we only know the heap sizes: the budget is then a fixed share of the
+ * heap and the usage is what GpuAllocator has reserved, which misses the driver's
+ * own allocations (swapchain images, for one).
+ *
+ * Each sample also carries what the app itself has in every heap, memory type and
+ * GpuMemoryCategory, so when a heap gets close to its budget the sample says what
+ * is using it. Samples are written one JSON object per line to a log if one was
+ * given, and a warning is printed whenever a heap crosses the warning threshold
+ * (once per crossing, not every frame it stays above).
+ */
+#pragma once
+
+#include "gpuAllocator.h"
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const double MEMORY_BUDGET_WARN_FRACTION = 0.9; //warn when a heap's usage passes this share of its budget
+const double MEMORY_BUDGET_FALLBACK_FRACTION = 0.8; //budget without VK_EXT_memory_budget: using a whole heap is rarely possible
+const uint32_t MEMORY_TELEMETRY_INTERVAL = 60; //frames between samples when nothing is logging every frame
+
+struct MemoryHeapSample {
+  VkDeviceSize size = 0;
+  VkDeviceSize budget = 0;
+  VkDeviceSize usage = 0; //whole process per the driver, or appReserved without the extension
+  VkDeviceSize appReserved = 0; //GpuAllocator blocks in this heap
+  VkDeviceSize appUsed = 0; //of those, what has been handed out
+  bool deviceLocal = false;
+};
+
+struct MemorySample {
+  uint64_t frame = 0;
+  bool fromBudgetExtension = false;
+  std::vector<MemoryHeapSample> heaps;
+  std::vector<GpuMemoryUsage> types; //indexed like VkPhysicalDeviceMemoryProperties::memoryTypes
+  GpuCategoryUsage categories = {};
+};
+
+class MemoryTelemetry {
+public:
+  /*
+    budgetEnabled: VK_EXT_memory_budget was enabled on the device, which also needs
+    VK_KHR_get_physical_device_properties2 on the instance for the query.
+    logPath: where to write a sample every frame, nullptr for none.
+  */
+  void init(VkInstance instance, VkPhysicalDevice device, bool budgetEnabled, const char* logPath) {
+    physicalDevice = device;
+    if (budgetEnabled) {
+      getMemoryProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceMemoryProperties2KHR>(
+          vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties2KHR"));
+    }
+    if (logPath) {
+      log.open(logPath, std::ios::trunc);
+      if (!log) {
+        std::cerr << "memory telemetry: can't write " << logPath << std::endl;
+      }
+    }
+    std::cout << "memory telemetry: " << (usesBudgetExtension() ? "VK_EXT_memory_budget" : "heap sizes (no VK_EXT_memory_budget)")
+              << (log.is_open() ? std::string(", logging to ") + logPath : std::string()) << std::endl;
+  }
+
+  bool usesBudgetExtension() const { return getMemoryProperties2 != nullptr; }
+
+  //once per frame, after the frame's fence: samples every frame while logging, every MEMORY_TELEMETRY_INTERVAL frames otherwise
+  void frame(GpuAllocator& allocator, uint64_t frameNumber) {
+    if (log.is_open() || frameNumber % MEMORY_TELEMETRY_INTERVAL == 0) {
+      sample(allocator, frameNumber);
+    }
+  }
+
+  const MemorySample& sample(GpuAllocator& allocator, uint64_t frameNumber) {
+    const VkPhysicalDeviceMemoryProperties& memory = allocator.properties();
+    MemorySample& current = latestSample;
+    current.frame = frameNumber;
+    current.fromBudgetExtension = usesBudgetExtension();
+    current.types = allocator.usageByType();
+    current.categories = allocator.usageByCategory();
+    current.heaps.assign(memory.memoryHeapCount, MemoryHeapSample());
+    for (uint32_t heap = 0; heap < memory.memoryHeapCount; heap++) {
+      current.heaps[heap].size = memory.memoryHeaps[heap].size;
+      current.heaps[heap].deviceLocal = (memory.memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    }
+    for (uint32_t type = 0; type < current.types.size(); type++) {
+      MemoryHeapSample& heap = current.heaps[memory.memoryTypes[type].heapIndex];
+      heap.appReserved += current.types[type].reservedBytes;
+      heap.appUsed += current.types[type].usedBytes;
+    }
+
+    if (usesBudgetExtension()) {
+      VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+      budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+      VkPhysicalDeviceMemoryProperties2 properties = {};
+      properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+      properties.pNext = &budget;
+      getMemoryProperties2(physicalDevice, &properties);
+      for (uint32_t heap = 0; heap < memory.memoryHeapCount; heap++) {
+        current.heaps[heap].budget = budget.heapBudget[heap];
+        current.heaps[heap].usage = budget.heapUsage[heap];
+      }
+    } else {
+      for (MemoryHeapSample& heap : current.heaps) {
+        heap.budget = static_cast<VkDeviceSize>(heap.size * MEMORY_BUDGET_FALLBACK_FRACTION);
+        heap.usage = heap.appReserved;
+      }
+    }
+
+    if (peakUsage.size() != current.heaps.size()) {
+      peakUsage.assign(current.heaps.size(), 0);
+      overBudget.assign(current.heaps.size(), false);
+    }
+    for (size_t heap = 0; heap < current.heaps.size(); heap++) {
+      peakUsage[heap] = std::max(peakUsage[heap], current.heaps[heap].usage);
+      checkBudget(heap, current.heaps[heap]);
+    }
+    sampleCount++;
+    if (log.is_open()) {
+      log << toJson(current) << '\n';
+    }
+    return current;
+  }
+
+  const MemorySample& latest() const { return latestSample; }
+  uint64_t samplesTaken() const { return sampleCount; }
+  uint64_t warningsRaised() const { return warningCount; }
+
+  //peak usage per heap next to its size and budget, for the end of a run
+  std::string describe() const {
+    std::ostringstream out;
+    out << "memory telemetry: " << sampleCount << " samples, " << warningCount << " budget warnings";
+    for (size_t heap = 0; heap < latestSample.heaps.size() && heap < peakUsage.size(); heap++) {
+      const MemoryHeapSample& sample = latestSample.heaps[heap];
+      out << "\n  heap " << heap << (sample.deviceLocal ? " (device local)" : "") << ": peak " << peakUsage[heap] / 1024 << " KiB, budget "
+          << sample.budget / 1024 << " KiB of " << sample.size / 1024 << " KiB";
+    }
+    for (size_t category = 0; category < latestSample.categories.size(); category++) {
+      const GpuMemoryUsage& usage = latestSample.categories[category];
+      if (usage.allocationCount > 0) {
+        out << "\n  " << gpuMemoryCategoryName(static_cast<GpuMemoryCategory>(category)) << ": " << usage.usedBytes / 1024 << " KiB in "
+            << usage.allocationCount << " allocations";
+      }
+    }
+    return out.str();
+  }
+
+  void close() {
+    if (log.is_open()) {
+      log.close();
+    }
+  }
+
+  static std::string toJson(const MemorySample& sample) {
+    std::ostringstream out;
+    out << "{\"frame\":" << sample.frame << ",\"budgetExtension\":" << (sample.fromBudgetExtension ? "true" : "false") << ",\"heaps\":[";
+    for (size_t heap = 0; heap < sample.heaps.size(); heap++) {
+      const MemoryHeapSample& h = sample.heaps[heap];
+      out << (heap ? "," : "") << "{\"heap\":" << heap << ",\"deviceLocal\":" << (h.deviceLocal ? "true" : "false") << ",\"size\":" << h.size
+          << ",\"budget\":" << h.budget << ",\"usage\":" << h.usage << ",\"appReserved\":" << h.appReserved << ",\"appUsed\":" << h.appUsed
+          << "}";
+    }
+    out << "],\"types\":[";
+    bool first = true;
+    for (size_t type = 0; type < sample.types.size(); type++) {
+      const GpuMemoryUsage& t = sample.types[type];
+      if (t.reservedBytes == 0) {
+        continue; //most types are never used, keep lines short
+      }
+      out << (first ? "" : ",") << "{\"type\":" << type << ",\"reserved\":" << t.reservedBytes << ",\"used\":" << t.usedBytes
+          << ",\"allocations\":" << t.allocationCount << "}";
+      first = false;
+    }
+    out << "],\"categories\":{";
+    for (size_t category = 0; category < sample.categories.size(); category++) {
+      const GpuMemoryUsage& c = sample.categories[category];
+      out << (category ? "," : "") << "\"" << gpuMemoryCategoryName(static_cast<GpuMemoryCategory>(category)) << "\":{\"used\":"
+          << c.usedBytes << ",\"allocations\":" << c.allocationCount << "}";
+    }
+    out << "}}";
+    return out.str();
+  }
+
+private:
+  //warn on the way up, re-arm once usage drops a little below the threshold so a heap hovering around it doesn't spam
+  void checkBudget(size_t heap, const MemoryHeapSample& sample) {
+    if (sample.budget == 0) {
+      return;
+    }
+    double fraction = static_cast<double>(sample.usage) / static_cast<double>(sample.budget);
+    if (!overBudget[heap] && fraction >= MEMORY_BUDGET_WARN_FRACTION) {
+      overBudget[heap] = true;
+      warningCount++;
+      std::cerr << "warning: memory heap " << heap << " at " << static_cast<int>(fraction * 100) << "% of its budget ("
+                << sample.usage / 1024 << " of " << sample.budget / 1024 << " KiB, app " << sample.appReserved / 1024 << " KiB)"
+                << std::endl;
+    } else if (overBudget[heap] && fraction < MEMORY_BUDGET_WARN_FRACTION - 0.05) {
+      overBudget[heap] = false;
+    }
+  }
+
+  VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR getMemoryProperties2 = nullptr; //nullptr: fall back to heap sizes
+  std::ofstream log; //JSON lines, one sample per frame
+  MemorySample latestSample;
+  std::vector<VkDeviceSize> peakUsage; //per heap
+  std::vector<bool> overBudget; //per heap, above the warning threshold at the last sample
+  uint64_t sampleCount = 0;
+  uint64_t warningCount = 0;
+};
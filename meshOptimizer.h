@@ -0,0 +1,247 @@
+/*
+ * Load-time mesh optimization. Meshes are authored as plain triangle lists, where
+ * every corner a triangle shares with its neighbours is stored (and fetched, and
+ * transformed) again. optimizeMesh() turns one into an indexed mesh in three passes:
+ *
+ *  1. Deduplication: bytewise identical vertices are merged through a hash table
+ *     keyed by fnv1a64 of their bytes, so the vertex type must have no padding.
+ *  2. Vertex cache order: triangles are reordered with Forsyth's linear-speed
+ *     algorithm, so a vertex is reused while it's still in the GPU's post-transform
+ *     cache instead of being shaded again.
+ *  3. Vertex fetch order: vertices are renumbered in order of first use, so the
+ *     input assembler walks the vertex buffer mostly front to back.
+ *
+ * MeshStats reports ACMR (average cache miss ratio: vertices shaded per triangle,
+ * 3 at worst, about 0.5 for a big regular grid) with a MESH_CACHE_SIZE entry FIFO
+ * cache, before and after reordering, and the bytes the mesh takes before and after.
+ */
+#pragma once
+
+#include "shaderCache.h" //fnv1a64
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+const uint32_t MESH_CACHE_SIZE = 16; //FIFO entries ACMR is measured with, a typical post-transform cache
+
+struct MeshStats {
+  size_t inputVertices = 0; //as given; 3 per triangle for a triangle list
+  size_t uniqueVertices = 0;
+  size_t triangles = 0;
+  float acmrBefore = 0.0f; //deduplicated, in the input's triangle order
+  float acmrAfter = 0.0f;
+  size_t bytesBefore = 0; //the input's vertices, plus its indices if it had any
+  size_t bytesAfter = 0; //unique vertices plus indices at indexSize
+  uint32_t indexSize = 4; //2 when every index fits in 16 bits
+
+  std::string describe(const std::string& name) const {
+    std::ostringstream out;
+    out << "mesh " << name << ": " << inputVertices << " -> " << uniqueVertices << " vertices, " << triangles << " triangles, ACMR "
+        << acmrBefore << " -> " << acmrAfter << " (FIFO " << MESH_CACHE_SIZE << "), " << bytesBefore << " -> " << bytesAfter << " bytes ("
+        << static_cast<long long>(bytesBefore) - static_cast<long long>(bytesAfter) << " saved, " << indexSize * 8 << "-bit indices)";
+    return out.str();
+  }
+};
+
+namespace mesh_optimizer_detail {
+  const uint32_t FORSYTH_CACHE_SIZE = 32; //the LRU cache the ordering aims at; bigger than MESH_CACHE_SIZE does no harm
+  const uint32_t NOT_CACHED = UINT32_MAX;
+
+  //how much emitting a triangle that uses this vertex now is worth
+  inline float vertexScore(uint32_t cachePosition, uint32_t trianglesLeft) {
+    if (trianglesLeft == 0) {
+      return -1.0f; //nothing left to draw with it
+    }
+    float score = 0.0f;
+    if (cachePosition < 3) {
+      score = 0.75f; //used by the last triangle: good, but not so good that strips of slivers win
+    } else if (cachePosition < FORSYTH_CACHE_SIZE) {
+      score = std::pow(1.0f - float(cachePosition - 3) / (FORSYTH_CACHE_SIZE - 3), 1.5f);
+    }
+    return score + 2.0f / std::sqrt(float(trianglesLeft)); //finish off vertices with few triangles left, they'd only be fetched again later
+  }
+
+  //Forsyth, "Linear-Speed Vertex Cache Optimisation": greedily emits the best scoring triangle next to what's cached
+  inline std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount) {
+    size_t triangleCount = indices.size() / 3;
+    //triangles using each vertex, as spans of one array
+    std::vector<uint32_t> trianglesLeft(vertexCount, 0);
+    for (uint32_t index : indices) {
+      trianglesLeft[index]++;
+    }
+    std::vector<uint32_t> firstTriangle(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; v++) {
+      firstTriangle[v + 1] = firstTriangle[v] + trianglesLeft[v];
+    }
+    std::vector<uint32_t> vertexTriangles(indices.size());
+    std::vector<uint32_t> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (size_t t = 0; t < triangleCount; t++) {
+      for (int corner = 0; corner < 3; corner++) {
+        vertexTriangles[filled[indices[3 * t + corner]]++] = static_cast<uint32_t>(t);
+      }
+    }
+
+    std::vector<uint32_t> cachePosition(vertexCount, NOT_CACHED);
+    std::vector<float> score(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++) {
+      score[v] = vertexScore(NOT_CACHED, trianglesLeft[v]);
+    }
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<bool> emitted(triangleCount, false);
+    size_t best = 0;
+    for (size_t t = 0; t < triangleCount; t++) {
+      triangleScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+      if (triangleScore[t] > triangleScore[best]) {
+        best = t;
+      }
+    }
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    std::vector<uint32_t> cache, nextCache; //most recent first, FORSYTH_CACHE_SIZE + 3 at most while updating
+    size_t scanFrom = 0; //no emitted triangle before this, for when nothing cached has triangles left
+    for (size_t emittedCount = 0; emittedCount < triangleCount; emittedCount++) {
+      emitted[best] = true;
+      const uint32_t* triangle = &indices[3 * best];
+      nextCache.assign(triangle, triangle + 3);
+      for (int corner = 0; corner < 3; corner++) {
+        uint32_t v = triangle[corner];
+        result.push_back(v);
+        //take the triangle off the vertex's span: swap it past the end of what's left
+        uint32_t* span = &vertexTriangles[firstTriangle[v]];
+        uint32_t* found = std::find(span, span + trianglesLeft[v], static_cast<uint32_t>(best));
+        std::swap(*found, span[--trianglesLeft[v]]);
+      }
+      for (uint32_t v : cache) {
+        if (v != triangle[0] && v != triangle[1] && v != triangle[2]) {
+          nextCache.push_back(v);
+        }
+      }
+      for (uint32_t v : cache) {
+        cachePosition[v] = NOT_CACHED; //anything still cached gets its new position below
+      }
+      for (uint32_t i = 0; i < nextCache.size(); i++) {
+        cachePosition[nextCache[i]] = i < FORSYTH_CACHE_SIZE ? i : NOT_CACHED;
+      }
+      //only vertices that moved in the cache change score, and only their triangles
+      for (uint32_t v : nextCache) {
+        score[v] = vertexScore(cachePosition[v], trianglesLeft[v]);
+      }
+      float bestScore = -1.0f;
+      for (uint32_t v : nextCache) {
+        for (uint32_t i = 0; i < trianglesLeft[v]; i++) {
+          uint32_t t = vertexTriangles[firstTriangle[v] + i];
+          triangleScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+          if (triangleScore[t] > bestScore) {
+            bestScore = triangleScore[t];
+            best = t;
+          }
+        }
+      }
+      if (nextCache.size() > FORSYTH_CACHE_SIZE) {
+        nextCache.resize(FORSYTH_CACHE_SIZE);
+      }
+      cache.swap(nextCache);
+      if (bestScore < 0.0f && emittedCount + 1 < triangleCount) {
+        //the cache has nothing left to draw: start again from the next triangle not emitted yet
+        while (emitted[scanFrom]) {
+          scanFrom++;
+        }
+        best = scanFrom;
+      }
+    }
+    return result;
+  }
+}
+
+//vertices shaded per triangle drawing indices through a FIFO post-transform cache of cacheSize entries
+inline float measureAcmr(const std::vector<uint32_t>& indices, size_t vertexCount, uint32_t cacheSize = MESH_CACHE_SIZE) {
+  if (indices.size() < 3) {
+    return 0.0f;
+  }
+  //a vertex is cached while fewer than cacheSize misses happened since its own
+  std::vector<uint32_t> missedAt(vertexCount, 0);
+  uint32_t misses = 0;
+  for (uint32_t index : indices) {
+    if (missedAt[index] == 0 || misses + 1 - missedAt[index] > cacheSize) {
+      missedAt[index] = ++misses;
+    }
+  }
+  return float(misses) / float(indices.size() / 3);
+}
+
+/*
+  Optimizes a triangle mesh for drawing indexed. indices is the input's index list,
+  or empty for a plain triangle list (every 3 vertices a triangle), and comes back
+  as the optimized mesh's indices into optimizedVertices.
+*/
+template <typename V>
+MeshStats optimizeMesh(const std::vector<V>& vertices, std::vector<V>& optimizedVertices, std::vector<uint32_t>& indices) {
+  static_assert(std::is_trivially_copyable<V>::value, "vertices are compared and hashed as bytes");
+  MeshStats stats;
+  stats.inputVertices = vertices.size();
+  stats.bytesBefore = vertices.size() * sizeof(V) + indices.size() * sizeof(uint32_t);
+  if (indices.empty()) {
+    indices.resize(vertices.size() - vertices.size() % 3);
+    for (uint32_t i = 0; i < indices.size(); i++) {
+      indices[i] = i;
+    }
+  }
+
+  //1. deduplicate: an open addressing table of unique vertex numbers, probed linearly
+  size_t tableSize = 1;
+  while (tableSize < vertices.size() * 2) {
+    tableSize *= 2;
+  }
+  const uint32_t EMPTY = UINT32_MAX;
+  std::vector<uint32_t> table(tableSize, EMPTY);
+  std::vector<uint32_t> remap(vertices.size(), EMPTY);
+  std::vector<V> unique;
+  for (uint32_t index : indices) {
+    if (remap[index] != EMPTY) {
+      continue;
+    }
+    const V& vertex = vertices[index];
+    size_t slot = fnv1a64(&vertex, sizeof(V)) & (tableSize - 1);
+    while (table[slot] != EMPTY && std::memcmp(&unique[table[slot]], &vertex, sizeof(V)) != 0) {
+      slot = (slot + 1) & (tableSize - 1);
+    }
+    if (table[slot] == EMPTY) {
+      table[slot] = static_cast<uint32_t>(unique.size());
+      unique.push_back(vertex);
+    }
+    remap[index] = table[slot];
+  }
+  for (uint32_t& index : indices) {
+    index = remap[index];
+  }
+  stats.uniqueVertices = unique.size();
+  stats.triangles = indices.size() / 3;
+  stats.acmrBefore = measureAcmr(indices, unique.size());
+
+  //2. vertex cache order
+  indices = mesh_optimizer_detail::optimizeVertexCache(indices, unique.size());
+  stats.acmrAfter = measureAcmr(indices, unique.size());
+
+  //3. vertex fetch order: number vertices as the index list first reaches them
+  std::vector<uint32_t> order(unique.size(), EMPTY);
+  optimizedVertices.clear();
+  optimizedVertices.reserve(unique.size());
+  for (uint32_t& index : indices) {
+    if (order[index] == EMPTY) {
+      order[index] = static_cast<uint32_t>(optimizedVertices.size());
+      optimizedVertices.push_back(unique[index]);
+    }
+    index = order[index];
+  }
+
+  stats.indexSize = optimizedVertices.size() <= 65536 ? 2 : 4;
+  stats.bytesAfter = optimizedVertices.size() * sizeof(V) + indices.size() * stats.indexSize;
+  return stats;
+}
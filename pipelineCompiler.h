@@ -0,0 +1,187 @@
+/*
+ * Background pipeline compilation. vkCreateGraphicsPipelines can take tens of
+ * milliseconds on a cold driver cache, which is a visible hitch if it happens on the
+ * render thread. PipelineCompiler runs pipeline builds on a small pool of worker
+ * threads and hands back a PipelineHandle straight away; the render thread polls
+ * ready() once per frame and draws with a fallback (or skips the draw) until then.
+ *
+ * vkCreateGraphicsPipelines and VkPipelineCache are internally synchronized, so
+ * builds on different workers don't need a lock of their own. Whatever the build
+ * function touches besides that is the caller's business.
+ */
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class PipelineStatus { Pending, Ready, Failed };
+
+//shared between the handle(s) and the worker building it
+struct PipelineBuildState {
+  std::atomic<PipelineStatus> status{PipelineStatus::Pending};
+  VkPipeline pipeline = VK_NULL_HANDLE; //written once, before status becomes Ready
+  std::string error; //written once, before status becomes Failed
+  double buildMs = 0.0;
+  std::mutex mutex;
+  std::condition_variable done;
+};
+
+/*
+  Future-like, but never blocks unless asked to with wait(). Copies share the same
+  build. The handle doesn't own the pipeline: whoever submitted it destroys it.
+*/
+class PipelineHandle {
+public:
+  PipelineHandle() = default;
+
+  //a handle for a pipeline that was built some other way (e.g. synchronously at startup)
+  static PipelineHandle completed(VkPipeline pipeline) {
+    PipelineHandle handle;
+    handle.state = std::make_shared<PipelineBuildState>();
+    handle.state->pipeline = pipeline;
+    handle.state->status = PipelineStatus::Ready;
+    return handle;
+  }
+
+  bool valid() const { return state != nullptr; }
+  PipelineStatus status() const { return state ? state->status.load() : PipelineStatus::Failed; }
+  bool ready() const { return status() == PipelineStatus::Ready; }
+  bool failed() const { return status() == PipelineStatus::Failed; }
+  bool done() const { return status() != PipelineStatus::Pending; }
+
+  //VK_NULL_HANDLE until ready()
+  VkPipeline get() const { return ready() ? state->pipeline : VK_NULL_HANDLE; }
+  //only meaningful once failed()
+  const std::string& error() const { return state->error; }
+  double buildMs() const { return state->buildMs; }
+
+  void wait() const {
+    if (!state) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [this] { return state->status != PipelineStatus::Pending; });
+  }
+
+private:
+  friend class PipelineCompiler;
+  std::shared_ptr<PipelineBuildState> state;
+};
+
+class PipelineCompiler {
+public:
+  using BuildFunction = std::function<VkPipeline()>; //throws on failure
+
+  //two workers by default: enough to hide a build or two per frame without fighting the render thread for cores
+  explicit PipelineCompiler(unsigned threadCount = 2) {
+    threadCount = std::max(1u, threadCount);
+    for (unsigned i = 0; i < threadCount; i++) {
+      workers.emplace_back(&PipelineCompiler::work, this);
+    }
+  }
+  PipelineCompiler(const PipelineCompiler&) = delete;
+  PipelineCompiler& operator=(const PipelineCompiler&) = delete;
+  ~PipelineCompiler() { stop(); }
+
+  PipelineHandle submit(BuildFunction build) {
+    PipelineHandle handle;
+    handle.state = std::make_shared<PipelineBuildState>();
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      if (stopping) {
+        finish(*handle.state, VK_NULL_HANDLE, "pipeline compiler is stopped", 0.0);
+        return handle;
+      }
+      queue.push_back({std::move(build), handle.state});
+    }
+    queueReady.notify_one();
+    return handle;
+  }
+
+  //queued builds are failed as cancelled, running ones are finished. Safe to call more than once
+  void stop() {
+    std::deque<Job> cancelled;
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      stopping = true;
+      cancelled.swap(queue);
+    }
+    queueReady.notify_all();
+    for (auto& job : cancelled) {
+      finish(*job.state, VK_NULL_HANDLE, "cancelled", 0.0);
+    }
+    for (auto& worker : workers) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+    workers.clear();
+  }
+
+  size_t pending() {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return queue.size();
+  }
+
+private:
+  struct Job {
+    BuildFunction build;
+    std::shared_ptr<PipelineBuildState> state;
+  };
+
+  void work() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        queueReady.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+          return; //stopping
+        }
+        job = std::move(queue.front());
+        queue.pop_front();
+      }
+      auto start = std::chrono::steady_clock::now();
+      VkPipeline pipeline = VK_NULL_HANDLE;
+      std::string error;
+      try {
+        pipeline = job.build();
+      } catch (const std::exception& e) {
+        error = e.what();
+      }
+      if (pipeline == VK_NULL_HANDLE && error.empty()) {
+        error = "build returned no pipeline";
+      }
+      finish(*job.state, pipeline, error, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+  }
+
+  static void finish(PipelineBuildState& state, VkPipeline pipeline, const std::string& error, double buildMs) {
+    {
+      std::lock_guard<std::mutex> lock(state.mutex);
+      state.pipeline = pipeline;
+      state.error = error;
+      state.buildMs = buildMs;
+      state.status = pipeline != VK_NULL_HANDLE ? PipelineStatus::Ready : PipelineStatus::Failed;
+    }
+    state.done.notify_all();
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex queueMutex;
+  std::condition_variable queueReady;
+  std::deque<Job> queue;
+  bool stopping = false;
+};
@@ -0,0 +1,737 @@
+/*
+ * Frame structure as a graph of passes. Hand-written render passes have to spell
+ * out every attachment's load/store ops and layouts and every dependency, and all
+ * of that has to change together whenever a pass is added, removed or reordered;
+ * getting one barrier wrong shows up as flicker on one vendor's driver only.
+ *
+ * Here each pass only declares what it does with which image: writes it as a color
+ * or depth attachment (clearing it or keeping its contents) or samples it in the
+ * fragment shader. compile() then works out the rest from the order of the uses:
+ *  - passes whose writes nothing ends up needing are culled: walking back from the
+ *    outputs (markOutput()), a pass is kept if it writes something still needed; a
+ *    clearing write satisfies the need, a keeping write or a read extends it;
+ *  - load/store ops (LOAD only if an earlier use left contents, STORE only if a
+ *    later use or the outside world wants them) and the initial/final layouts, so
+ *    the render pass does every layout transition itself;
+ *  - one incoming dependency per pass, from the stages and writes of each image's
+ *    previous use (or what importImage() was told happens before the frame);
+ *  - transient images (createImage()) whose lifetimes, first to last use among the
+ *    kept passes, don't overlap share memory. Their contents never need to survive
+ *    the handover: a transient's first use can't read it, so it starts UNDEFINED,
+ *    and the incoming dependency also waits for the memory's previous occupant.
+ *    Transients are shared by every frame in flight, so a slot's first occupant
+ *    waits for its last occupant, as the previous frame submitted it.
+ *
+ * The graph is rebuilt, not patched: destroy() drops everything, declarations
+ * included, and the caller declares and compiles again (on swapchain recreation).
+ * execute() records the kept passes in declaration order, each inside its render
+ * pass, calling the pass's function to record its contents.
+ */
+#pragma once
+
+#include "gpuAllocator.h"
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using RenderResource = uint32_t; //an image declared with importImage() or createImage()
+using RenderPassId = uint32_t;
+
+struct RenderImageDesc {
+  VkFormat format = VK_FORMAT_UNDEFINED;
+  VkExtent2D extent = {0, 0};
+  VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+};
+
+//what a pass's execute function records against; the render pass has already begun
+struct RenderPassContext {
+  VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+  uint32_t imageIndex = 0; //swapchain image the frame renders to
+  VkRenderPass renderPass = VK_NULL_HANDLE;
+  uint32_t subpass = 0;
+  VkFramebuffer framebuffer = VK_NULL_HANDLE;
+  VkExtent2D extent = {0, 0};
+};
+
+class RenderGraph {
+  enum class UseKind { Color, Depth, Sampled };
+
+public:
+  using ExecuteFunction = std::function<void(const RenderPassContext& context)>;
+
+  //declares a pass's uses, passed to the setup function given to addPass()
+  class PassBuilder {
+  public:
+    void writeColor(RenderResource image) { add(image, UseKind::Color, false, VkClearValue()); } //keeps its contents
+    void writeColor(RenderResource image, const VkClearColorValue& clear) {
+      VkClearValue value = {};
+      value.color = clear;
+      add(image, UseKind::Color, true, value);
+    }
+    void writeDepth(RenderResource image) { add(image, UseKind::Depth, false, VkClearValue()); }
+    void writeDepth(RenderResource image, float depth, uint32_t stencil = 0) {
+      VkClearValue value = {};
+      value.depthStencil = {depth, stencil};
+      add(image, UseKind::Depth, true, value);
+    }
+    void readSampled(RenderResource image) { add(image, UseKind::Sampled, false, VkClearValue()); } //in the fragment shader
+    //VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS if execute only runs vkCmdExecuteCommands
+    void contents(VkSubpassContents subpassContents) { graph.passes[pass].contents = subpassContents; }
+
+  private:
+    friend class RenderGraph;
+    PassBuilder(RenderGraph& renderGraph, RenderPassId passId) : graph(renderGraph), pass(passId) {}
+    void add(RenderResource image, UseKind kind, bool clear, const VkClearValue& clearValue);
+
+    RenderGraph& graph;
+    RenderPassId pass;
+  };
+
+  using SetupFunction = std::function<void(PassBuilder& builder)>;
+
+  RenderGraph() = default;
+  RenderGraph(const RenderGraph&) = delete;
+  RenderGraph& operator=(const RenderGraph&) = delete;
+
+  void init(VkDevice logicalDevice, GpuAllocator& gpuAllocator, const VkAllocationCallbacks* hostCallbacks = nullptr) {
+    device = logicalDevice;
+    allocator = &gpuAllocator;
+    callbacks = hostCallbacks;
+  }
+
+  /*
+    An image the graph doesn't own, e.g. the swapchain's: views holds one view per
+    swapchain image (execute() picks views[imageIndex]) or a single view. Before the
+    frame it is in initialLayout (UNDEFINED: contents don't matter), last touched by
+    srcStage/srcAccess; after its last use it is left in finalLayout.
+  */
+  RenderResource importImage(const std::string& name, const RenderImageDesc& desc, const std::vector<VkImageView>& views,
+                             VkImageLayout initialLayout, VkImageLayout finalLayout, VkPipelineStageFlags srcStage,
+                             VkAccessFlags srcAccess) {
+    if (views.empty()) {
+      throw std::runtime_error("render graph: imported image " + name + " has no views!");
+    }
+    Resource resource;
+    resource.name = name;
+    resource.desc = desc;
+    resource.imported = true;
+    resource.views = views;
+    resource.initialLayout = initialLayout;
+    resource.finalLayout = finalLayout;
+    resource.srcStage = srcStage;
+    resource.srcAccess = srcAccess;
+    resources.push_back(resource);
+    return static_cast<RenderResource>(resources.size() - 1);
+  }
+
+  //an image that only lives within the frame; compile() creates it, with memory it may share
+  RenderResource createImage(const std::string& name, const RenderImageDesc& desc) {
+    Resource resource;
+    resource.name = name;
+    resource.desc = desc;
+    resources.push_back(resource);
+    return static_cast<RenderResource>(resources.size() - 1);
+  }
+
+  //passes run in the order they are added; setup runs right away
+  RenderPassId addPass(const std::string& name, const SetupFunction& setup, ExecuteFunction execute) {
+    Pass pass;
+    pass.name = name;
+    pass.execute = std::move(execute);
+    passes.push_back(std::move(pass));
+    RenderPassId id = static_cast<RenderPassId>(passes.size() - 1);
+    PassBuilder builder(*this, id);
+    setup(builder);
+    return id;
+  }
+
+  //needed after the frame (presented, read back, ...): passes contributing to it are kept
+  void markOutput(RenderResource image) { resources.at(image).output = true; }
+
+  void compile() {
+    cull();
+    buildTimelines();
+    createTransients();
+    for (RenderPassId pass : order) {
+      createPass(pass);
+    }
+  }
+
+  //records every kept pass into commandBuffer, outside any render pass
+  void execute(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+    for (RenderPassId id : order) {
+      Pass& pass = passes[id];
+      RenderPassContext context;
+      context.commandBuffer = commandBuffer;
+      context.imageIndex = imageIndex;
+      context.renderPass = pass.renderPass;
+      context.framebuffer = framebuffer(id, imageIndex);
+      context.extent = pass.extent;
+      VkRenderPassBeginInfo beginInfo = {};
+      beginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+      beginInfo.renderPass = pass.renderPass;
+      beginInfo.framebuffer = context.framebuffer;
+      beginInfo.renderArea.offset = {0, 0};
+      beginInfo.renderArea.extent = pass.extent;
+      beginInfo.clearValueCount = static_cast<uint32_t>(pass.clearValues.size());
+      beginInfo.pClearValues = pass.clearValues.data();
+      vkCmdBeginRenderPass(commandBuffer, &beginInfo, pass.contents);
+      if (pass.execute) {
+        pass.execute(context);
+      }
+      vkCmdEndRenderPass(commandBuffer);
+    }
+  }
+
+  //VK_NULL_HANDLE for a culled pass
+  VkRenderPass renderPass(RenderPassId pass) const { return passes.at(pass).renderPass; }
+  bool culled(RenderPassId pass) const { return !passes.at(pass).kept; }
+  //both transients got the same memory
+  bool aliased(RenderResource a, RenderResource b) const {
+    return resources.at(a).slot != NO_SLOT && resources.at(a).slot == resources.at(b).slot;
+  }
+
+  VkFramebuffer framebuffer(RenderPassId pass, uint32_t imageIndex) const {
+    const std::vector<VkFramebuffer>& framebuffers = passes.at(pass).framebuffers;
+    return framebuffers.empty() ? VK_NULL_HANDLE : framebuffers[imageIndex % framebuffers.size()];
+  }
+
+  //for descriptor sets sampling a transient; VK_NULL_HANDLE if no kept pass uses it
+  VkImageView imageView(RenderResource image, uint32_t imageIndex = 0) const {
+    const std::vector<VkImageView>& views = resources.at(image).views;
+    return views.empty() ? VK_NULL_HANDLE : views[imageIndex % views.size()];
+  }
+
+  //culled passes and how much aliasing saved, after compile()
+  std::string describe() const {
+    std::ostringstream out;
+    out << "render graph: " << order.size() << " of " << passes.size() << " passes kept";
+    for (const Pass& pass : passes) {
+      if (!pass.kept) {
+        out << ", culled " << pass.name;
+      }
+    }
+    size_t transientCount = 0;
+    VkDeviceSize unaliasedBytes = 0;
+    for (const Resource& resource : resources) {
+      if (resource.image != VK_NULL_HANDLE) {
+        transientCount++;
+        unaliasedBytes += resource.size;
+      }
+    }
+    VkDeviceSize aliasedBytes = 0;
+    for (const Slot& slot : slots) {
+      aliasedBytes += slot.allocation.size;
+    }
+    out << "; " << transientCount << " transient images in " << slots.size() << " allocations, " << aliasedBytes / 1024 << " KiB ("
+        << unaliasedBytes / 1024 << " KiB unaliased)";
+    return out.str();
+  }
+
+  //frees everything compile() made and forgets the declarations
+  void destroy() {
+    for (Pass& pass : passes) {
+      for (VkFramebuffer framebuffer : pass.framebuffers) {
+        vkDestroyFramebuffer(device, framebuffer, callbacks);
+      }
+      if (pass.renderPass != VK_NULL_HANDLE) {
+        vkDestroyRenderPass(device, pass.renderPass, callbacks);
+      }
+    }
+    for (Resource& resource : resources) {
+      if (!resource.imported) {
+        for (VkImageView view : resource.views) {
+          vkDestroyImageView(device, view, callbacks);
+        }
+        if (resource.image != VK_NULL_HANDLE) {
+          vkDestroyImage(device, resource.image, callbacks);
+        }
+      }
+    }
+    for (Slot& slot : slots) {
+      allocator->free(slot.allocation);
+    }
+    passes.clear();
+    resources.clear();
+    order.clear();
+    timelines.clear();
+    slots.clear();
+  }
+
+private:
+  struct Use {
+    RenderResource resource = 0;
+    UseKind kind = UseKind::Color;
+    bool clear = false; //overwrites everything: earlier contents aren't needed
+    VkClearValue clearValue = {};
+  };
+
+  struct Pass {
+    std::string name;
+    std::vector<Use> uses;
+    VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE;
+    ExecuteFunction execute;
+    //compile()
+    bool kept = false;
+    VkRenderPass renderPass = VK_NULL_HANDLE;
+    std::vector<VkFramebuffer> framebuffers; //one per view of the imported images it uses, else one
+    std::vector<VkClearValue> clearValues; //per attachment
+    VkExtent2D extent = {0, 0};
+  };
+
+  static const size_t NO_SLOT = std::numeric_limits<size_t>::max();
+
+  struct Resource {
+    std::string name;
+    RenderImageDesc desc;
+    bool imported = false;
+    bool output = false;
+    std::vector<VkImageView> views; //imported: the caller's; transient: one, made by compile()
+    VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; //imported only
+    VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    VkAccessFlags srcAccess = 0;
+    //transient, compile()
+    VkImage image = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    size_t slot = NO_SLOT;
+    RenderResource previousOccupant = 0; //of the slot: earlier in the frame, or the previous frame's last. Transients only
+    bool hasPreviousOccupant = false;
+  };
+
+  //memory shared by transients with disjoint lifetimes
+  struct Slot {
+    VkMemoryRequirements requirements = {};
+    size_t lastPosition = 0; //in order, of its latest occupant
+    RenderResource lastOccupant = 0;
+    GpuAllocation allocation;
+  };
+
+  //a use at a position in order
+  struct TimelineEntry {
+    size_t position = 0;
+    const Use* use = nullptr;
+  };
+
+  static VkImageLayout layoutFor(UseKind kind) {
+    switch (kind) {
+      case UseKind::Color: return VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      case UseKind::Depth: return VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+      default: return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+  }
+
+  static VkPipelineStageFlags stagesFor(UseKind kind) {
+    switch (kind) {
+      case UseKind::Color: return VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      case UseKind::Depth: return VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      default: return VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    }
+  }
+
+  static VkAccessFlags accessFor(UseKind kind) {
+    switch (kind) {
+      case UseKind::Color: return VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      case UseKind::Depth: return VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      default: return VK_ACCESS_SHADER_READ_BIT;
+    }
+  }
+
+  //only writes need making available; a read before a write just needs the execution dependency
+  static VkAccessFlags writesOf(VkAccessFlags access) {
+    return access & (VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT
+                     | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT);
+  }
+
+  static bool hasStencil(VkFormat format) {
+    return format == VK_FORMAT_S8_UINT || format == VK_FORMAT_D16_UNORM_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT
+           || format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+  }
+
+  static bool isDepthFormat(VkFormat format) {
+    return hasStencil(format) || format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_X8_D24_UNORM_PACK32 || format == VK_FORMAT_D32_SFLOAT;
+  }
+
+  //walks back from the outputs; order gets the kept passes, in declaration order
+  void cull() {
+    std::vector<bool> needed(resources.size(), false);
+    for (size_t i = 0; i < resources.size(); i++) {
+      needed[i] = resources[i].output;
+    }
+    for (size_t p = passes.size(); p-- > 0;) {
+      Pass& pass = passes[p];
+      pass.kept = false;
+      for (const Use& use : pass.uses) {
+        if (use.kind != UseKind::Sampled && needed[use.resource]) {
+          pass.kept = true;
+        }
+      }
+      if (!pass.kept) {
+        continue;
+      }
+      for (const Use& use : pass.uses) {
+        if (use.clear) {
+          needed[use.resource] = false; //earlier writers are overwritten
+        }
+      }
+      for (const Use& use : pass.uses) {
+        if (!use.clear) {
+          needed[use.resource] = true; //read, or drawn on top of
+        }
+      }
+    }
+    order.clear();
+    for (size_t p = 0; p < passes.size(); p++) {
+      if (passes[p].kept) {
+        order.push_back(static_cast<RenderPassId>(p));
+      }
+    }
+  }
+
+  void buildTimelines() {
+    timelines.assign(resources.size(), std::vector<TimelineEntry>());
+    for (size_t position = 0; position < order.size(); position++) {
+      for (const Use& use : passes[order[position]].uses) {
+        timelines[use.resource].push_back({position, &use});
+      }
+    }
+    for (size_t r = 0; r < resources.size(); r++) {
+      const Resource& resource = resources[r];
+      const std::vector<TimelineEntry>& timeline = timelines[r];
+      if (timeline.empty()) {
+        continue;
+      }
+      UseKind first = timeline.front().use->kind;
+      if (!resource.imported && first == UseKind::Sampled) {
+        throw std::runtime_error("render graph: " + resource.name + " is read by " + passes[order[timeline.front().position]].name
+                                 + " before anything writes it!");
+      }
+      if (resource.imported && first == UseKind::Sampled && resource.initialLayout != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+        throw std::runtime_error("render graph: " + resource.name + " is sampled first but not imported in a shader read layout!");
+      }
+      //sampling changes no layout, so the image is left as the use before it left it: shader read
+      if (resource.imported && timeline.back().use->kind == UseKind::Sampled && resource.finalLayout != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+        throw std::runtime_error("render graph: " + resource.name + " is sampled last, so its final layout has to be a shader read layout!");
+      }
+    }
+  }
+
+  //creates the used transients, aliasing memory between those whose lifetimes don't overlap
+  void createTransients() {
+    std::vector<RenderResource> transients;
+    for (size_t r = 0; r < resources.size(); r++) {
+      if (!resources[r].imported && !timelines[r].empty()) {
+        transients.push_back(static_cast<RenderResource>(r));
+      }
+    }
+    //by first use, so each slot's occupants follow one another
+    std::sort(transients.begin(), transients.end(),
+              [this](RenderResource a, RenderResource b) { return timelines[a].front().position < timelines[b].front().position; });
+
+    std::vector<VkMemoryRequirements> requirements(resources.size());
+    for (RenderResource r : transients) {
+      Resource& resource = resources[r];
+      VkImageCreateInfo imageInfo = {};
+      imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+      imageInfo.imageType = VK_IMAGE_TYPE_2D;
+      imageInfo.format = resource.desc.format;
+      imageInfo.extent = {resource.desc.extent.width, resource.desc.extent.height, 1};
+      imageInfo.mipLevels = 1;
+      imageInfo.arrayLayers = 1;
+      imageInfo.samples = resource.desc.samples;
+      imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+      imageInfo.usage = usageOf(r);
+      imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+      imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      if (vkCreateImage(device, &imageInfo, callbacks, &resource.image) != VK_SUCCESS) {
+        throw std::runtime_error("render graph: failed to create image " + resource.name + "!");
+      }
+      vkGetImageMemoryRequirements(device, resource.image, &requirements[r]);
+      resource.size = requirements[r].size;
+    }
+
+    for (RenderResource r : transients) {
+      Resource& resource = resources[r];
+      const VkMemoryRequirements& needs = requirements[r];
+      size_t first = timelines[r].front().position;
+      //the free slot that has to grow least
+      size_t best = NO_SLOT;
+      for (size_t s = 0; s < slots.size(); s++) {
+        const Slot& slot = slots[s];
+        if (slot.lastPosition >= first || (slot.requirements.memoryTypeBits & needs.memoryTypeBits) == 0) {
+          continue;
+        }
+        if (best == NO_SLOT || growth(slot, needs) < growth(slots[best], needs)) {
+          best = s;
+        }
+      }
+      if (best == NO_SLOT) {
+        slots.push_back(Slot());
+        best = slots.size() - 1;
+        slots[best].requirements = needs;
+      } else {
+        Slot& slot = slots[best];
+        slot.requirements.size = std::max(slot.requirements.size, needs.size);
+        slot.requirements.alignment = std::max(slot.requirements.alignment, needs.alignment); //powers of two: the larger satisfies both
+        slot.requirements.memoryTypeBits &= needs.memoryTypeBits;
+        resource.previousOccupant = slot.lastOccupant;
+        resource.hasPreviousOccupant = true;
+      }
+      slots[best].lastPosition = timelines[r].back().position;
+      slots[best].lastOccupant = r;
+      resource.slot = best;
+    }
+    //the previous frame may still be using the memory (its own image, for a slot with one occupant)
+    for (RenderResource r : transients) {
+      Resource& resource = resources[r];
+      if (!resource.hasPreviousOccupant) {
+        resource.previousOccupant = slots[resource.slot].lastOccupant;
+        resource.hasPreviousOccupant = true;
+      }
+    }
+
+    for (Slot& slot : slots) {
+      slot.allocation = allocator->allocate(slot.requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GpuResourceKind::Optimal,
+                                            GpuMemoryCategory::Image);
+    }
+    for (RenderResource r : transients) {
+      Resource& resource = resources[r];
+      const GpuAllocation& allocation = slots[resource.slot].allocation;
+      vkBindImageMemory(device, resource.image, allocation.memory, allocation.offset);
+      VkImageViewCreateInfo viewInfo = {};
+      viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+      viewInfo.image = resource.image;
+      viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+      viewInfo.format = resource.desc.format;
+      viewInfo.subresourceRange.aspectMask = isDepthFormat(resource.desc.format) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+      viewInfo.subresourceRange.levelCount = 1;
+      viewInfo.subresourceRange.layerCount = 1;
+      VkImageView view;
+      if (vkCreateImageView(device, &viewInfo, callbacks, &view) != VK_SUCCESS) {
+        throw std::runtime_error("render graph: failed to create image view for " + resource.name + "!");
+      }
+      resource.views.push_back(view);
+    }
+  }
+
+  VkImageUsageFlags usageOf(RenderResource resource) const {
+    VkImageUsageFlags usage = 0;
+    for (const TimelineEntry& entry : timelines[resource]) {
+      switch (entry.use->kind) {
+        case UseKind::Color: usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT; break;
+        case UseKind::Depth: usage |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT; break;
+        case UseKind::Sampled: usage |= VK_IMAGE_USAGE_SAMPLED_BIT; break;
+      }
+    }
+    return usage;
+  }
+
+  static VkDeviceSize growth(const Slot& slot, const VkMemoryRequirements& needs) {
+    return needs.size > slot.requirements.size ? needs.size - slot.requirements.size : 0;
+  }
+
+  //the render pass, its incoming dependency and framebuffers for a kept pass
+  void createPass(RenderPassId id) {
+    Pass& pass = passes[id];
+    std::vector<VkAttachmentDescription> attachments;
+    std::vector<VkAttachmentReference> colorRefs;
+    VkAttachmentReference depthRef = {};
+    bool hasDepth = false;
+    std::vector<RenderResource> attached;
+    VkSubpassDependency dependency = {};
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    bool extentSet = false;
+
+    for (const Use& use : pass.uses) {
+      const Resource& resource = resources[use.resource];
+      const std::vector<TimelineEntry>& timeline = timelines[use.resource];
+      size_t index = 0;
+      while (timeline[index].use != &use) {
+        index++;
+      }
+      const Use* previous = index > 0 ? timeline[index - 1].use : nullptr;
+      const Use* next = index + 1 < timeline.size() ? timeline[index + 1].use : nullptr;
+
+      //wait for whatever touched the image (or its memory) before
+      if (previous) {
+        dependency.srcStageMask |= stagesFor(previous->kind);
+        dependency.srcAccessMask |= writesOf(accessFor(previous->kind));
+      } else if (resource.imported) {
+        dependency.srcStageMask |= resource.srcStage;
+        dependency.srcAccessMask |= writesOf(resource.srcAccess);
+      } else if (resource.hasPreviousOccupant) {
+        const Use* last = timelines[resource.previousOccupant].back().use;
+        dependency.srcStageMask |= stagesFor(last->kind);
+        dependency.srcAccessMask |= writesOf(accessFor(last->kind));
+      }
+      dependency.dstStageMask |= stagesFor(use.kind);
+      dependency.dstAccessMask |= accessFor(use.kind);
+
+      if (use.kind == UseKind::Sampled) {
+        continue; //not an attachment: the previous use's final layout already made it readable
+      }
+      if (!extentSet) {
+        pass.extent = resource.desc.extent;
+        extentSet = true;
+      } else if (resource.desc.extent.width != pass.extent.width || resource.desc.extent.height != pass.extent.height) {
+        throw std::runtime_error("render graph: attachments of " + pass.name + " differ in size!");
+      }
+      bool hasContents = previous != nullptr || (resource.imported && resource.initialLayout != VK_IMAGE_LAYOUT_UNDEFINED);
+      VkAttachmentDescription attachment = {};
+      attachment.format = resource.desc.format;
+      attachment.samples = resource.desc.samples;
+      attachment.loadOp = use.clear ? VK_ATTACHMENT_LOAD_OP_CLEAR : hasContents ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachment.storeOp = next || resource.imported ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      bool stencil = hasStencil(resource.desc.format);
+      attachment.stencilLoadOp = stencil ? attachment.loadOp : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachment.stencilStoreOp = stencil ? attachment.storeOp : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      //UNDEFINED unless loading: lets the driver skip the transition and discard what's there
+      if (attachment.loadOp != VK_ATTACHMENT_LOAD_OP_LOAD) {
+        attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      } else {
+        attachment.initialLayout = previous ? layoutFor(previous->kind) : resource.initialLayout;
+      }
+      attachment.finalLayout = next ? layoutFor(next->kind) : resource.imported ? resource.finalLayout : layoutFor(use.kind);
+
+      VkAttachmentReference ref = {};
+      ref.attachment = static_cast<uint32_t>(attachments.size());
+      ref.layout = layoutFor(use.kind);
+      if (use.kind == UseKind::Color) {
+        colorRefs.push_back(ref);
+      } else if (hasDepth) {
+        throw std::runtime_error("render graph: " + pass.name + " writes more than one depth attachment!");
+      } else {
+        depthRef = ref;
+        hasDepth = true;
+      }
+      attachments.push_back(attachment);
+      pass.clearValues.push_back(use.clearValue);
+      attached.push_back(use.resource);
+    }
+    if (attachments.empty()) {
+      throw std::runtime_error("render graph: " + pass.name + " writes no attachments!");
+    }
+    if (dependency.srcStageMask == 0) {
+      dependency.srcStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT; //imported with nothing to wait for
+    }
+
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = static_cast<uint32_t>(colorRefs.size());
+    subpass.pColorAttachments = colorRefs.data();
+    subpass.pDepthStencilAttachment = hasDepth ? &depthRef : nullptr;
+    VkRenderPassCreateInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+    renderPassInfo.pAttachments = attachments.data();
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+    renderPassInfo.dependencyCount = 1;
+    renderPassInfo.pDependencies = &dependency;
+    if (vkCreateRenderPass(device, &renderPassInfo, callbacks, &pass.renderPass) != VK_SUCCESS) {
+      throw std::runtime_error("render graph: failed to create render pass for " + pass.name + "!");
+    }
+
+    //one framebuffer per view of the attachment with the most (the swapchain's, usually)
+    size_t framebufferCount = 1;
+    for (RenderResource r : attached) {
+      framebufferCount = std::max(framebufferCount, resources[r].views.size());
+    }
+    std::vector<VkImageView> views(attached.size());
+    for (size_t i = 0; i < framebufferCount; i++) {
+      for (size_t a = 0; a < attached.size(); a++) {
+        const std::vector<VkImageView>& resourceViews = resources[attached[a]].views;
+        views[a] = resourceViews[i % resourceViews.size()];
+      }
+      VkFramebufferCreateInfo framebufferInfo = {};
+      framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+      framebufferInfo.renderPass = pass.renderPass;
+      framebufferInfo.attachmentCount = static_cast<uint32_t>(views.size());
+      framebufferInfo.pAttachments = views.data();
+      framebufferInfo.width = pass.extent.width;
+      framebufferInfo.height = pass.extent.height;
+      framebufferInfo.layers = 1;
+      VkFramebuffer framebuffer;
+      if (vkCreateFramebuffer(device, &framebufferInfo, callbacks, &framebuffer) != VK_SUCCESS) {
+        throw std::runtime_error("render graph: failed to create framebuffer for " + pass.name + "!");
+      }
+      pass.framebuffers.push_back(framebuffer);
+    }
+  }
+
+  VkDevice device = VK_NULL_HANDLE;
+  GpuAllocator* allocator = nullptr;
+  const VkAllocationCallbacks* callbacks = nullptr;
+  std::vector<Pass> passes; //declaration order
+  std::vector<Resource> resources;
+  std::vector<RenderPassId> order; //kept passes, in execution order
+  std::vector<std::vector<TimelineEntry>> timelines; //per resource, its uses by kept passes in order
+  std::vector<Slot> slots;
+};
+
+inline void RenderGraph::PassBuilder::add(RenderResource image, UseKind kind, bool clear, const VkClearValue& clearValue) {
+  Pass& target = graph.passes[pass];
+  if (image >= graph.resources.size()) {
+    throw std::runtime_error("render graph: " + target.name + " uses an undeclared image!");
+  }
+  for (const Use& use : target.uses) {
+    if (use.resource == image) {
+      throw std::runtime_error("render graph: " + target.name + " uses " + graph.resources[image].name + " twice!");
+    }
+  }
+  Use use;
+  use.resource = image;
+  use.kind = kind;
+  use.clear = clear;
+  use.clearValue = clearValue;
+  target.uses.push_back(use);
+}
+
+/*
+  Compiles a small offscreen graph on device and checks what the frame's graph
+  (a single pass so far) never exercises: a pass nothing needs is culled, and a
+  transient whose lifetime starts after another's ends takes over its memory.
+  Throws if either doesn't happen; returns the graph's describe().
+*/
+inline std::string checkRenderGraph(VkDevice device, GpuAllocator& allocator, const VkAllocationCallbacks* callbacks = nullptr) {
+  RenderGraph graph;
+  graph.init(device, allocator, callbacks);
+  RenderImageDesc desc;
+  desc.format = VK_FORMAT_R8G8B8A8_UNORM; //color attachment and sampled support are mandatory for it
+  desc.extent = {16, 16};
+  RenderResource first = graph.createImage("first", desc);
+  RenderResource second = graph.createImage("second", desc);
+  RenderResource third = graph.createImage("third", desc); //first is dead by then, so it can have first's memory
+  RenderResource unused = graph.createImage("unused", desc);
+  VkClearColorValue clear = {{0.0f, 0.0f, 0.0f, 1.0f}};
+  graph.addPass("a", [&](RenderGraph::PassBuilder& pass) { pass.writeColor(first, clear); }, nullptr);
+  graph.addPass("b", [&](RenderGraph::PassBuilder& pass) { pass.readSampled(first); pass.writeColor(second, clear); }, nullptr);
+  graph.addPass("c", [&](RenderGraph::PassBuilder& pass) { pass.readSampled(second); pass.writeColor(third, clear); }, nullptr);
+  RenderPassId dead = graph.addPass("dead", [&](RenderGraph::PassBuilder& pass) { pass.writeColor(unused, clear); }, nullptr);
+  graph.markOutput(third);
+  std::string report;
+  try {
+    graph.compile();
+    if (!graph.culled(dead)) {
+      throw std::runtime_error("render graph check: a pass writing only unused images wasn't culled!");
+    }
+    if (!graph.aliased(first, third)) {
+      throw std::runtime_error("render graph check: transients with disjoint lifetimes didn't share memory!");
+    }
+    report = graph.describe();
+  } catch (...) {
+    graph.destroy();
+    throw;
+  }
+  graph.destroy();
+  return report;
+}
@@ -0,0 +1,230 @@
+/*
+ * Packed shader archive: every compiled shader in one file with an index up front.
+ * The batch compiler in libshaderc_stuff.cpp writes it (--pack), and main.cpp maps
+ * it into memory and hands VkShaderModuleCreateInfo::pCode a pointer straight into
+ * the mapping. No per-shader file reads, no heap copies.
+ *
+ * Layout:
+ *   ShaderArchiveHeader
+ *   ShaderArchiveEntry[entryCount]
+ *   SPIR-V blobs, each starting on a SHADER_ARCHIVE_ALIGNMENT boundary
+ * mmap hands back page aligned memory, so aligned offsets give aligned pointers,
+ * which is what pCode (a uint32_t*) needs.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+//no mmap, ShaderArchive reads the file into an aligned buffer instead
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const uint32_t SHADER_ARCHIVE_MAGIC = 0x4B415053; //"SPAK"
+const uint32_t SHADER_ARCHIVE_VERSION = 1;
+const uint64_t SHADER_ARCHIVE_ALIGNMENT = 16;
+const size_t SHADER_ARCHIVE_NAME_SIZE = 96;
+
+struct ShaderArchiveHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entryCount;
+  uint32_t reserved;
+  uint64_t fileSize; //lets the reader catch truncated archives
+};
+
+struct ShaderArchiveEntry {
+  char name[SHADER_ARCHIVE_NAME_SIZE]; //source path the shader was compiled from, null terminated
+  uint64_t key; //ShaderCache::makeKey() of the source it was compiled from, for staleness checks
+  uint64_t offset; //from the start of the file
+  uint64_t size; //bytes of SPIR-V
+  uint32_t kind; //shaderc_shader_kind
+  uint32_t reserved;
+};
+
+//one shader handed to writeShaderArchive()
+struct ShaderArchiveInput {
+  std::string name;
+  uint64_t key;
+  uint32_t kind;
+  std::vector<char> spirv;
+};
+
+inline uint64_t alignShaderArchiveOffset(uint64_t offset) {
+  return (offset + SHADER_ARCHIVE_ALIGNMENT - 1) & ~(SHADER_ARCHIVE_ALIGNMENT - 1);
+}
+
+//offline side: writes every input into one archive, throws on failure
+inline void writeShaderArchive(const std::string& path, const std::vector<ShaderArchiveInput>& inputs) {
+  std::vector<ShaderArchiveEntry> entries(inputs.size());
+  uint64_t offset = alignShaderArchiveOffset(sizeof(ShaderArchiveHeader) + sizeof(ShaderArchiveEntry) * inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (inputs[i].name.size() >= SHADER_ARCHIVE_NAME_SIZE) {
+      throw std::runtime_error("shader name too long for archive: " + inputs[i].name);
+    }
+    if (inputs[i].spirv.size() % 4 != 0) {
+      throw std::runtime_error("SPIR-V is not a whole number of words: " + inputs[i].name);
+    }
+    std::memset(&entries[i], 0, sizeof(ShaderArchiveEntry));
+    std::memcpy(entries[i].name, inputs[i].name.c_str(), inputs[i].name.size());
+    entries[i].key = inputs[i].key;
+    entries[i].offset = offset;
+    entries[i].size = inputs[i].spirv.size();
+    entries[i].kind = inputs[i].kind;
+    offset = alignShaderArchiveOffset(offset + inputs[i].spirv.size());
+  }
+  ShaderArchiveHeader header = {};
+  header.magic = SHADER_ARCHIVE_MAGIC;
+  header.version = SHADER_ARCHIVE_VERSION;
+  header.entryCount = static_cast<uint32_t>(inputs.size());
+  header.fileSize = offset;
+
+  std::string tempPath = path + ".tmp";
+  std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    throw std::runtime_error("failed to open " + tempPath + " for writing!");
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(entries.data()), sizeof(ShaderArchiveEntry) * entries.size());
+  const char padding[SHADER_ARCHIVE_ALIGNMENT] = {};
+  uint64_t written = sizeof(header) + sizeof(ShaderArchiveEntry) * entries.size();
+  for (size_t i = 0; i < inputs.size(); i++) {
+    file.write(padding, entries[i].offset - written);
+    file.write(inputs[i].spirv.data(), inputs[i].spirv.size());
+    written = entries[i].offset + entries[i].size;
+  }
+  file.write(padding, header.fileSize - written);
+  file.close();
+  if (!file.good() || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+    std::remove(tempPath.c_str());
+    throw std::runtime_error("failed to write shader archive " + path + "!");
+  }
+}
+
+/*
+  Runtime side. open() maps the archive read only; find() and code() give back
+  pointers into the mapping that stay valid until close() (or destruction).
+  vkCreateShaderModule copies the code it is given, so the mapping only has to
+  outlive module creation.
+*/
+class ShaderArchive {
+public:
+  ShaderArchive() = default;
+  ShaderArchive(const ShaderArchive&) = delete;
+  ShaderArchive& operator=(const ShaderArchive&) = delete;
+  ~ShaderArchive() { close(); }
+
+  //false if the archive is missing or malformed, which callers treat as "compile instead"
+  bool open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+      return false;
+    }
+    size_t fileSize = static_cast<size_t>(file.tellg());
+    fallbackStorage.resize((fileSize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(fallbackStorage.data()), fileSize);
+    base = reinterpret_cast<const char*>(fallbackStorage.data());
+    mappedSize = fileSize;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+      ::close(fd);
+      return false;
+    }
+    void* mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); //the mapping keeps its own reference to the file
+    if (mapping == MAP_FAILED) {
+      return false;
+    }
+    //we are about to touch every shader in it, so ask the kernel to read ahead
+    posix_madvise(mapping, static_cast<size_t>(info.st_size), POSIX_MADV_WILLNEED);
+    base = static_cast<const char*>(mapping);
+    mappedSize = static_cast<size_t>(info.st_size);
+#endif
+    if (!validate()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+#ifdef _WIN32
+    fallbackStorage.clear();
+#else
+    if (base) {
+      munmap(const_cast<char*>(base), mappedSize);
+    }
+#endif
+    base = nullptr;
+    mappedSize = 0;
+  }
+
+  bool isOpen() const { return base != nullptr; }
+
+  const ShaderArchiveEntry* find(const std::string& name) const {
+    for (uint32_t i = 0; i < entryCount(); i++) {
+      if (name == entries()[i].name) {
+        return &entries()[i];
+      }
+    }
+    return nullptr;
+  }
+
+  const uint32_t* code(const ShaderArchiveEntry& entry) const {
+    return reinterpret_cast<const uint32_t*>(base + entry.offset);
+  }
+
+  uint32_t entryCount() const { return isOpen() ? header()->entryCount : 0; }
+
+private:
+  const ShaderArchiveHeader* header() const { return reinterpret_cast<const ShaderArchiveHeader*>(base); }
+  const ShaderArchiveEntry* entries() const { return reinterpret_cast<const ShaderArchiveEntry*>(base + sizeof(ShaderArchiveHeader)); }
+
+  //every offset gets bounds and alignment checked once here so find()/code() don't have to
+  bool validate() const {
+    if (mappedSize < sizeof(ShaderArchiveHeader)) {
+      return false;
+    }
+    const ShaderArchiveHeader* h = header();
+    if (h->magic != SHADER_ARCHIVE_MAGIC || h->version != SHADER_ARCHIVE_VERSION || h->fileSize != mappedSize) {
+      return false;
+    }
+    uint64_t indexEnd = sizeof(ShaderArchiveHeader) + uint64_t(h->entryCount) * sizeof(ShaderArchiveEntry);
+    if (indexEnd > mappedSize) {
+      return false;
+    }
+    for (uint32_t i = 0; i < h->entryCount; i++) {
+      const ShaderArchiveEntry& entry = entries()[i];
+      if (entry.offset < indexEnd || entry.offset % SHADER_ARCHIVE_ALIGNMENT != 0 || entry.size % 4 != 0
+          || entry.size > mappedSize || entry.offset > mappedSize - entry.size
+          || std::memchr(entry.name, '\0', SHADER_ARCHIVE_NAME_SIZE) == nullptr) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const char* base = nullptr;
+  size_t mappedSize = 0;
+#ifdef _WIN32
+  std::vector<uint64_t> fallbackStorage;
+#endif
+};
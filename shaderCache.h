@@ -0,0 +1,264 @@
+/*
+ * On-disk, content addressed cache for GLSL -> SPIR-V compilation results.
+ * Header only so it can be shared by main.cpp and libshaderc_stuff.cpp without
+ * changing their one line build commands.
+ *
+ * Every entry is keyed by a hash of everything that can change the SPIR-V that
+ * shaderc produces: the GLSL source, the shader kind, the entry point and a tag
+ * describing the compile options (shaderc_compile_options_t is opaque, so the
+ * caller has to describe it). On a hit the stored SPIR-V is returned and shaderc
+ * is never touched. Entries are plain files in one directory, so "clearing the
+ * cache" is just deleting the directory. Data derived from the SPIR-V (like
+ * reflection, see spirvReflect.h) can be stored next to it under the same key
+ * with storeBlob()/loadBlob().
+ */
+#pragma once
+
+#include <shaderc/shaderc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+//bump this whenever the compiler or the entry format changes so stale entries stop matching
+const uint32_t SHADER_CACHE_VERSION = 1;
+const uint32_t SHADER_CACHE_MAGIC = 0x43565053; //"SPVC"
+const uintmax_t SHADER_CACHE_DEFAULT_MAX_BYTES = 64ull * 1024 * 1024;
+//options tag for shaders compiled with default (nullptr) shaderc options. main.cpp and the
+//batch compiler in libshaderc_stuff.cpp must agree on it or they won't share entries
+const char* const SHADER_DEFAULT_OPTIONS_TAG = "default";
+
+//64 bit FNV-1a. Not cryptographic, but plenty for content addressing a shader directory
+inline uint64_t fnv1a64(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+//maps a shader file extension (.vert, .frag, ...) to its shaderc kind, false for anything else
+inline bool shaderKindFromPath(const std::filesystem::path& path, shaderc_shader_kind& kind) {
+  std::string extension = path.extension().string();
+  if (extension == ".vert") kind = shaderc_glsl_vertex_shader;
+  else if (extension == ".frag") kind = shaderc_glsl_fragment_shader;
+  else if (extension == ".comp") kind = shaderc_glsl_compute_shader;
+  else if (extension == ".geom") kind = shaderc_glsl_geometry_shader;
+  else if (extension == ".tesc") kind = shaderc_glsl_tess_control_shader;
+  else if (extension == ".tese") kind = shaderc_glsl_tess_evaluation_shader;
+  else return false;
+  return true;
+}
+
+class ShaderCache {
+public:
+  explicit ShaderCache(const std::string& directory = "shader_cache", uintmax_t maxBytes = SHADER_CACHE_DEFAULT_MAX_BYTES)
+    : cacheDirectory(directory), maxCacheBytes(maxBytes) {}
+
+  //everything that goes into the key is length prefixed so ("ab","c") and ("a","bc") can't collide
+  static uint64_t makeKey(const std::string& source, shaderc_shader_kind kind,
+                          const std::string& entryPoint, const std::string& optionsTag) {
+    uint64_t hash = fnv1a64(&SHADER_CACHE_VERSION, sizeof(SHADER_CACHE_VERSION));
+    auto mix = [&hash](const std::string& s) {
+      uint64_t length = s.size();
+      hash = fnv1a64(&length, sizeof(length), hash);
+      hash = fnv1a64(s.data(), s.size(), hash);
+    };
+    mix(source);
+    int32_t kindValue = static_cast<int32_t>(kind);
+    hash = fnv1a64(&kindValue, sizeof(kindValue), hash);
+    mix(entryPoint);
+    mix(optionsTag);
+    return hash;
+  }
+
+  //returns true and fills spirv on a hit. Corrupt or truncated entries count as misses and are removed.
+  //words rather than bytes so the result can go straight into VkShaderModuleCreateInfo::pCode
+  bool load(uint64_t key, std::vector<uint32_t>& spirv) {
+    bool hit = readEntry(key, ".spv", spirv) && spirv.size() >= 5; //a SPIR-V header alone is 5 words
+    if (!hit) {
+      spirv.clear();
+    }
+    (hit ? hitCount : missCount)++;
+    return hit;
+  }
+
+  void store(uint64_t key, const char* data, size_t size) {
+    writeEntry(key, ".spv", data, size);
+  }
+
+  //side data stored under the same key as the SPIR-V, e.g. reflection. Not counted as hits or misses
+  bool loadBlob(uint64_t key, const std::string& extension, std::vector<char>& data) {
+    return readEntry(key, extension, data);
+  }
+
+  void storeBlob(uint64_t key, const std::string& extension, const std::vector<char>& data) {
+    writeEntry(key, extension, data.data(), data.size());
+  }
+
+  //evicts least recently used entries until the directory fits in maxCacheBytes. Scans the whole directory;
+  //stores only call it once their running total of bytes written goes over the limit
+  void trim() {
+    std::lock_guard<std::mutex> lock(trimMutex);
+    struct Entry {
+      std::filesystem::path path;
+      uintmax_t size;
+      std::filesystem::file_time_type lastUsed;
+    };
+    std::vector<Entry> entries;
+    uintmax_t totalBytes = 0;
+    std::error_code ec;
+    for (const auto& item : std::filesystem::directory_iterator(cacheDirectory, ec)) {
+      //skip other writers' in-flight temp files (name.ext.tmpNNN)
+      if (!item.is_regular_file(ec) || item.path().extension().string().compare(0, 4, ".tmp") == 0) {
+        continue;
+      }
+      Entry entry = {item.path(), item.file_size(ec), item.last_write_time(ec)};
+      totalBytes += entry.size;
+      entries.push_back(entry);
+    }
+    knownBytes = totalBytes;
+    if (totalBytes <= maxCacheBytes) {
+      return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+      return a.lastUsed < b.lastUsed;
+    });
+    for (const auto& entry : entries) {
+      if (totalBytes <= maxCacheBytes) {
+        break;
+      }
+      if (std::filesystem::remove(entry.path, ec)) {
+        totalBytes -= entry.size;
+        evictionCount++;
+      }
+    }
+    knownBytes = totalBytes;
+  }
+
+  void setMaxBytes(uintmax_t maxBytes) {
+    maxCacheBytes = maxBytes;
+    trim();
+  }
+  uintmax_t maxBytes() const { return maxCacheBytes; }
+  const std::filesystem::path& directory() const { return cacheDirectory; }
+
+  uint64_t hits() const { return hitCount; }
+  uint64_t misses() const { return missCount; }
+  uint64_t evictions() const { return evictionCount; }
+
+private:
+  struct EntryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t size; //bytes of payload following the header
+    uint64_t checksum; //fnv1a64 of the payload, catches torn or truncated files
+  };
+
+  //reads a whole entry into out (whose element type decides alignment). Corrupt or truncated entries are removed
+  template <typename T>
+  bool readEntry(uint64_t key, const std::string& extension, std::vector<T>& out) {
+    std::filesystem::path path = pathFor(key, extension);
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      return false;
+    }
+    std::error_code ec;
+    uintmax_t fileSize = std::filesystem::file_size(path, ec);
+    EntryHeader header = {};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    //the size on disk bounds the payload, so a corrupt header can't ask for a huge allocation
+    bool valid = !ec && file.good() && header.magic == SHADER_CACHE_MAGIC && header.version == SHADER_CACHE_VERSION
+                 && header.key == key && header.size == fileSize - sizeof(header) && header.size % sizeof(T) == 0;
+    if (valid) {
+      out.resize(header.size / sizeof(T));
+      file.read(reinterpret_cast<char*>(out.data()), header.size);
+      valid = file.gcount() == static_cast<std::streamsize>(header.size)
+              && fnv1a64(out.data(), header.size) == header.checksum;
+    }
+    file.close();
+    if (!valid) {
+      std::filesystem::remove(path, ec);
+      out.clear();
+      return false;
+    }
+    //touch the entry so trim() evicts least recently used entries first
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+    return true;
+  }
+
+  //writes to a temporary file and renames it into place so concurrent readers never see half an entry
+  void writeEntry(uint64_t key, const std::string& extension, const char* data, size_t size) {
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDirectory, ec);
+    if (ec) {
+      return; //a cache that can't be written is just a cache that always misses
+    }
+    EntryHeader header = {};
+    header.magic = SHADER_CACHE_MAGIC;
+    header.version = SHADER_CACHE_VERSION;
+    header.key = key;
+    header.size = size;
+    header.checksum = fnv1a64(data, size);
+
+    std::filesystem::path path = pathFor(key, extension);
+    std::filesystem::path tempPath = path;
+    tempPath += ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count())
+                + "_" + std::to_string(tempCounter++);
+    {
+      std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+      if (!file.is_open()) {
+        return;
+      }
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.write(data, size);
+      if (!file.good()) {
+        file.close();
+        std::filesystem::remove(tempPath, ec);
+        return;
+      }
+    }
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec) {
+      std::filesystem::remove(tempPath, ec);
+      return;
+    }
+    //overwritten or removed entries and other processes' writes make the total drift; the next scan corrects it
+    {
+      std::lock_guard<std::mutex> lock(trimMutex);
+      if (knownBytes != UNSCANNED) {
+        knownBytes += sizeof(header) + size;
+        if (knownBytes <= maxCacheBytes) {
+          return;
+        }
+      }
+    }
+    trim();
+  }
+
+  std::filesystem::path pathFor(uint64_t key, const std::string& extension) const {
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+    return cacheDirectory / (std::string(name) + extension);
+  }
+
+  std::filesystem::path cacheDirectory;
+  std::atomic<uintmax_t> maxCacheBytes;
+  std::atomic<uint64_t> hitCount{0};
+  std::atomic<uint64_t> missCount{0};
+  std::atomic<uint64_t> evictionCount{0};
+  std::atomic<uint64_t> tempCounter{0};
+  std::mutex trimMutex;
+  static const uintmax_t UNSCANNED = UINTMAX_MAX;
+  uintmax_t knownBytes = UNSCANNED; //bytes in the directory as of the last trim(), plus what's been stored since. Guarded by trimMutex
+};
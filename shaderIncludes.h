@@ -0,0 +1,192 @@
+/*
+ * #include support for shaderc, plus the dependency records that make the shader
+ * cache include aware.
+ *
+ * ShaderIncluder implements shaderc's include callbacks and remembers every file a
+ * compile pulled in (transitively, since nested includes go through it too) along
+ * with a hash of the content it handed to the compiler. Those lists are stored in
+ * the shader cache next to the SPIR-V as <record key>.deps, which is the on-disk
+ * dependency graph: one edge list per shader.
+ *
+ * The cache key of a shader with includes covers the contents of every file it
+ * includes, so an edited include changes the key of exactly the shaders that
+ * (transitively) include it. Before compiling, shaderKeyForSource() rebuilds that
+ * key from the last dependency record and the files as they are on disk now; when
+ * nothing changed it hits the cache and shaderc never runs.
+ */
+#pragma once
+
+#include "shaderCache.h"
+
+#include <shaderc/shaderc.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const char* const SHADER_INCLUDE_DIR = "shaders/include"; //searched for #include <...>, and after the including file's directory for #include "..."
+
+struct ShaderDependency {
+  std::string path; //normalized, relative to the working directory like the shader paths
+  uint64_t contentHash; //fnv1a64 of the content the compiler saw
+};
+
+inline bool readShaderDependency(const std::string& path, std::string& content) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream.is_open()) {
+    return false;
+  }
+  content.assign((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+  return true;
+}
+
+/*
+  One includer per compile at a time: attach() it to the options, compile, then read
+  dependencies(). clear() before reusing it for the next shader.
+*/
+class ShaderIncluder {
+public:
+  explicit ShaderIncluder(std::vector<std::filesystem::path> includeDirectories = {SHADER_INCLUDE_DIR})
+    : includeDirs(std::move(includeDirectories)) {}
+
+  void attach(shaderc_compile_options_t options) {
+    shaderc_compile_options_set_include_callbacks(options, &ShaderIncluder::resolve, &ShaderIncluder::release, this);
+  }
+
+  //every file included since the last clear(), each once, in first-include order
+  const std::vector<ShaderDependency>& dependencies() const { return included; }
+  void clear() { included.clear(); }
+
+private:
+  //owns the strings shaderc_include_result points at
+  struct Result {
+    shaderc_include_result result;
+    std::string name;
+    std::string content;
+  };
+
+  static shaderc_include_result* resolve(void* userData, const char* requestedSource, int type,
+                                         const char* requestingSource, size_t) {
+    ShaderIncluder* includer = static_cast<ShaderIncluder*>(userData);
+    Result* result = new Result();
+    std::vector<std::filesystem::path> candidates;
+    if (type == shaderc_include_type_relative) {
+      candidates.push_back(std::filesystem::path(requestingSource).parent_path() / requestedSource);
+    }
+    for (const auto& directory : includer->includeDirs) {
+      candidates.push_back(directory / requestedSource);
+    }
+    for (const auto& candidate : candidates) {
+      std::string path = candidate.lexically_normal().generic_string();
+      if (readShaderDependency(path, result->content)) {
+        result->name = path;
+        includer->record(path, result->content);
+        break;
+      }
+    }
+    if (result->name.empty()) {
+      //shaderc's convention for a failed include: empty source name, error message as the content
+      result->content = "can't find include file " + std::string(requestedSource);
+    }
+    result->result.source_name = result->name.c_str();
+    result->result.source_name_length = result->name.size();
+    result->result.content = result->content.c_str();
+    result->result.content_length = result->content.size();
+    result->result.user_data = result;
+    return &result->result;
+  }
+
+  static void release(void*, shaderc_include_result* includeResult) {
+    delete static_cast<Result*>(includeResult->user_data);
+  }
+
+  void record(const std::string& path, const std::string& content) {
+    for (const auto& dependency : included) {
+      if (dependency.path == path) {
+        return; //included twice (include guards), hashed once
+      }
+    }
+    included.push_back({path, fnv1a64(content.data(), content.size())});
+  }
+
+  std::vector<std::filesystem::path> includeDirs;
+  std::vector<ShaderDependency> included;
+};
+
+//a shader's cache key: its own key (ShaderCache::makeKey) extended with every include's path and content
+inline uint64_t shaderKeyWithDependencies(uint64_t sourceKey, const std::vector<ShaderDependency>& dependencies) {
+  uint64_t key = sourceKey;
+  for (const auto& dependency : dependencies) {
+    key = fnv1a64(dependency.path.data(), dependency.path.size(), key);
+    key = fnv1a64(&dependency.contentHash, sizeof(dependency.contentHash), key);
+  }
+  return key;
+}
+
+//where a shader's dependency record lives in the cache. Keyed by path, not content, so it survives edits
+inline uint64_t shaderDependencyRecordKey(const std::string& path, shaderc_shader_kind kind) {
+  return ShaderCache::makeKey(path, kind, "main", "dependencies");
+}
+
+//record format: one "<hash> <path>" line per include
+inline void storeShaderDependencies(ShaderCache& cache, const std::string& path, shaderc_shader_kind kind,
+                                    const std::vector<ShaderDependency>& dependencies) {
+  std::ostringstream record;
+  for (const auto& dependency : dependencies) {
+    record << dependency.contentHash << ' ' << dependency.path << '\n';
+  }
+  std::string text = record.str();
+  cache.storeBlob(shaderDependencyRecordKey(path, kind), ".deps", std::vector<char>(text.begin(), text.end()));
+}
+
+inline bool loadShaderDependencies(ShaderCache& cache, const std::string& path, shaderc_shader_kind kind,
+                                   std::vector<ShaderDependency>& dependencies) {
+  std::vector<char> blob;
+  if (!cache.loadBlob(shaderDependencyRecordKey(path, kind), ".deps", blob)) {
+    return false;
+  }
+  dependencies.clear();
+  std::istringstream record(std::string(blob.begin(), blob.end()));
+  ShaderDependency dependency;
+  while (record >> dependency.contentHash && std::getline(record >> std::ws, dependency.path)) {
+    dependencies.push_back(dependency);
+  }
+  return true;
+}
+
+/*
+  The key the shader would get if it were compiled right now, worked out without
+  compiling: the source plus the current content of every include its last compile
+  recorded. If the includes are unchanged, the include set is too (it is decided by
+  the same source and content), so the key is exact. Returns false when only a
+  compile can tell: no record yet, or a recorded include is gone. changedIncludes,
+  if given, collects the includes whose content differs from the record.
+*/
+inline bool shaderKeyForSource(ShaderCache& cache, const std::string& path, const std::string& source,
+                               shaderc_shader_kind kind, const std::string& optionsTag, uint64_t& key,
+                               std::vector<std::string>* changedIncludes = nullptr) {
+  uint64_t sourceKey = ShaderCache::makeKey(source, kind, "main", optionsTag);
+  if (source.find("#include") == std::string::npos) {
+    key = sourceKey; //nothing to record, and no record needed
+    return true;
+  }
+  std::vector<ShaderDependency> dependencies;
+  if (!loadShaderDependencies(cache, path, kind, dependencies)) {
+    return false;
+  }
+  for (auto& dependency : dependencies) {
+    std::string content;
+    if (!readShaderDependency(dependency.path, content)) {
+      return false;
+    }
+    uint64_t contentHash = fnv1a64(content.data(), content.size());
+    if (contentHash != dependency.contentHash && changedIncludes) {
+      changedIncludes->push_back(dependency.path);
+    }
+    dependency.contentHash = contentHash;
+  }
+  key = shaderKeyWithDependencies(sourceKey, dependencies);
+  return true;
+}
@@ -1,10 +1,22 @@
 //FRAG SHADER
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
+#extension GL_GOOGLE_include_directive : require
+
+#include <colorModes.glsl>
+
+//specialization constants: one SPIR-V module serves every variant, the values are
+//picked per pipeline (see getPipelineVariant() in main.cpp)
+layout(constant_id = 0) const int COLOR_MODE = 0; //0 vertex colour, 1 grayscale, 2 inverted
+layout(constant_id = 1) const bool SCANLINES = false; //darken every other pair of rows
 
 layout(location = 0) out vec4 outColor;
 layout(location = 0) in vec3 fragColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    vec3 color = applyColorMode(fragColor, COLOR_MODE);
+    if (SCANLINES && (int(gl_FragCoord.y) & 2) != 0) {
+        color *= 0.5;
+    }
+    outColor = vec4(color, 1.0);
 }
@@ -0,0 +1,19 @@
+//shared colour helpers, #include <colorModes.glsl> (searched for in shaders/include)
+#ifndef COLOR_MODES_GLSL
+#define COLOR_MODES_GLSL
+
+float luminance(vec3 color) {
+    return dot(color, vec3(0.299, 0.587, 0.114));
+}
+
+//mode: 0 unchanged, 1 grayscale, 2 inverted
+vec3 applyColorMode(vec3 color, int mode) {
+    if (mode == 1) {
+        return vec3(luminance(color));
+    } else if (mode == 2) {
+        return vec3(1.0) - color;
+    }
+    return color;
+}
+
+#endif
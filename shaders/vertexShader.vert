@@ -4,9 +4,13 @@
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
 
+//per instance (binding 1), see struct InstanceData
+layout(location = 2) in vec4 inTransform; //xy scale, zw offset
+layout(location = 3) in vec3 inInstanceColor;
+
 layout(location = 0) out vec3 fragColor;
 
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
-    fragColor = inColor;
-}
\ No newline at end of file
+    gl_Position = vec4(inPosition * inTransform.xy + inTransform.zw, 0.0, 1.0);
+    fragColor = inColor * inInstanceColor;
+}
@@ -0,0 +1,390 @@
+/*
+ * Minimal SPIR-V reflection: walks the instruction stream of a compiled shader and
+ * pulls out what the pipeline needs to know about its interface, so nothing has to
+ * be kept in step with the GLSL by hand:
+ *   - vertex inputs (layout(location = N) in ...) with their formats
+ *   - descriptor bindings (layout(set = S, binding = B) uniform/buffer/sampler ...)
+ *   - the push constant block size
+ *   - specialization constants (layout(constant_id = N) const ...) and their defaults
+ * Results can be serialized so they are cached next to the SPIR-V (see main.cpp),
+ * which makes reflection free on a warm start.
+ *
+ * Only the handful of instructions that describe the interface are decoded.
+ * The numbers below come straight from the SPIR-V spec (section 3, "Binary Form").
+ */
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct ReflectedVertexInput {
+  uint32_t location;
+  VkFormat format;
+  uint32_t size; //bytes
+};
+
+struct ReflectedDescriptorBinding {
+  uint32_t set;
+  uint32_t binding;
+  VkDescriptorType type;
+  uint32_t count;
+};
+
+struct ReflectedSpecConstant {
+  uint32_t constantId;
+  uint32_t size; //bytes, 4 for bool (VkBool32), int, uint and float
+  uint32_t defaultValue; //low word of the default in the SPIR-V
+};
+
+struct ShaderReflection {
+  VkShaderStageFlagBits stage = VK_SHADER_STAGE_VERTEX_BIT;
+  std::vector<ReflectedVertexInput> inputs; //sorted by location, vertex shaders only
+  std::vector<ReflectedDescriptorBinding> bindings; //sorted by set then binding
+  uint32_t pushConstantSize = 0; //0 when the shader has no push constant block
+  std::vector<ReflectedSpecConstant> specConstants; //sorted by constantId
+};
+
+namespace spirv_reflect_detail {
+  //opcodes
+  const uint32_t OpEntryPoint = 15, OpTypeBool = 20, OpTypeInt = 21, OpTypeFloat = 22, OpTypeVector = 23,
+                 OpTypeMatrix = 24, OpTypeImage = 25, OpTypeSampler = 26, OpTypeSampledImage = 27,
+                 OpTypeArray = 28, OpTypeRuntimeArray = 29, OpTypeStruct = 30, OpTypePointer = 32,
+                 OpConstant = 43, OpSpecConstantTrue = 48, OpSpecConstantFalse = 49, OpSpecConstant = 50,
+                 OpVariable = 59, OpDecorate = 71, OpMemberDecorate = 72;
+  //decorations
+  const uint32_t DecorationSpecId = 1, DecorationBlock = 2, DecorationBufferBlock = 3, DecorationArrayStride = 6,
+                 DecorationMatrixStride = 7, DecorationBuiltIn = 11, DecorationLocation = 30,
+                 DecorationBinding = 33, DecorationDescriptorSet = 34, DecorationOffset = 35;
+  //storage classes
+  const uint32_t StorageUniformConstant = 0, StorageInput = 1, StorageUniform = 2,
+                 StoragePushConstant = 9, StorageStorageBuffer = 12;
+  //image dimensionality that means "input attachment"
+  const uint32_t DimSubpassData = 6;
+
+  //everything we learn about one result id
+  struct Id {
+    uint32_t opcode = 0;
+    uint32_t typeId = 0; //pointee, component, column or element type
+    uint32_t storageClass = 0;
+    uint32_t count = 0; //vector components, matrix columns, or (for arrays) the id of the length constant
+    uint32_t width = 0; //int/float bits
+    bool isSigned = false;
+    uint32_t value = 0; //OpConstant/OpSpecConstant, low word
+    bool isSpecConstant = false;
+    uint32_t imageDim = 0;
+    uint32_t imageSampled = 0;
+    std::vector<uint32_t> members;
+    std::vector<uint32_t> memberOffsets;
+    std::vector<uint32_t> memberMatrixStrides;
+    bool hasLocation = false, hasBinding = false, hasSet = false, hasSpecId = false;
+    bool builtIn = false, block = false, bufferBlock = false;
+    uint32_t location = 0, binding = 0, set = 0, arrayStride = 0, specId = 0;
+  };
+
+  inline uint32_t typeSize(const std::vector<Id>& ids, uint32_t typeId, uint32_t matrixStride = 0, int depth = 0) {
+    if (typeId >= ids.size() || depth > 32) {
+      throw std::runtime_error("reflectSpirv: malformed type");
+    }
+    const Id& type = ids[typeId];
+    switch (type.opcode) {
+      case OpTypeBool: return 4;
+      case OpTypeInt:
+      case OpTypeFloat: return type.width / 8;
+      case OpTypeVector: return type.count * typeSize(ids, type.typeId, 0, depth + 1);
+      case OpTypeMatrix: return type.count * (matrixStride ? matrixStride : typeSize(ids, type.typeId, 0, depth + 1));
+      case OpTypeArray: {
+        uint32_t length = type.count < ids.size() ? ids[type.count].value : 0;
+        return length * (type.arrayStride ? type.arrayStride : typeSize(ids, type.typeId, 0, depth + 1));
+      }
+      case OpTypeStruct: {
+        uint32_t size = 0;
+        for (size_t i = 0; i < type.members.size(); i++) {
+          uint32_t memberEnd = type.memberOffsets[i] + typeSize(ids, type.members[i], type.memberMatrixStrides[i], depth + 1);
+          size = std::max(size, memberEnd);
+        }
+        return size;
+      }
+      default: return 0; //runtime arrays, opaque types
+    }
+  }
+
+  inline VkFormat vertexFormat(const std::vector<Id>& ids, uint32_t typeId) {
+    const Id& type = ids[typeId];
+    uint32_t components = 1;
+    const Id* scalar = &type;
+    if (type.opcode == OpTypeVector) {
+      components = type.count;
+      scalar = &ids[type.typeId];
+    }
+    if (scalar->width != 32) {
+      throw std::runtime_error("reflectSpirv: only 32 bit vertex inputs are supported");
+    }
+    static const VkFormat floatFormats[] = {VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT};
+    static const VkFormat intFormats[] = {VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT};
+    static const VkFormat uintFormats[] = {VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT};
+    if (components < 1 || components > 4) {
+      throw std::runtime_error("reflectSpirv: unsupported vertex input vector size");
+    }
+    if (scalar->opcode == OpTypeFloat) return floatFormats[components - 1];
+    if (scalar->opcode == OpTypeInt) return scalar->isSigned ? intFormats[components - 1] : uintFormats[components - 1];
+    throw std::runtime_error("reflectSpirv: unsupported vertex input type (matrices take one location per column)");
+  }
+
+  inline VkShaderStageFlagBits stageForExecutionModel(uint32_t model) {
+    switch (model) {
+      case 0: return VK_SHADER_STAGE_VERTEX_BIT;
+      case 3: return VK_SHADER_STAGE_GEOMETRY_BIT;
+      case 4: return VK_SHADER_STAGE_FRAGMENT_BIT;
+      case 5: return VK_SHADER_STAGE_COMPUTE_BIT;
+      default: throw std::runtime_error("reflectSpirv: unsupported execution model");
+    }
+  }
+}
+
+//codeSize is in bytes, like VkShaderModuleCreateInfo::codeSize. Throws on malformed SPIR-V
+inline ShaderReflection reflectSpirv(const uint32_t* code, size_t codeSize) {
+  using namespace spirv_reflect_detail;
+  size_t wordCount = codeSize / sizeof(uint32_t);
+  if (wordCount < 5 || code[0] != 0x07230203) {
+    throw std::runtime_error("reflectSpirv: not a SPIR-V module");
+  }
+  std::vector<Id> ids(code[3]); //word 3 of the header is the id bound
+  auto id = [&ids](uint32_t value) -> Id& {
+    if (value >= ids.size()) {
+      throw std::runtime_error("reflectSpirv: id out of bounds");
+    }
+    return ids[value];
+  };
+
+  ShaderReflection reflection;
+  bool haveEntryPoint = false;
+  for (size_t i = 5; i < wordCount; ) {
+    uint32_t length = code[i] >> 16;
+    uint32_t opcode = code[i] & 0xffff;
+    if (length == 0 || i + length > wordCount) {
+      throw std::runtime_error("reflectSpirv: truncated instruction");
+    }
+    const uint32_t* op = code + i;
+    switch (opcode) {
+      case OpEntryPoint:
+        if (!haveEntryPoint && length >= 3) {
+          reflection.stage = stageForExecutionModel(op[1]);
+          haveEntryPoint = true;
+        }
+        break;
+      case OpTypeBool:
+        id(op[1]).opcode = opcode;
+        break;
+      case OpTypeInt:
+        id(op[1]).opcode = opcode;
+        id(op[1]).width = op[2];
+        id(op[1]).isSigned = op[3] != 0;
+        break;
+      case OpTypeFloat:
+        id(op[1]).opcode = opcode;
+        id(op[1]).width = op[2];
+        break;
+      case OpTypeVector:
+      case OpTypeMatrix:
+      case OpTypeArray:
+        id(op[1]).opcode = opcode;
+        id(op[1]).typeId = op[2];
+        id(op[1]).count = op[3];
+        break;
+      case OpTypeRuntimeArray:
+      case OpTypeSampledImage:
+        id(op[1]).opcode = opcode;
+        id(op[1]).typeId = op[2];
+        break;
+      case OpTypeImage:
+        id(op[1]).opcode = opcode;
+        id(op[1]).imageDim = op[3];
+        id(op[1]).imageSampled = op[7];
+        break;
+      case OpTypeSampler:
+        id(op[1]).opcode = opcode;
+        break;
+      case OpTypeStruct: {
+        Id& type = id(op[1]);
+        type.opcode = opcode;
+        type.members.assign(op + 2, op + length);
+        type.memberOffsets.resize(type.members.size(), 0);
+        type.memberMatrixStrides.resize(type.members.size(), 0);
+        break;
+      }
+      case OpTypePointer:
+        id(op[1]).opcode = opcode;
+        id(op[1]).storageClass = op[2];
+        id(op[1]).typeId = op[3];
+        break;
+      case OpConstant:
+        id(op[2]).opcode = opcode;
+        id(op[2]).typeId = op[1];
+        id(op[2]).value = op[3];
+        break;
+      case OpSpecConstantTrue:
+      case OpSpecConstantFalse:
+      case OpSpecConstant:
+        id(op[2]).opcode = opcode;
+        id(op[2]).typeId = op[1];
+        id(op[2]).value = opcode == OpSpecConstant ? op[3] : (opcode == OpSpecConstantTrue ? 1 : 0);
+        id(op[2]).isSpecConstant = true;
+        break;
+      case OpVariable:
+        id(op[2]).opcode = opcode;
+        id(op[2]).typeId = op[1];
+        id(op[2]).storageClass = op[3];
+        break;
+      case OpDecorate: {
+        Id& target = id(op[1]);
+        uint32_t literal = length > 3 ? op[3] : 0;
+        switch (op[2]) {
+          case DecorationBlock: target.block = true; break;
+          case DecorationBufferBlock: target.bufferBlock = true; break;
+          case DecorationArrayStride: target.arrayStride = literal; break;
+          case DecorationBuiltIn: target.builtIn = true; break;
+          case DecorationLocation: target.hasLocation = true; target.location = literal; break;
+          case DecorationBinding: target.hasBinding = true; target.binding = literal; break;
+          case DecorationDescriptorSet: target.hasSet = true; target.set = literal; break;
+          case DecorationSpecId: target.hasSpecId = true; target.specId = literal; break;
+        }
+        break;
+      }
+      case OpMemberDecorate: {
+        //struct types are declared after their decorations, so size the member arrays on demand
+        Id& target = id(op[1]);
+        uint32_t member = op[2];
+        if (target.memberOffsets.size() <= member) {
+          target.memberOffsets.resize(member + 1, 0);
+          target.memberMatrixStrides.resize(member + 1, 0);
+        }
+        if (op[3] == DecorationOffset && length > 4) target.memberOffsets[member] = op[4];
+        if (op[3] == DecorationMatrixStride && length > 4) target.memberMatrixStrides[member] = op[4];
+        if (op[3] == DecorationBuiltIn) target.builtIn = true; //gl_PerVertex and friends
+        break;
+      }
+    }
+    i += length;
+  }
+  if (!haveEntryPoint) {
+    throw std::runtime_error("reflectSpirv: no entry point");
+  }
+
+  for (uint32_t v = 0; v < ids.size(); v++) {
+    const Id& variable = ids[v];
+    if (variable.isSpecConstant && variable.hasSpecId) {
+      reflection.specConstants.push_back({variable.specId, typeSize(ids, variable.typeId), variable.value});
+      continue;
+    }
+    if (variable.opcode != OpVariable) {
+      continue;
+    }
+    const Id& pointer = id(variable.typeId);
+    uint32_t typeId = pointer.typeId;
+    const Id& type = id(typeId);
+    switch (variable.storageClass) {
+      case StorageInput:
+        if (reflection.stage == VK_SHADER_STAGE_VERTEX_BIT && variable.hasLocation && !variable.builtIn && !type.builtIn) {
+          reflection.inputs.push_back({variable.location, vertexFormat(ids, typeId), typeSize(ids, typeId)});
+        }
+        break;
+      case StoragePushConstant:
+        reflection.pushConstantSize = std::max(reflection.pushConstantSize, typeSize(ids, typeId));
+        break;
+      case StorageUniformConstant:
+      case StorageUniform:
+      case StorageStorageBuffer: {
+        //unwrap arrays of resources: layout(binding = 0) uniform sampler2D textures[4];
+        uint32_t count = 1;
+        const Id* resource = &type;
+        if (resource->opcode == OpTypeArray) {
+          count = id(resource->count).value;
+          resource = &id(resource->typeId);
+        } else if (resource->opcode == OpTypeRuntimeArray) {
+          resource = &id(resource->typeId);
+        }
+        VkDescriptorType descriptorType;
+        if (variable.storageClass == StorageStorageBuffer || resource->bufferBlock) {
+          descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        } else if (variable.storageClass == StorageUniform) {
+          descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        } else if (resource->opcode == OpTypeSampledImage) {
+          descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        } else if (resource->opcode == OpTypeSampler) {
+          descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+        } else if (resource->opcode == OpTypeImage && resource->imageDim == DimSubpassData) {
+          descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        } else if (resource->opcode == OpTypeImage && resource->imageSampled == 2) {
+          descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        } else if (resource->opcode == OpTypeImage) {
+          descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+        } else {
+          continue; //not something that lives in a descriptor set
+        }
+        reflection.bindings.push_back({variable.set, variable.binding, descriptorType, count});
+        break;
+      }
+    }
+  }
+  std::sort(reflection.inputs.begin(), reflection.inputs.end(), [](const ReflectedVertexInput& a, const ReflectedVertexInput& b) {
+    return a.location < b.location;
+  });
+  std::sort(reflection.bindings.begin(), reflection.bindings.end(), [](const ReflectedDescriptorBinding& a, const ReflectedDescriptorBinding& b) {
+    return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+  });
+  std::sort(reflection.specConstants.begin(), reflection.specConstants.end(), [](const ReflectedSpecConstant& a, const ReflectedSpecConstant& b) {
+    return a.constantId < b.constantId;
+  });
+  return reflection;
+}
+
+/**** cache serialization ****/
+const uint32_t SHADER_REFLECTION_VERSION = 2; //bump when ShaderReflection changes shape
+
+inline std::vector<char> serializeReflection(const ShaderReflection& reflection) {
+  std::vector<char> bytes;
+  auto put = [&bytes](const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    bytes.insert(bytes.end(), p, p + size);
+  };
+  uint32_t header[6] = {SHADER_REFLECTION_VERSION, static_cast<uint32_t>(reflection.stage), reflection.pushConstantSize,
+                        static_cast<uint32_t>(reflection.inputs.size()), static_cast<uint32_t>(reflection.bindings.size()),
+                        static_cast<uint32_t>(reflection.specConstants.size())};
+  put(header, sizeof(header));
+  put(reflection.inputs.data(), reflection.inputs.size() * sizeof(ReflectedVertexInput));
+  put(reflection.bindings.data(), reflection.bindings.size() * sizeof(ReflectedDescriptorBinding));
+  put(reflection.specConstants.data(), reflection.specConstants.size() * sizeof(ReflectedSpecConstant));
+  return bytes;
+}
+
+//false if the blob was written by a different version or is the wrong size
+inline bool deserializeReflection(const std::vector<char>& bytes, ShaderReflection& reflection) {
+  uint32_t header[6];
+  if (bytes.size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(header, bytes.data(), sizeof(header));
+  size_t expected = sizeof(header) + header[3] * sizeof(ReflectedVertexInput) + header[4] * sizeof(ReflectedDescriptorBinding)
+                    + header[5] * sizeof(ReflectedSpecConstant);
+  if (header[0] != SHADER_REFLECTION_VERSION || bytes.size() != expected) {
+    return false;
+  }
+  const char* p = bytes.data() + sizeof(header);
+  reflection.stage = static_cast<VkShaderStageFlagBits>(header[1]);
+  reflection.pushConstantSize = header[2];
+  reflection.inputs.resize(header[3]);
+  std::memcpy(reflection.inputs.data(), p, header[3] * sizeof(ReflectedVertexInput));
+  p += header[3] * sizeof(ReflectedVertexInput);
+  reflection.bindings.resize(header[4]);
+  std::memcpy(reflection.bindings.data(), p, header[4] * sizeof(ReflectedDescriptorBinding));
+  p += header[4] * sizeof(ReflectedDescriptorBinding);
+  reflection.specConstants.resize(header[5]);
+  std::memcpy(reflection.specConstants.data(), p, header[5] * sizeof(ReflectedSpecConstant));
+  return true;
+}
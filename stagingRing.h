@@ -0,0 +1,140 @@
+/*
+ * Uploads into DEVICE_LOCAL buffers. The GPU reads device local memory at full
+ * speed, but on a discrete card the CPU usually can't write it, so data goes
+ * through a host visible staging buffer and a vkCmdCopyBuffer.
+ *
+ * StagingRing is one persistently mapped staging buffer used as a ring. upload()
+ * copies the data to the head of the ring and queues a copy; recordCopies() writes
+ * every queued copy of the frame into one command buffer (grouped per destination,
+ * one barrier for all of them) that is submitted ahead of the frame's draw.
+ * Staging space is reused once the frame that copied out of it is known to be
+ * finished, which is exactly what the per-frame in-flight fence already tells us:
+ * call beginFrame(frame) right after waiting on that frame's fence.
+ *
+ * When the ring is full, upload() returns false and the caller tries again next
+ * frame; the frames in flight free space as they complete.
+ */
+#pragma once
+
+#include "gpuAllocator.h"
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+const VkDeviceSize STAGING_RING_SIZE = 16ull * 1024 * 1024;
+
+class StagingRing {
+public:
+  void init(GpuAllocator& gpuAllocator, VkDeviceSize capacity, uint32_t frameCount) {
+    allocator = &gpuAllocator;
+    ringSize = capacity;
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = capacity;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    allocation = allocator->createBuffer(bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer,
+                                         GpuMemoryCategory::Staging);
+    frameEnds.assign(frameCount, 0);
+    head = tail = 0;
+  }
+
+  void destroy() {
+    if (allocator && buffer != VK_NULL_HANDLE) {
+      allocator->destroyBuffer(buffer, allocation);
+    }
+    pending.clear();
+  }
+
+  //frame's fence has signalled, so everything it copied out of the ring is done (and everything before it, queues complete in order)
+  void beginFrame(uint32_t frame) {
+    currentFrame = frame;
+    tail = std::max(tail, frameEnds[frame]);
+  }
+
+  //false if the ring has no room right now (try next frame), or never will (bigger than the ring)
+  bool upload(VkBuffer destination, VkDeviceSize destinationOffset, const void* data, VkDeviceSize size) {
+    if (size == 0) {
+      return true;
+    }
+    if (size > ringSize) {
+      return false;
+    }
+    uint64_t start = alignUp(head, STAGING_ALIGNMENT);
+    if (start % ringSize + size > ringSize) {
+      start += ringSize - start % ringSize; //doesn't fit before the end, skip to the start of the ring
+    }
+    if (start + size - tail > ringSize) {
+      fullCount++;
+      return false;
+    }
+    VkDeviceSize ringOffset = start % ringSize;
+    std::memcpy(static_cast<char*>(allocation.mapped) + ringOffset, data, size);
+    pending[destination].push_back({ringOffset, destinationOffset, size});
+    head = start + size;
+    uploadedBytes += size;
+    return true;
+  }
+
+  bool hasPendingCopies() const { return !pending.empty(); }
+
+  //drops the copies queued into destination, which is about to be destroyed; its staged bytes are reclaimed along with the next copies recorded
+  void cancel(VkBuffer destination) {
+    pending.erase(destination);
+  }
+
+  /*
+    One vkCmdCopyBuffer per destination buffer, then one barrier that makes all of
+    the copies visible to the stages that read them (dstStages/dstAccess, e.g.
+    vertex input / vertex attribute read). The staged bytes belong to the current
+    frame from here on, until beginFrame() sees that frame again.
+  */
+  void recordCopies(VkCommandBuffer commandBuffer, VkPipelineStageFlags dstStages, VkAccessFlags dstAccess) {
+    if (pending.empty()) {
+      return;
+    }
+    for (const auto& copies : pending) {
+      vkCmdCopyBuffer(commandBuffer, buffer, copies.first, static_cast<uint32_t>(copies.second.size()), copies.second.data());
+      copyCount += copies.second.size();
+    }
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = dstAccess;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    pending.clear();
+    frameEnds[currentFrame] = head;
+  }
+
+  VkDeviceSize capacity() const { return ringSize; }
+  uint64_t bytesUploaded() const { return uploadedBytes; }
+  uint64_t copiesRecorded() const { return copyCount; }
+  uint64_t timesFull() const { return fullCount; } //upload() calls that had to wait for a frame to finish
+
+private:
+  static const VkDeviceSize STAGING_ALIGNMENT = 16; //keeps memcpy destinations aligned; copies themselves need none
+
+  static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  GpuAllocator* allocator = nullptr;
+  VkBuffer buffer = VK_NULL_HANDLE;
+  GpuAllocation allocation;
+  VkDeviceSize ringSize = 0;
+  //positions only ever grow; the ring offset is position % ringSize. Bytes in [tail, head) may still be read by the GPU
+  uint64_t head = 0;
+  uint64_t tail = 0;
+  std::vector<uint64_t> frameEnds; //head when each frame recorded its copies
+  uint32_t currentFrame = 0;
+  std::map<VkBuffer, std::vector<VkBufferCopy>> pending; //by destination, queued since the last recordCopies()
+  uint64_t uploadedBytes = 0;
+  uint64_t copyCount = 0;
+  uint64_t fullCount = 0;
+};
@@ -0,0 +1,181 @@
+/*
+ * Scoped wall-clock timing for startup (and anything else worth a look), written
+ * out as a Chrome trace-event JSON file. Open it in chrome://tracing or
+ * https://ui.perfetto.dev to see every stage on a per-thread timeline.
+ *
+ *   {
+ *     ProfileScope scope("createInstance");
+ *     ...
+ *   } //recorded when the scope ends
+ *
+ * Recording is a mutex and a vector push, cheap enough to leave in release builds.
+ * Scopes can be opened on any thread; each thread gets its own row in the trace.
+ * summaryJson() aggregates the same events into one line of JSON per run so
+ * startup numbers can be collected and compared across runs and hosts.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class StartupProfiler {
+public:
+  struct Event {
+    std::string name;
+    const char* category;
+    double startUs; //since the profiler was created
+    double durationUs; //negative for instant events (marks)
+    int thread;
+  };
+
+  //one per process, created on first use, which is as close to launch as we can get without platform calls
+  static StartupProfiler& instance() {
+    static StartupProfiler profiler;
+    return profiler;
+  }
+
+  double nowUs() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  void record(const std::string& name, const char* category, double startUs, double durationUs) {
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    events.push_back({name, category, startUs, durationUs, threadIndex()});
+  }
+
+  //a point in time rather than a span, e.g. "first frame"
+  void mark(const std::string& name, const char* category = "mark") {
+    record(name, category, nowUs(), -1.0);
+  }
+
+  //false if the file can't be written; profiling is never worth failing the app over
+  bool writeChromeTrace(const std::string& path) {
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    std::ofstream file(path, std::ios::trunc);
+    if (!file.is_open()) {
+      return false;
+    }
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (size_t i = 0; i < events.size(); i++) {
+      const Event& event = events[i];
+      file << "{\"name\":\"" << escape(event.name) << "\",\"cat\":\"" << event.category << "\",\"pid\":1,\"tid\":" << event.thread
+           << ",\"ts\":" << fixed(event.startUs);
+      if (event.durationUs < 0.0) {
+        file << ",\"ph\":\"i\",\"s\":\"g\"}";
+      } else {
+        file << ",\"ph\":\"X\",\"dur\":" << fixed(event.durationUs) << "}";
+      }
+      file << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    file << "]}\n";
+    return file.good();
+  }
+
+  /*
+    One line, e.g.
+      {"total_ms":412.3,"marks":{"first frame":409.8},"stages":[{"name":"createInstance","cat":"init","count":1,"total_ms":35.1,"max_ms":35.1},...]}
+    Stages with the same name are summed (count says how often they ran), in order of first appearance.
+  */
+  std::string summaryJson() {
+    std::lock_guard<std::mutex> lock(eventsMutex);
+    struct Stage {
+      std::string name;
+      const char* category;
+      size_t count = 0;
+      double totalUs = 0.0;
+      double maxUs = 0.0;
+    };
+    std::vector<Stage> stages;
+    std::map<std::string, size_t> stageIndex;
+    std::ostringstream marks;
+    double endUs = 0.0;
+    for (const Event& event : events) {
+      endUs = std::max(endUs, event.startUs + std::max(event.durationUs, 0.0));
+      if (event.durationUs < 0.0) {
+        marks << (marks.tellp() > 0 ? "," : "") << "\"" << escape(event.name) << "\":" << fixed(event.startUs / 1000.0);
+        continue;
+      }
+      auto found = stageIndex.find(event.name);
+      if (found == stageIndex.end()) {
+        found = stageIndex.emplace(event.name, stages.size()).first;
+        stages.push_back({event.name, event.category});
+      }
+      Stage& stage = stages[found->second];
+      stage.count++;
+      stage.totalUs += event.durationUs;
+      stage.maxUs = std::max(stage.maxUs, event.durationUs);
+    }
+    std::ostringstream summary;
+    summary << "{\"total_ms\":" << fixed(endUs / 1000.0) << ",\"marks\":{" << marks.str() << "},\"stages\":[";
+    for (size_t i = 0; i < stages.size(); i++) {
+      summary << (i ? "," : "") << "{\"name\":\"" << escape(stages[i].name) << "\",\"cat\":\"" << stages[i].category
+              << "\",\"count\":" << stages[i].count << ",\"total_ms\":" << fixed(stages[i].totalUs / 1000.0)
+              << ",\"max_ms\":" << fixed(stages[i].maxUs / 1000.0) << "}";
+    }
+    summary << "]}";
+    return summary.str();
+  }
+
+private:
+  StartupProfiler() : origin(std::chrono::steady_clock::now()) {}
+
+  //small stable ids read better in the trace viewer than hashed std::thread::ids
+  int threadIndex() {
+    static std::atomic<int> nextThread{1};
+    thread_local int index = nextThread++;
+    return index;
+  }
+
+  static std::string fixed(double value) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.3f", value);
+    return text;
+  }
+
+  static std::string escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+        escaped += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char code[8];
+        std::snprintf(code, sizeof(code), "\\u%04x", c);
+        escaped += code;
+      } else {
+        escaped += c;
+      }
+    }
+    return escaped;
+  }
+
+  std::chrono::steady_clock::time_point origin;
+  std::mutex eventsMutex;
+  std::vector<Event> events;
+};
+
+//times its own lifetime. name is copied, so a temporary string is fine
+class ProfileScope {
+public:
+  explicit ProfileScope(std::string scopeName, const char* scopeCategory = "init")
+    : name(std::move(scopeName)), category(scopeCategory), startUs(StartupProfiler::instance().nowUs()) {}
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+  ~ProfileScope() {
+    StartupProfiler& profiler = StartupProfiler::instance();
+    profiler.record(name, category, startUs, profiler.nowUs() - startUs);
+  }
+
+private:
+  std::string name;
+  const char* category;
+  double startUs;
+};